@@ -39,6 +39,22 @@ JNIEXPORT void JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nStop
 JNIEXPORT jlong JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nOpen
   (JNIEnv *, jclass, jstring, jboolean, jint, jint, jint, jint, jint, jboolean, jboolean, jint);
 
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nOpenEx
+ * Signature: (Ljava/lang/String;ZIIIIIZZII)J
+ */
+JNIEXPORT jlong JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nOpenEx
+  (JNIEnv *, jclass, jstring, jboolean, jint, jint, jint, jint, jint, jboolean, jboolean, jint, jint);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nOpenLatency
+ * Signature: (Ljava/lang/String;ZIIIIIZZIII[I)J
+ */
+JNIEXPORT jlong JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nOpenLatency
+  (JNIEnv *, jclass, jstring, jboolean, jint, jint, jint, jint, jint, jboolean, jboolean, jint, jint, jint, jintArray);
+
 /*
  * Class:     com_cleansine_sound_provider_SimpleMixer
  * Method:    nClose
@@ -63,6 +79,62 @@ JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nRead
 JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nWrite
   (JNIEnv *, jclass, jlong, jbyteArray, jint, jint);
 
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nReadStamped
+ * Signature: (J[BII[J)I
+ */
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nReadStamped
+  (JNIEnv *, jclass, jlong, jbyteArray, jint, jint, jlongArray);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nReadDirect
+ * Signature: (JLjava/nio/ByteBuffer;II)I
+ */
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nReadDirect
+  (JNIEnv *, jclass, jlong, jobject, jint, jint);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nWriteDirect
+ * Signature: (JLjava/nio/ByteBuffer;II)I
+ */
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nWriteDirect
+  (JNIEnv *, jclass, jlong, jobject, jint, jint);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nReadFloat
+ * Signature: (J[FII)I
+ */
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nReadFloat
+  (JNIEnv *, jclass, jlong, jfloatArray, jint, jint);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nWriteFloat
+ * Signature: (J[FII)I
+ */
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nWriteFloat
+  (JNIEnv *, jclass, jlong, jfloatArray, jint, jint);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nReadFloatDirect
+ * Signature: (JLjava/nio/ByteBuffer;II)I
+ */
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nReadFloatDirect
+  (JNIEnv *, jclass, jlong, jobject, jint, jint);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nWriteFloatDirect
+ * Signature: (JLjava/nio/ByteBuffer;II)I
+ */
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nWriteFloatDirect
+  (JNIEnv *, jclass, jlong, jobject, jint, jint);
+
 /*
  * Class:     com_cleansine_sound_provider_SimpleMixer
  * Method:    nGetBufferBytes
@@ -79,6 +151,46 @@ JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetBufferB
 JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetAvailBytes
   (JNIEnv *, jclass, jlong, jboolean);
 
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nGetMeter
+ * Signature: (J[F)I
+ */
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetMeter
+  (JNIEnv *, jclass, jlong, jfloatArray);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nGetMeterBuffer
+ * Signature: (J)Ljava/nio/ByteBuffer;
+ */
+JNIEXPORT jobject JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetMeterBuffer
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nSetGain
+ * Signature: (JFI)Z
+ */
+JNIEXPORT jboolean JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nSetGain
+  (JNIEnv *, jclass, jlong, jfloat, jint);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nSetMute
+ * Signature: (JZI)Z
+ */
+JNIEXPORT jboolean JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nSetMute
+  (JNIEnv *, jclass, jlong, jboolean, jint);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nWaitAvail
+ * Signature: (JZII)I
+ */
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nWaitAvail
+  (JNIEnv *, jclass, jlong, jboolean, jint, jint);
+
 /*
  * Class:     com_cleansine_sound_provider_SimpleMixer
  * Method:    nDrain
@@ -103,6 +215,30 @@ JNIEXPORT void JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nFlush
 JNIEXPORT jlong JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetBytePos
   (JNIEnv *, jclass, jlong, jboolean, jlong);
 
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nGetPosition
+ * Signature: (JZ[J)Z
+ */
+JNIEXPORT jboolean JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetPosition
+  (JNIEnv *, jclass, jlong, jboolean, jlongArray);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nRefreshStatus
+ * Signature: (JZ)I
+ */
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nRefreshStatus
+  (JNIEnv *, jclass, jlong, jboolean);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixer
+ * Method:    nGetStatusBuffer
+ * Signature: (J)Ljava/nio/ByteBuffer;
+ */
+JNIEXPORT jobject JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetStatusBuffer
+  (JNIEnv *, jclass, jlong);
+
 #ifdef __cplusplus
 }
 #endif
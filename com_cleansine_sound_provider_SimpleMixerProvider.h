@@ -45,6 +45,22 @@ JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixerProvider_nGe
 JNIEXPORT jobject JNICALL Java_com_cleansine_sound_provider_SimpleMixerProvider_nCreateMixerInfo
   (JNIEnv *, jclass, jint);
 
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixerProvider
+ * Method:    nGetAllMixerInfos
+ * Signature: ()[Lcom/cleansine/sound/provider/SimpleMixerInfo;
+ */
+JNIEXPORT jobjectArray JNICALL Java_com_cleansine_sound_provider_SimpleMixerProvider_nGetAllMixerInfos
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     com_cleansine_sound_provider_SimpleMixerProvider
+ * Method:    nProbeAllFormats
+ * Signature: ()I
+ */
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixerProvider_nProbeAllFormats
+  (JNIEnv *, jclass);
+
 #ifdef __cplusplus
 }
 #endif
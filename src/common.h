@@ -3,6 +3,7 @@
 
 #include <alsa/asoundlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <jni.h>
 
 #include "config.h"
@@ -13,8 +14,6 @@
 #define NOT_SPECIFIED   -1
 
 typedef struct {
-	// used when walking descs to find a desc with required idx
-	int down_counter;
     char deviceID[STR_LEN+1];
     INT32 maxLines;
     char name[STR_LEN+1];
@@ -22,6 +21,208 @@ typedef struct {
     char description[STR_LEN+1];
 } MixerDesc;
 
+// one format in the order of params of java SimpleMixer.addFormat
+typedef struct {
+    int sampleSignBits;
+    int frameBytes;
+    int channels;
+    int rate;
+    int enc;
+    int isSigned;
+    int isBigEndian;
+} AudioFmt;
+
+typedef struct {
+    AudioFmt* fmts;
+    int cnt;
+    int capacity;
+} FmtList;
+
+// formats of one device and direction
+typedef struct {
+    char deviceID[STR_LEN + 1];
+    int isSource;
+    FmtList list;
+} FmtEntry;
+
+typedef struct {
+    FmtEntry* entries;
+    int cnt;
+    int capacity;
+} FmtCache;
+
+// flags of doOpen, same values as in java SimpleMixer
+// playback/capture through a native ring, serviced by a real-time thread
+#define OPEN_FLAG_RING      0x01
+// TPDF dither in float -> 16/24 bit conversion
+#define OPEN_FLAG_DITHER    0x02
+// resampling quality if the device cannot run at the requested rate, none = open fails
+#define OPEN_FLAG_RESAMPLE_FAST     0x04
+#define OPEN_FLAG_RESAMPLE_MEDIUM   0x08
+#define OPEN_FLAG_RESAMPLE_BEST     0x0C
+#define OPEN_FLAG_RESAMPLE_MASK     0x0C
+// per-channel peak/RMS of the written/read data
+#define OPEN_FLAG_METER     0x10
+// OPEN_FLAG_RING with a large device buffer refilled by a timer instead of period wakeups
+#define OPEN_FLAG_TSCHED    0x20
+
+typedef struct {
+    char* data;
+    int size;
+    // ever-increasing byte positions
+    UINT64 readPos;
+    UINT64 writePos;
+} Ring;
+
+// capture ring: data [startPos, endPos) of the ring, first frame captured at startNs (CLOCK_MONOTONIC)
+typedef struct {
+    UINT64 startPos;
+    UINT64 endPos;
+    INT64 startNs;
+    // frames lost right before this chunk
+    INT64 droppedFrames;
+} ChunkStamp;
+
+// returned by doReadStamped
+typedef struct {
+    INT64 droppedFrames;
+    INT64 tstampNs;
+} ReadStamp;
+
+// float <-> integer PCM conversion of one stream
+typedef struct {
+    // 2, 3 (packed 24 bits) or 4 bytes
+    int sampleBytes;
+    // full scale of the integer samples, max. float value converted to integer
+    float scale;
+    float maxVal;
+    float invScale;
+    // 8 for 24 bits in the low bytes of 32-bit samples
+    int shift;
+    short int isDither;
+    // xorshift state of each vector lane
+    UINT32 ditherState[8];
+} Converter;
+
+// gain of the write path, see gain.c
+typedef struct {
+    // target gain and ramp frames requested by the controlling thread
+    UINT64 request;
+    // state of the writing thread
+    UINT64 appliedRequest;
+    float current;
+    float target;
+    float step;
+    int rampLeft;
+    // set under the PcmInfo lock
+    float level;
+    short int isMuted;
+} Gain;
+
+// published levels, also shared with java as a direct ByteBuffer (native byte order).
+// Owned by the registry slot and never freed, see registry.c
+typedef struct {
+    // odd while the levels are being updated
+    UINT32 seq;
+    INT32 channels;
+    // generation of the line handle (high 32 bits), 0 once the line is closed
+    UINT32 generation;
+    // peak and RMS of each channel, full scale = 1.0
+    float levels[];
+} MeterSnapshot;
+
+typedef struct {
+    int channels;
+    // accumulator lanes, a multiple of channels and of the vector width
+    int stride;
+    int windowFrames;
+    // frames accumulated in the current window
+    int frames;
+    float* peak;
+    float* sumSq;
+    // integer samples converted to float
+    float* chunk;
+    int chunkSamples;
+    // the snapshot of the registry slot, set by registerPcm
+    MeterSnapshot* snapshot;
+    int snapshotBytes;
+    // snapshot seq when attached, readMeter counts the windows of this line only
+    UINT32 seqBase;
+} Meter;
+
+// result of doGetPosition, frames at the java rate
+typedef struct {
+    // frames played (playback) or captured (capture) since open
+    INT64 framePos;
+    // frames between java and the DAC/ADC - device delay incl. hardware delay, ring and resampler
+    INT64 delayFrames;
+    // CLOCK_MONOTONIC time of framePos
+    INT64 tstampNs;
+    // audio time of the device position reported by the driver, 0 if not available
+    INT64 audioTstampNs;
+} PcmPosition;
+
+// doOpen target of the latency negotiation
+typedef struct {
+    // device buffer time
+    int latencyUs;
+    // period time, 0 for half of the latency
+    int wakeupUs;
+} LatencyTarget;
+
+// status block shared with java as a direct ByteBuffer (native byte order), refreshed by doRefreshStatus.
+// Owned by the registry slot and never freed, see registry.c
+typedef struct {
+    // odd while the block is being refreshed
+    UINT32 seq;
+    // snd_pcm_state_t
+    INT32 state;
+    // as doGetAvailBytes
+    INT32 availBytes;
+    INT32 xrunCnt;
+    // as PcmPosition
+    INT64 delayFrames;
+    INT64 framePos;
+    INT64 tstampNs;
+    // generation of the line handle (high 32 bits), 0 once the line is closed
+    UINT32 generation;
+} StatusBlock;
+
+// java rate <-> device rate, playback: java -> device, capture: device -> java
+typedef struct {
+    short int isSource;
+    int channels;
+    int javaRate;
+    int deviceRate;
+    // output/input rate ratio as phases/step
+    int phases;
+    int step;
+    int taps;
+    // phases x taps
+    float* coefs;
+    // input history, histCapacity frames per channel
+    float* hist;
+    int histCapacity;
+    int histFrames;
+    char** planes;
+    // next output at history index idx + phase/phases
+    int idx;
+    int phase;
+    // float samples of one block
+    float* in;
+    // capture: frames of in not taken by the history yet, from inOffset
+    int inOffset;
+    int inFrames;
+    float* out;
+    int outCapacity;
+    // capture: device data of one block
+    char* raw;
+    // converted output not taken yet by the device (playback) or java (capture)
+    char* pending;
+    int pendingOffset;
+    int pendingBytes;
+} Resampler;
+
 typedef struct {
     snd_pcm_t* handle;
     snd_pcm_hw_params_t* hwParams;
@@ -32,6 +233,78 @@ typedef struct {
     snd_pcm_uframes_t periodSize;
     short int isRunning;
     short int isFlushed;
+    // SND_PCM_ACCESS_MMAP_INTERLEAVED negotiated, transferring directly to/from the device ring
+    short int isMmap;
+    // copy of the byte[] region for nWrite/nRead, bufferBytes large
+    char* staging;
+    int stagingBytes;
+    int flags;
+    short int isSource;
+    int rate;
+    // incremented at every xrun recovery
+    int xrunCnt;
+    // serializes alsa calls of control ops, java transfers and the ring thread
+    pthread_mutex_t lock;
+    // serializes java I/O calls with each other and with flush, taken before lock
+    pthread_mutex_t ioLock;
+    // slot in the handle registry
+    int handleIdx;
+    // OPEN_FLAG_RING - java writes only to the ring, the ring thread transfers the data to the device
+    Ring ring;
+    short int hasRingThread;
+    pthread_t ringThread;
+    int quitRingThread;
+    int isRingThreadWaiting;
+    int ringThreadError;
+    // eventfd waking the ring thread
+    int wakeFd;
+    // capture ring - stamps of chunks in the ring, the ring thread is the producer
+    ChunkStamp* stamps;
+    int stampsCnt;
+    UINT64 stampsWrite;
+    UINT64 stampsRead;
+    // device data read when the ring is full
+    char* dropBuffer;
+    INT64 pendingDropped;
+    // expected capture time of the next frame, 0 if unknown
+    INT64 nextStartNs;
+    // OPEN_FLAG_TSCHED with period wakeups disabled - the ring thread sleeps on a CLOCK_MONOTONIC timerfd
+    short int isTimerSched;
+    int timerFd;
+    // device fill (playback) or room (capture) left at the planned wakeup, adapted to the wakeup jitter
+    int watermarkFrames;
+    int minWatermarkFrames;
+    int maxWatermarkFrames;
+    INT64 wakeupNs;
+    INT64 watermarkChangeNs;
+    int tschedXrunCnt;
+    // eventfd waking doWaitAvail, cancelled waits detected by changed waitGeneration
+    int waitFd;
+    int waitGeneration;
+    int isAppWaiting;
+    // last avail_min committed to the device
+    snd_pcm_uframes_t availMin;
+    int channels;
+    // float API, only for the formats supported by initConverter
+    short int hasConv;
+    Converter conv;
+    float* floatStaging;
+    int floatStagingSamples;
+    // non-interleaved access - channel planes (rw: in the planar buffer, mmap: device areas)
+    short int isNonInterleaved;
+    char* planar;
+    char** planes;
+    int planeFrames;
+    // NULL if the device runs at the java rate
+    Resampler* resampler;
+    // write path gain and mute, only with hasConv
+    Gain gain;
+    // OPEN_FLAG_METER, NULL otherwise
+    Meter* meter;
+    // frames transferred to/from the device since open, updated under lock
+    INT64 pcmFrames;
+    // the block of the registry slot, set by registerPcm
+    StatusBlock* statusBlock;
 } PcmInfo;
 
 typedef struct {
@@ -39,25 +312,163 @@ typedef struct {
     jobject vector;
     jclass clazz;
     jmethodID methodID;
+    // addFormats taking all formats packed in int[], NULL if not available in java
+    jmethodID batchMethodID;
 } AddFmtMethodInfo;
 
+// runtime settings, see settings.c
+typedef struct {
+    int logLevel;
+    // stdout, stderr or a file path
+    char logTarget[STR_LEN + 1];
+    // setBufferParams
+    int periodTimeUs;
+    int smallBufferFrames;
+    // transfers
+    int triesToRecover;
+    // format probing: 0-terminated rates and channel counts (empty = all channel counts up to maxChannels)
+    unsigned int probedRates[SETTINGS_MAX_RATES + 1];
+    unsigned int probedChannels[SETTINGS_MAX_CHANNELS + 1];
+    // rates above maxRate pruned, channel counts above maxChannels reported as unspecified channels
+    unsigned int maxRate;
+    unsigned int maxChannels;
+    // config names ignored by walkConfigs, terminated by an empty name
+    char ignoredConfigs[SETTINGS_MAX_IGNORED + 1][STR_LEN + 1];
+} Settings;
+
+const Settings* getSettings();
+int initSettings(int logLevel, const char* logTarget, const int* rates, int ratesCnt, const int* channels,
+        int channelsCnt, int maxRate, int maxChannels);
+
+// results of confWatchCheck
+#define CONF_UNCHANGED  0
+#define CONF_CHANGED    1
+#define CONF_UNKNOWN    2
+
+int confWatchCheck();
+
+int expandConfigPath(const char* path, char* fullPath, int len);
+
+// persistent cache of descs and formats, valid only for the current config files and cards
+int diskCacheRevalidate(int confChanged);
+int diskCacheGetDescs(MixerDesc** descs, int* capacity);
+void diskCachePutDescs(const MixerDesc* descs, int cnt);
+int diskCacheGetFmts(const char* deviceID, int isSource, FmtList* list);
+void diskCachePutFmts(const char* deviceID, int isSource, const FmtList* list);
+void diskCacheSave();
+
+FmtEntry* findFmtEntry(FmtCache* cache, const char* deviceID, int isSource);
+FmtEntry* putFmtEntry(FmtCache* cache, const char* deviceID, int isSource);
+void clearFmtCache(FmtCache* cache);
+int appendFmtList(FmtList* dest, const FmtList* src);
+
+// in-process cache of formats, dropped with the device snapshot
+unsigned int fmtCacheGetGeneration();
+int fmtCacheGet(const char* deviceID, int isSource, FmtList* list);
+void fmtCachePut(const char* deviceID, int isSource, const FmtList* list, unsigned int generation);
+void fmtCacheInvalidate();
+
+int addFmt(FmtList* list, int sampleSignBits, int frameBytes, int channels, int rate, int enc, int isSigned, int isBigEndian);
+void freeFmtList(FmtList* list);
+
+int initRing(Ring* ring, int size);
+void freeRing(Ring* ring);
+int ringFill(Ring* ring);
+int ringSpace(Ring* ring);
+int ringWrite(Ring* ring, const char* buffer, int bytes);
+int ringPeek(Ring* ring, char** ptr);
+void ringConsume(Ring* ring, int bytes);
+void ringSkipAll(Ring* ring);
+int ringReserve(Ring* ring, char** ptr);
+void ringCommit(Ring* ring, int bytes);
+
+int startRingThread(PcmInfo* info, int isSource);
+void stopRingThread(PcmInfo* info);
+void wakeRingThread(PcmInfo* info);
+int writeToRing(PcmInfo* info, char* buffer, int bytes);
+int readFromRing(PcmInfo* info, char* buffer, int bytes, ReadStamp* stamp);
+int waitRingEmpty(PcmInfo* info, int generation);
+
+int initConverter(Converter* conv, snd_pcm_format_t format, int isDither);
+void convertFromFloat(Converter* conv, const float* src, char* dst, int samples);
+void convertToFloat(Converter* conv, const char* src, float* dst, int samples);
+void unpackInt24(const char* src, INT32* dst, int samples);
+void packInt24(const INT32* src, char* dst, int samples);
+
+void deinterleave(const char* src, char* const* planes, int frames, int channels, int sampleBytes);
+void interleave(char* const* planes, char* dst, int frames, int channels, int sampleBytes);
+
+int initResampler(Resampler* rs, int quality, int isSource, int channels, int frameBytes, int javaRate,
+        int deviceRate);
+void freeResampler(Resampler* rs);
+int gcd(int a, int b);
+void resetResampler(Resampler* rs);
+int resampleWrite(PcmInfo* info, char* buffer, int bytes);
+int resampleRead(PcmInfo* info, char* buffer, int bytes, ReadStamp* stamp);
+INT64 toJavaBytes(PcmInfo* info, INT64 streamBytes);
+
+void initGain(Gain* gain);
+void requestGain(Gain* gain, int rampFrames);
+int isGainActive(Gain* gain);
+void applyGain(Gain* gain, const Converter* conv, const char* src, char* dst, int frames, int channels);
+void advanceGain(Gain* gain, int frames);
+
+int initMeter(Meter* meter, int channels, int rate);
+void freeMeter(Meter* meter);
+void resetMeterSnapshot(MeterSnapshot* snapshot, int channels, UINT32 generation);
+void meterFloat(Meter* meter, const float* src, int frames);
+void meterInt(Meter* meter, Converter* conv, const char* src, int frames);
+int readMeter(Meter* meter, float* levels);
+
+int writeToStream(PcmInfo* info, char* buffer, int bytes);
+int readFromStream(PcmInfo* info, char* buffer, int bytes, ReadStamp* stamp);
+int writeToPcm(PcmInfo* info, char* buffer, int bytes);
+int readFromPcm(PcmInfo* info, char* buffer, int bytes);
+
+INT64 registerPcm(PcmInfo* info);
+PcmInfo* acquirePcm(INT64 handle);
+void releasePcm(PcmInfo* info);
+PcmInfo* unregisterPcm(INT64 handle);
+
 // callback from impl to iface
-void clbkAddAudioFmt(AddFmtMethodInfo* mInfo, int sampleSignBits, int frameBytes,
-		int channels, int rate, int enc, int isSigned, int bigEndian);
+void clbkAddAudioFmts(AddFmtMethodInfo* mInfo, const FmtList* list);
 
+int doInit(int logLevel, const char* logTarget, const int* rates, int ratesCnt, const int* channels,
+        int channelsCnt, int maxRate, int maxChannels);
 INT32 doGetMixerCnt();
-INT32 doFillDesc(MixerDesc* description);
+INT32 doFillDesc(INT32 idx, MixerDesc* desc);
+INT32 doGetAllDescs(MixerDesc** descs);
 void doGetFmts(const char* deviceID, int isSource, AddFmtMethodInfo* mInfo);
+INT32 doProbeAllFmts();
 PcmInfo* doOpen(const char* deviceID, int isSource, int enc, int rate, int sampleSignBits,
-		int frameBytes, int channels, int isSigned, int isBigEndian, int bufferBytes);
+		int frameBytes, int channels, int isSigned, int isBigEndian, int bufferBytes, int flags,
+		const LatencyTarget* latency);
 void doClose(PcmInfo* info, int isSource);
 int doStart(PcmInfo* info, int isSource);
 int doStop(PcmInfo* info, int isSource);
 int doRead(PcmInfo* info, char* buffer, int bytes);
+int doReadStamped(PcmInfo* info, char* buffer, int bytes, ReadStamp* stamp);
 int doWrite(PcmInfo* info, char* buffer, int bytes);
+int doReadFloat(PcmInfo* info, float* dst, int samples);
+int doWriteFloat(PcmInfo* info, const float* src, int samples);
+// do* bodies for callers already holding ioLock, e.g. filling the shared staging buffers
+int readJavaData(PcmInfo* info, char* buffer, int bytes, ReadStamp* stamp);
+int writeJavaData(PcmInfo* info, char* buffer, int bytes);
+int readFloatData(PcmInfo* info, float* dst, int samples);
+int writeFloatData(PcmInfo* info, const float* src, int samples);
+int doSetGain(PcmInfo* info, float gain, int rampFrames);
+int doSetMute(PcmInfo* info, int isMuted, int rampFrames);
+int doGetMeter(PcmInfo* info, float* levels);
 void doDrain(PcmInfo* info);
 void doFlush(PcmInfo* info, int isSource);
 int doGetAvailBytes(PcmInfo* info, int isSource);
+int doGetBufferBytes(PcmInfo* info);
+int doWaitAvail(PcmInfo* info, int isSource, int bytes, int timeoutMs);
+void wakeWaiter(PcmInfo* info);
+void cancelWait(PcmInfo* info);
+int sleepOnWaiter(PcmInfo* info, int generation, int timeoutMs);
 INT64 doGetBytePos(PcmInfo* info, int isSource, INT64 javaBytePos);
+int doGetPosition(PcmInfo* info, int isSource, PcmPosition* pos);
+int doRefreshStatus(PcmInfo* info, int isSource);
 
 #endif // COMMON_INCLUDED
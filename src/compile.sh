@@ -39,8 +39,8 @@ echo "Using JAVA_HOME: $JAVA_HOME"
 BASEDIR=$(dirname "$0")
 rm $BASEDIR/*.o $BASEDIR/libcsjsound_${JAVA_OS_ARCH}.so
 
-for FILE in jni_iface impl ; do
+for FILE in jni_iface impl confwatch diskcache fmtcache ring ringthread convert interleave resample gain meter registry settings ; do
   $GCC $GCC_EXTRA -c -fPIC -I${JAVA_HOME}/include -I${JAVA_HOME}/include/linux -I$BASEDIR/../ $BASEDIR/$FILE.c -o $BASEDIR/$FILE.o
 done
 
-$GCC -shared $GCC_EXTRA -Wl,--hash-style=both -Wl,-z,defs -Wl,-O1 -Wl,-z,noexecstack -Wl,--exclude-libs,ALL -Wl,-z,origin -Wl,-rpath,\$ORIGIN -Wl,-soname=libcsjsound_amd64.so $BASEDIR/*.o -o $BASEDIR/libcsjsound_${JAVA_OS_ARCH}.so -lasound
+$GCC -shared $GCC_EXTRA -Wl,--hash-style=both -Wl,-z,defs -Wl,-O1 -Wl,-z,noexecstack -Wl,--exclude-libs,ALL -Wl,-z,origin -Wl,-rpath,\$ORIGIN -Wl,-soname=libcsjsound_amd64.so $BASEDIR/*.o -o $BASEDIR/libcsjsound_${JAVA_OS_ARCH}.so -lasound -lpthread -lm
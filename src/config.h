@@ -9,6 +9,9 @@
 // maximum string length (deviceID, name, description)
 #define STR_LEN                 200
 
+// DEFAULT_PERIOD_TIME, SMALL_BUFFER_SIZE_LIMIT, TRIES_TO_RECOVER, PROBE_MAX_CHANNELS, PROBED_RATES and IGNORED_CONFIGS
+// are defaults of the runtime settings (see settings.c)
+
 // period time for buffers larger than SMALL_BUFFER_SIZE_LIMIT frames
 #define DEFAULT_PERIOD_TIME     20000
 
@@ -16,11 +19,83 @@
 
 #define TRIES_TO_RECOVER        3
 
+// max. entries of the list settings
+#define SETTINGS_MAX_RATES      32
+#define SETTINGS_MAX_CHANNELS   32
+#define SETTINGS_MAX_IGNORED    32
+// settings file relative to $XDG_CONFIG_HOME or ~/.config, CSJSOUND_CONFIG overrides the path
+#define SETTINGS_FILE           "csjsound/alsapcm.conf"
+
+// OPEN_FLAG_RING: the device runs with 1/RING_DEVICE_BUFFER_DIVIDER of the requested buffer, java gets the whole
+// requested buffer as the ring
+#define RING_DEVICE_BUFFER_DIVIDER  4
+// SCHED_FIFO priority of the ring thread, normal priority used if not permitted
+#define RING_THREAD_RT_PRIORITY     50
+// max. wait of the ring thread in ms
+#define RING_THREAD_POLL_TIMEOUT    100
+// OPEN_FLAG_TSCHED: device buffer time
+#define TSCHED_BUFFER_TIME_US       2000000
+// initial and min. refill watermark, the max. is half of the device buffer
+#define TSCHED_WATERMARK_US         20000
+#define TSCHED_MIN_WATERMARK_US     5000
+// the watermark decreases after this time without a late wakeup or xrun
+#define TSCHED_WATERMARK_DEC_MS     10000
+// playback fills the device only this far above the watermark. Gain and mute are applied before the ring and
+// reach the output after at most the watermark plus this margin
+#define TSCHED_FILL_MARGIN_US       20000
+// frames resampled at once
+#define RESAMPLE_BLOCK_FRAMES       1024
+// samples of packed 24 bits converted or scaled at once through 32-bit samples
+#define PACKED_CHUNK_SAMPLES        256
+// max. phases of the resampling filter = output rate / gcd(input rate, output rate)
+#define RESAMPLE_MAX_PHASES         2048
+// OPEN_FLAG_METER: levels published every METER_WINDOW_MS
+#define METER_WINDOW_MS             50
+// max. lines open at the same time, size of the handle registry
+#define MAX_OPEN_PCMS               256
+// interval of cancelling waits while closing a line with calls in progress
+#define CLOSE_WAIT_POLL_MS          10
+// max. poll descriptors of a device
+#define MAX_PCM_POLL_FDS            8
+// period counts tried by the latency negotiation
+#define LATENCY_MIN_PERIODS         2
+#define LATENCY_MAX_PERIODS         32
+
+// preferring SND_PCM_ACCESS_MMAP_INTERLEAVED if the device supports it, saving one copy per period
+#define USE_MMAP_ACCESS
+
+// testing each standard rate and channel count of every format instead of reporting only min/max limits
+#define EXACT_FMT_PROBING
+// channel counts tested by the exact probing, formats with more channels are reported with unspecified channels
+#define PROBE_MAX_CHANNELS      8
+
+// rates tested by the exact probing
+extern const unsigned int PROBED_RATES[];
+
+// persistent cache of device descs and formats (see diskcache.c)
+#define USE_DISK_CACHE
+// bump when the cache content changes
+#define DISK_CACHE_VERSION      2
+#define DISK_CACHE_FILE         "csjsound/alsapcm.cache"
+
+// max. threads probing the devices in parallel in doProbeAllFmts
+#define PROBE_THREADS           8
+
+// initial size of the format lists, grows by doubling
+#define FMT_LIST_INITIAL_CAPACITY 64
+
+// initial size of the device snapshot array, grows by doubling
+#define SNAPSHOT_INITIAL_CAPACITY 32
+
 // config names ignored when enumerating pcm devices
-static const char *IGNORED_CONFIGS[] = {
-			"hw", "plughw", "plug", "dsnoop", "tee",
-            "file", "null", "shm", "cards", "rate_convert",
-            NULL
-};
+extern const char *IGNORED_CONFIGS[];
+
+// alsa config files watched for changes (see confwatch.c). Leading ~ stands for $HOME, trailing / marks
+// a directory where any change counts
+extern const char *WATCHED_CONFIGS[];
+
+#define WATCHED_CONFIGS_MAX     16
+// device nodes dir watched for card hotplug
+#define CARDS_DEV_DIR           "/dev/snd/"
 
 #endif // CONFIG_INCLUDED
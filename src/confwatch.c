@@ -0,0 +1,137 @@
+#include <limits.h>
+#include <sys/inotify.h>
+#include "common.h"
+
+// watching alsa config files for changes, to avoid rescanning the config on every enumeration
+
+// see config.h
+const char *WATCHED_CONFIGS[] = {
+            "/etc/asound.conf", "~/.asoundrc", "~/.config/alsa/asoundrc",
+            "/usr/share/alsa/alsa.conf", "/usr/share/alsa/alsa.conf.d/", "/etc/alsa/conf.d/",
+            NULL
+};
+
+typedef struct {
+    int wd;
+    // file name within the watched dir, empty = any change in the dir
+    char name[NAME_MAX + 1];
+} ConfWatch;
+
+static ConfWatch watches[WATCHED_CONFIGS_MAX];
+static int watchCnt = 0;
+static int inotifyFd = -1;
+static int isWatchInitialized = FALSE;
+
+// expands leading ~ to $HOME. Returns FALSE if cannot be expanded
+int expandConfigPath(const char* path, char* fullPath, int len)
+{
+    if (path[0] == '~') {
+        const char* home = getenv("HOME");
+        if (home == NULL) {
+            TRACE2("%s: $HOME not set, skipping %s\n", __FUNCTION__, path);
+            return FALSE;
+        }
+        snprintf(fullPath, len, "%s%s", home, path + 1);
+    } else {
+        strncpy(fullPath, path, len - 1);
+        fullPath[len - 1] = '\0';
+    }
+    return TRUE;
+}
+
+static void addWatch(const char* path, uint32_t mask)
+{
+    char fullPath[PATH_MAX];
+    if (!expandConfigPath(path, fullPath, PATH_MAX)) {
+        return;
+    }
+
+    ConfWatch* watch = &watches[watchCnt];
+    char* slash = strrchr(fullPath, '/');
+    if (slash == NULL) {
+        return;
+    }
+    if (slash[1] == '\0') {
+        // directory - any change counts
+        watch->name[0] = '\0';
+    } else {
+        // file - watching its parent dir to catch (re)creation of the file too
+        strncpy(watch->name, slash + 1, NAME_MAX);
+        watch->name[NAME_MAX] = '\0';
+        slash[1] = '\0';
+    }
+    watch->wd = inotify_add_watch(inotifyFd, fullPath, mask);
+    if (watch->wd < 0) {
+        // a missing dir is common (e.g. no alsa.conf.d)
+        TRACE3("%s: inotify_add_watch %s: %s\n", __FUNCTION__, fullPath, strerror(errno));
+        return;
+    }
+    TRACE3("%s: watching %s%s\n", __FUNCTION__, fullPath, watch->name);
+    ++watchCnt;
+}
+
+static void initConfWatch()
+{
+    isWatchInitialized = TRUE;
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd < 0) {
+        ERROR2("%s: inotify_init1: %s, config changes will be detected by alsa only\n", __FUNCTION__, strerror(errno));
+        return;
+    }
+    int i = 0;
+    while (WATCHED_CONFIGS[i] && watchCnt < WATCHED_CONFIGS_MAX) {
+        addWatch(WATCHED_CONFIGS[i], IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB);
+        ++i;
+    }
+    if (watchCnt < WATCHED_CONFIGS_MAX) {
+        // cards plugged/unplugged - device nodes (re)created. Closing an opened device must not count
+        addWatch(CARDS_DEV_DIR, IN_CREATE | IN_DELETE);
+    }
+}
+
+static int isWatchedEvent(const struct inotify_event* event)
+{
+    int i;
+    for (i = 0; i < watchCnt; ++i) {
+        if (watches[i].wd != event->wd)
+            continue;
+        if (watches[i].name[0] == '\0' || (event->len > 0 && !strcmp(watches[i].name, event->name)))
+            return TRUE;
+    }
+    // overflowed queue - events were lost
+    return (event->mask & IN_Q_OVERFLOW)? TRUE: FALSE;
+}
+
+// Not thread-safe, the caller must serialize the calls.
+// Returns CONF_CHANGED if some watched config changed since the last call, CONF_UNCHANGED if not,
+// CONF_UNKNOWN if the changes cannot be watched (first call, no inotify)
+int confWatchCheck()
+{
+    if (!isWatchInitialized) {
+        initConfWatch();
+        return CONF_UNKNOWN;
+    }
+    if (inotifyFd < 0) {
+        return CONF_UNKNOWN;
+    }
+
+    int changed = CONF_UNCHANGED;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    // draining all queued events
+    while ((len = read(inotifyFd, buf, sizeof(buf))) > 0) {
+        char* ptr;
+        for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*) ptr)->len) {
+            const struct inotify_event* event = (const struct inotify_event*) ptr;
+            if (isWatchedEvent(event)) {
+                TRACE3("%s: change of %s detected (mask 0x%x)\n", __FUNCTION__, (event->len > 0)? event->name: "", event->mask);
+                changed = CONF_CHANGED;
+            }
+        }
+    }
+    if (len < 0 && errno != EAGAIN) {
+        ERROR2("%s: reading inotify events: %s\n", __FUNCTION__, strerror(errno));
+        changed = CONF_UNKNOWN;
+    }
+    return changed;
+}
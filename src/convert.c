@@ -0,0 +1,537 @@
+#include <math.h>
+#include <time.h>
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_X86_KERNELS
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAS_NEON_KERNELS
+#endif
+
+// Conversion of interleaved float samples (full scale -1.0 .. 1.0) from/to little-endian signed integer PCM.
+// Kernels for SSE2/AVX2 (selected at runtime) and NEON (aarch64), scalar code for the rest. Optional TPDF dither
+// of +-1 LSB from per-lane xorshift generators.
+
+typedef void (*ToInt32Func)(const float* src, INT32* dst, int samples, const Converter* conv, UINT32* dither);
+typedef void (*ToInt16Func)(const float* src, INT16* dst, int samples, const Converter* conv, UINT32* dither);
+typedef void (*FromInt32Func)(const INT32* src, float* dst, int samples, const Converter* conv);
+typedef void (*FromInt16Func)(const INT16* src, float* dst, int samples, const Converter* conv);
+
+static struct {
+    ToInt32Func toInt32;
+    ToInt16Func toInt16;
+    FromInt32Func fromInt32;
+    FromInt16Func fromInt16;
+} kernels;
+
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+
+
+/********** SCALAR **********/
+
+static inline UINT32 xorshift(UINT32* state)
+{
+    UINT32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// 0.0 .. 1.0 from the upper 23 bits
+static inline float uniform(UINT32* state)
+{
+    union { UINT32 i; float f; } u;
+    u.i = (xorshift(state) >> 9) | 0x3f800000;
+    return u.f - 1.0f;
+}
+
+// triangular PDF in -1.0 .. 1.0 LSB
+static inline float tpdf(UINT32* state)
+{
+    return uniform(state) - uniform(state);
+}
+
+static inline float toIntRange(float v, const Converter* conv, UINT32* dither)
+{
+    v *= conv->scale;
+    if (dither != NULL) {
+        v += tpdf(dither);
+    }
+    if (v > conv->maxVal) {
+        return conv->maxVal;
+    }
+    // NaN ends as -scale like in the SSE2 kernels, lrintf of NaN is undefined
+    return (v >= -conv->scale)? v: -conv->scale;
+}
+
+static void toInt32Scalar(const float* src, INT32* dst, int samples, const Converter* conv, UINT32* dither)
+{
+    int i;
+    for (i = 0; i < samples; i++) {
+        dst[i] = (INT32) lrintf(toIntRange(src[i], conv, dither));
+    }
+}
+
+static void toInt16Scalar(const float* src, INT16* dst, int samples, const Converter* conv, UINT32* dither)
+{
+    int i;
+    for (i = 0; i < samples; i++) {
+        dst[i] = (INT16) lrintf(toIntRange(src[i], conv, dither));
+    }
+}
+
+static void fromInt32Scalar(const INT32* src, float* dst, int samples, const Converter* conv)
+{
+    int i;
+    for (i = 0; i < samples; i++) {
+        // sign extension of samples in the low bits
+        INT32 v = ((INT32) ((UINT32) src[i] << conv->shift)) >> conv->shift;
+        dst[i] = (float) v * conv->invScale;
+    }
+}
+
+static void fromInt16Scalar(const INT16* src, float* dst, int samples, const Converter* conv)
+{
+    int i;
+    for (i = 0; i < samples; i++) {
+        dst[i] = (float) src[i] * conv->invScale;
+    }
+}
+
+
+#ifdef HAS_X86_KERNELS
+/********** SSE2 **********/
+
+__attribute__((target("sse2")))
+static inline __m128i xorshiftSSE2(__m128i x)
+{
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 uniformSSE2(__m128i x)
+{
+    __m128i bits = _mm_or_si128(_mm_srli_epi32(x, 9), _mm_set1_epi32(0x3f800000));
+    return _mm_sub_ps(_mm_castsi128_ps(bits), _mm_set1_ps(1.0f));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 toIntRangeSSE2(__m128 v, const Converter* conv, __m128i* state, int isDither)
+{
+    v = _mm_mul_ps(v, _mm_set1_ps(conv->scale));
+    if (isDither) {
+        __m128i x1 = xorshiftSSE2(*state);
+        __m128i x2 = xorshiftSSE2(x1);
+        *state = x2;
+        v = _mm_add_ps(v, _mm_sub_ps(uniformSSE2(x1), uniformSSE2(x2)));
+    }
+    // NaN ends as -scale
+    v = _mm_max_ps(v, _mm_set1_ps(-conv->scale));
+    return _mm_min_ps(v, _mm_set1_ps(conv->maxVal));
+}
+
+__attribute__((target("sse2")))
+static void toInt32SSE2(const float* src, INT32* dst, int samples, const Converter* conv, UINT32* dither)
+{
+    __m128i state = _mm_setzero_si128();
+    if (dither != NULL) {
+        state = _mm_loadu_si128((const __m128i*) dither);
+    }
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128 v = toIntRangeSSE2(_mm_loadu_ps(src + i), conv, &state, dither != NULL);
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_cvtps_epi32(v));
+    }
+    if (dither != NULL) {
+        _mm_storeu_si128((__m128i*) dither, state);
+    }
+    toInt32Scalar(src + i, dst + i, samples - i, conv, dither);
+}
+
+__attribute__((target("sse2")))
+static void toInt16SSE2(const float* src, INT16* dst, int samples, const Converter* conv, UINT32* dither)
+{
+    __m128i state = _mm_setzero_si128();
+    if (dither != NULL) {
+        state = _mm_loadu_si128((const __m128i*) dither);
+    }
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128 lo = toIntRangeSSE2(_mm_loadu_ps(src + i), conv, &state, dither != NULL);
+        __m128 hi = toIntRangeSSE2(_mm_loadu_ps(src + i + 4), conv, &state, dither != NULL);
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+        _mm_storeu_si128((__m128i*) (dst + i), packed);
+    }
+    if (dither != NULL) {
+        _mm_storeu_si128((__m128i*) dither, state);
+    }
+    toInt16Scalar(src + i, dst + i, samples - i, conv, dither);
+}
+
+__attribute__((target("sse2")))
+static void fromInt32SSE2(const INT32* src, float* dst, int samples, const Converter* conv)
+{
+    __m128i shift = _mm_cvtsi32_si128(conv->shift);
+    __m128 invScale = _mm_set1_ps(conv->invScale);
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+        v = _mm_sra_epi32(_mm_sll_epi32(v, shift), shift);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), invScale));
+    }
+    fromInt32Scalar(src + i, dst + i, samples - i, conv);
+}
+
+__attribute__((target("sse2")))
+static void fromInt16SSE2(const INT16* src, float* dst, int samples, const Converter* conv)
+{
+    __m128 invScale = _mm_set1_ps(conv->invScale);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+        // sign extension to 32 bits
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), invScale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), invScale));
+    }
+    fromInt16Scalar(src + i, dst + i, samples - i, conv);
+}
+
+
+/********** AVX2 **********/
+
+__attribute__((target("avx2")))
+static inline __m256i xorshiftAVX2(__m256i x)
+{
+    x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+    return _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 uniformAVX2(__m256i x)
+{
+    __m256i bits = _mm256_or_si256(_mm256_srli_epi32(x, 9), _mm256_set1_epi32(0x3f800000));
+    return _mm256_sub_ps(_mm256_castsi256_ps(bits), _mm256_set1_ps(1.0f));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 toIntRangeAVX2(__m256 v, const Converter* conv, __m256i* state, int isDither)
+{
+    v = _mm256_mul_ps(v, _mm256_set1_ps(conv->scale));
+    if (isDither) {
+        __m256i x1 = xorshiftAVX2(*state);
+        __m256i x2 = xorshiftAVX2(x1);
+        *state = x2;
+        v = _mm256_add_ps(v, _mm256_sub_ps(uniformAVX2(x1), uniformAVX2(x2)));
+    }
+    v = _mm256_max_ps(v, _mm256_set1_ps(-conv->scale));
+    return _mm256_min_ps(v, _mm256_set1_ps(conv->maxVal));
+}
+
+__attribute__((target("avx2")))
+static void toInt32AVX2(const float* src, INT32* dst, int samples, const Converter* conv, UINT32* dither)
+{
+    __m256i state = _mm256_setzero_si256();
+    if (dither != NULL) {
+        state = _mm256_loadu_si256((const __m256i*) dither);
+    }
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256 v = toIntRangeAVX2(_mm256_loadu_ps(src + i), conv, &state, dither != NULL);
+        _mm256_storeu_si256((__m256i*) (dst + i), _mm256_cvtps_epi32(v));
+    }
+    if (dither != NULL) {
+        _mm256_storeu_si256((__m256i*) dither, state);
+    }
+    toInt32Scalar(src + i, dst + i, samples - i, conv, dither);
+}
+
+__attribute__((target("avx2")))
+static void toInt16AVX2(const float* src, INT16* dst, int samples, const Converter* conv, UINT32* dither)
+{
+    __m256i state = _mm256_setzero_si256();
+    if (dither != NULL) {
+        state = _mm256_loadu_si256((const __m256i*) dither);
+    }
+    int i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        __m256 lo = toIntRangeAVX2(_mm256_loadu_ps(src + i), conv, &state, dither != NULL);
+        __m256 hi = toIntRangeAVX2(_mm256_loadu_ps(src + i + 8), conv, &state, dither != NULL);
+        __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+        // packs works within 128-bit lanes
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+        _mm256_storeu_si256((__m256i*) (dst + i), packed);
+    }
+    if (dither != NULL) {
+        _mm256_storeu_si256((__m256i*) dither, state);
+    }
+    toInt16Scalar(src + i, dst + i, samples - i, conv, dither);
+}
+
+__attribute__((target("avx2")))
+static void fromInt32AVX2(const INT32* src, float* dst, int samples, const Converter* conv)
+{
+    __m128i shift = _mm_cvtsi32_si128(conv->shift);
+    __m256 invScale = _mm256_set1_ps(conv->invScale);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (src + i));
+        v = _mm256_sra_epi32(_mm256_sll_epi32(v, shift), shift);
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), invScale));
+    }
+    fromInt32Scalar(src + i, dst + i, samples - i, conv);
+}
+
+__attribute__((target("avx2")))
+static void fromInt16AVX2(const INT16* src, float* dst, int samples, const Converter* conv)
+{
+    __m256 invScale = _mm256_set1_ps(conv->invScale);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) (src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), invScale));
+    }
+    fromInt16Scalar(src + i, dst + i, samples - i, conv);
+}
+#endif  // HAS_X86_KERNELS
+
+
+#ifdef HAS_NEON_KERNELS
+/********** NEON **********/
+
+static inline uint32x4_t xorshiftNEON(uint32x4_t x)
+{
+    x = veorq_u32(x, vshlq_n_u32(x, 13));
+    x = veorq_u32(x, vshrq_n_u32(x, 17));
+    return veorq_u32(x, vshlq_n_u32(x, 5));
+}
+
+static inline float32x4_t uniformNEON(uint32x4_t x)
+{
+    uint32x4_t bits = vorrq_u32(vshrq_n_u32(x, 9), vdupq_n_u32(0x3f800000));
+    return vsubq_f32(vreinterpretq_f32_u32(bits), vdupq_n_f32(1.0f));
+}
+
+static inline float32x4_t toIntRangeNEON(float32x4_t v, const Converter* conv, uint32x4_t* state, int isDither)
+{
+    v = vmulq_n_f32(v, conv->scale);
+    if (isDither) {
+        uint32x4_t x1 = xorshiftNEON(*state);
+        uint32x4_t x2 = xorshiftNEON(x1);
+        *state = x2;
+        v = vaddq_f32(v, vsubq_f32(uniformNEON(x1), uniformNEON(x2)));
+    }
+    v = vmaxq_f32(v, vdupq_n_f32(-conv->scale));
+    return vminq_f32(v, vdupq_n_f32(conv->maxVal));
+}
+
+static void toInt32NEON(const float* src, INT32* dst, int samples, const Converter* conv, UINT32* dither)
+{
+    uint32x4_t state = vdupq_n_u32(0);
+    if (dither != NULL) {
+        state = vld1q_u32(dither);
+    }
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        float32x4_t v = toIntRangeNEON(vld1q_f32(src + i), conv, &state, dither != NULL);
+        // NaN converts to 0
+        vst1q_s32((int32_t*) (dst + i), vcvtnq_s32_f32(v));
+    }
+    if (dither != NULL) {
+        vst1q_u32(dither, state);
+    }
+    toInt32Scalar(src + i, dst + i, samples - i, conv, dither);
+}
+
+static void toInt16NEON(const float* src, INT16* dst, int samples, const Converter* conv, UINT32* dither)
+{
+    uint32x4_t state = vdupq_n_u32(0);
+    if (dither != NULL) {
+        state = vld1q_u32(dither);
+    }
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        float32x4_t lo = toIntRangeNEON(vld1q_f32(src + i), conv, &state, dither != NULL);
+        float32x4_t hi = toIntRangeNEON(vld1q_f32(src + i + 4), conv, &state, dither != NULL);
+        int16x8_t packed = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(lo)), vqmovn_s32(vcvtnq_s32_f32(hi)));
+        vst1q_s16(dst + i, packed);
+    }
+    if (dither != NULL) {
+        vst1q_u32(dither, state);
+    }
+    toInt16Scalar(src + i, dst + i, samples - i, conv, dither);
+}
+
+static void fromInt32NEON(const INT32* src, float* dst, int samples, const Converter* conv)
+{
+    int32x4_t left = vdupq_n_s32(conv->shift);
+    // negative shift of signed lanes is arithmetic right shift
+    int32x4_t right = vdupq_n_s32(-conv->shift);
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        int32x4_t v = vld1q_s32((const int32_t*) (src + i));
+        v = vshlq_s32(vshlq_s32(v, left), right);
+        vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(v), conv->invScale));
+    }
+    fromInt32Scalar(src + i, dst + i, samples - i, conv);
+}
+
+static void fromInt16NEON(const INT16* src, float* dst, int samples, const Converter* conv)
+{
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        int16x8_t v = vld1q_s16(src + i);
+        vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), conv->invScale));
+        vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), conv->invScale));
+    }
+    fromInt16Scalar(src + i, dst + i, samples - i, conv);
+}
+#endif  // HAS_NEON_KERNELS
+
+
+/********** DISPATCH **********/
+
+static void selectKernels()
+{
+    kernels.toInt32 = toInt32Scalar;
+    kernels.toInt16 = toInt16Scalar;
+    kernels.fromInt32 = fromInt32Scalar;
+    kernels.fromInt16 = fromInt16Scalar;
+#if defined(HAS_X86_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        TRACE1("%s: using AVX2\n", __FUNCTION__);
+        kernels.toInt32 = toInt32AVX2;
+        kernels.toInt16 = toInt16AVX2;
+        kernels.fromInt32 = fromInt32AVX2;
+        kernels.fromInt16 = fromInt16AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        TRACE1("%s: using SSE2\n", __FUNCTION__);
+        kernels.toInt32 = toInt32SSE2;
+        kernels.toInt16 = toInt16SSE2;
+        kernels.fromInt32 = fromInt32SSE2;
+        kernels.fromInt16 = fromInt16SSE2;
+    }
+#elif defined(HAS_NEON_KERNELS)
+    TRACE1("%s: using NEON\n", __FUNCTION__);
+    kernels.toInt32 = toInt32NEON;
+    kernels.toInt16 = toInt16NEON;
+    kernels.fromInt32 = fromInt32NEON;
+    kernels.fromInt16 = fromInt16NEON;
+#endif
+}
+
+// Returns FALSE if the format has no float conversion
+int initConverter(Converter* conv, snd_pcm_format_t format, int isDither)
+{
+    int i;
+    int bits;
+    memset(conv, 0, sizeof(Converter));
+    switch (format) {
+        case SND_PCM_FORMAT_S16_LE:
+            conv->sampleBytes = 2;
+            bits = 16;
+            break;
+        case SND_PCM_FORMAT_S24_3LE:
+            conv->sampleBytes = 3;
+            conv->shift = 8;
+            bits = 24;
+            break;
+        case SND_PCM_FORMAT_S24_LE:
+            conv->sampleBytes = 4;
+            conv->shift = 8;
+            bits = 24;
+            break;
+        case SND_PCM_FORMAT_S32_LE:
+            conv->sampleBytes = 4;
+            bits = 32;
+            break;
+        default:
+            TRACE2("%s: no float conversion for format %s\n", __FUNCTION__, snd_pcm_format_name(format));
+            return FALSE;
+    }
+    pthread_once(&kernelsOnce, selectKernels);
+    conv->scale = ldexpf(1.0f, bits - 1);
+    // 2^31 - 1 is not representable in float, using the largest float below
+    conv->maxVal = (bits == 32)? 2147483520.0f: conv->scale - 1.0f;
+    conv->invScale = 1.0f / conv->scale;
+    // dither below float resolution is pointless for 32 bits
+    conv->isDither = isDither && bits < 32;
+    UINT32 seed = (UINT32) time(NULL) ^ (UINT32) (UINT_PTR) conv;
+    for (i = 0; i < 8; i++) {
+        // xorshift state must not be zero
+        conv->ditherState[i] = (seed + (UINT32) i * 0x9E3779B9u) | 1;
+    }
+    return TRUE;
+}
+
+// packed 24 bits to the low bytes of 32-bit samples, not sign extended
+void unpackInt24(const char* src, INT32* dst, int samples)
+{
+    int i;
+    const UINT8* bytes = (const UINT8*) src;
+    for (i = 0; i < samples; i++) {
+        dst[i] = (INT32) (bytes[0] | (bytes[1] << 8) | (bytes[2] << 16));
+        bytes += 3;
+    }
+}
+
+// low 3 bytes of 32-bit samples packed
+void packInt24(const INT32* src, char* dst, int samples)
+{
+    int i;
+    for (i = 0; i < samples; i++) {
+        *dst++ = (char) src[i];
+        *dst++ = (char) (src[i] >> 8);
+        *dst++ = (char) (src[i] >> 16);
+    }
+}
+
+void convertFromFloat(Converter* conv, const float* src, char* dst, int samples)
+{
+    UINT32* dither = conv->isDither? conv->ditherState: NULL;
+    if (conv->sampleBytes == 2) {
+        kernels.toInt16(src, (INT16*) dst, samples, conv, dither);
+    } else if (conv->sampleBytes == 4) {
+        kernels.toInt32(src, (INT32*) dst, samples, conv, dither);
+    } else {
+        // packed 24 bits through 32-bit samples
+        INT32 chunk[PACKED_CHUNK_SAMPLES];
+        while (samples > 0) {
+            int cnt = (samples < PACKED_CHUNK_SAMPLES)? samples: PACKED_CHUNK_SAMPLES;
+            kernels.toInt32(src, chunk, cnt, conv, dither);
+            packInt24(chunk, dst, cnt);
+            src += cnt;
+            dst += 3 * cnt;
+            samples -= cnt;
+        }
+    }
+}
+
+void convertToFloat(Converter* conv, const char* src, float* dst, int samples)
+{
+    if (conv->sampleBytes == 2) {
+        kernels.fromInt16((const INT16*) src, dst, samples, conv);
+    } else if (conv->sampleBytes == 4) {
+        kernels.fromInt32((const INT32*) src, dst, samples, conv);
+    } else {
+        // packed 24 bits unpacked to the low bytes of 32-bit samples, sign extended by the kernel
+        INT32 chunk[PACKED_CHUNK_SAMPLES];
+        while (samples > 0) {
+            int cnt = (samples < PACKED_CHUNK_SAMPLES)? samples: PACKED_CHUNK_SAMPLES;
+            unpackInt24(src, chunk, cnt);
+            kernels.fromInt32(chunk, dst, cnt, conv);
+            src += 3 * cnt;
+            dst += cnt;
+            samples -= cnt;
+        }
+    }
+}
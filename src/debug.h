@@ -1,14 +1,24 @@
 #ifndef DEBUG_INCLUDED
 #define DEBUG_INCLUDED
 
+// levels of java SimpleMixerProvider.LIB_LOG_LEVEL_*, messages above the runtime level are skipped
+#define LOG_LEVEL_ERROR     0
+#define LOG_LEVEL_WARN      1
+#define LOG_LEVEL_INFO      2
+#define LOG_LEVEL_DEBUG     3
+#define LOG_LEVEL_TRACE     4
+
+// prints to the log target of the settings, see settings.c
+void logPrint(int level, const char* format, ...);
+
 #ifdef USE_ERROR
-#define ERROR0(string)                        { fprintf(stdout, (string)); fflush(stdout); }
-#define ERROR1(string, p1)                    { fprintf(stdout, (string), (p1)); fflush(stdout); }
-#define ERROR2(string, p1, p2)                { fprintf(stdout, (string), (p1), (p2)); fflush(stdout); }
-#define ERROR3(string, p1, p2, p3)            { fprintf(stdout, (string), (p1), (p2), (p3)); fflush(stdout); }
-#define ERROR4(string, p1, p2, p3, p4)        { fprintf(stdout, (string), (p1), (p2), (p3), (p4)); fflush(stdout); }
-#define ERROR4(string, p1, p2, p3, p4)        { fprintf(stdout, (string), (p1), (p2), (p3), (p4)); fflush(stdout); }
-#define ERROR5(string, p1, p2, p3, p4, p5)    { fprintf(stdout, (string), (p1), (p2), (p3), (p4), (p5)); fflush(stdout); }
+#define ERROR0(string)                        { logPrint(LOG_LEVEL_ERROR, (string)); }
+#define ERROR1(string, p1)                    { logPrint(LOG_LEVEL_ERROR, (string), (p1)); }
+#define ERROR2(string, p1, p2)                { logPrint(LOG_LEVEL_ERROR, (string), (p1), (p2)); }
+#define ERROR3(string, p1, p2, p3)            { logPrint(LOG_LEVEL_ERROR, (string), (p1), (p2), (p3)); }
+#define ERROR4(string, p1, p2, p3, p4)        { logPrint(LOG_LEVEL_ERROR, (string), (p1), (p2), (p3), (p4)); }
+#define ERROR4(string, p1, p2, p3, p4)        { logPrint(LOG_LEVEL_ERROR, (string), (p1), (p2), (p3), (p4)); }
+#define ERROR5(string, p1, p2, p3, p4, p5)    { logPrint(LOG_LEVEL_ERROR, (string), (p1), (p2), (p3), (p4), (p5)); }
 #else
 #define ERROR0(string)
 #define ERROR1(string, p1)
@@ -19,12 +29,12 @@
 #endif
 
 #ifdef USE_TRACE
-#define TRACE0(string)                        { fprintf(stdout, (string)); fflush(stdout); }
-#define TRACE1(string, p1)                    { fprintf(stdout, (string), (p1)); fflush(stdout); }
-#define TRACE2(string, p1, p2)                { fprintf(stdout, (string), (p1), (p2)); fflush(stdout); }
-#define TRACE3(string, p1, p2, p3)            { fprintf(stdout, (string), (p1), (p2), (p3)); fflush(stdout); }
-#define TRACE4(string, p1, p2, p3, p4)        { fprintf(stdout, (string), (p1), (p2), (p3), (p4)); fflush(stdout); }
-#define TRACE5(string, p1, p2, p3, p4, p5)    { fprintf(stdout, (string), (p1), (p2), (p3), (p4), (p5)); fflush(stdout); }
+#define TRACE0(string)                        { logPrint(LOG_LEVEL_TRACE, (string)); }
+#define TRACE1(string, p1)                    { logPrint(LOG_LEVEL_TRACE, (string), (p1)); }
+#define TRACE2(string, p1, p2)                { logPrint(LOG_LEVEL_TRACE, (string), (p1), (p2)); }
+#define TRACE3(string, p1, p2, p3)            { logPrint(LOG_LEVEL_TRACE, (string), (p1), (p2), (p3)); }
+#define TRACE4(string, p1, p2, p3, p4)        { logPrint(LOG_LEVEL_TRACE, (string), (p1), (p2), (p3), (p4)); }
+#define TRACE5(string, p1, p2, p3, p4, p5)    { logPrint(LOG_LEVEL_TRACE, (string), (p1), (p2), (p3), (p4), (p5)); }
 #else
 #define TRACE0(string)
 #define TRACE1(string, p1)
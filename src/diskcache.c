@@ -0,0 +1,458 @@
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "common.h"
+
+// Persistent cache of device descs and probed formats, to avoid walking the configs and opening all the devices
+// at every JVM start. The cache is keyed by a hash of the config files (mtimes, sizes) and of /proc/asound/cards,
+// any change makes the whole cache invalid.
+
+#ifdef USE_DISK_CACHE
+
+#define CACHE_HEADER        "csjsound-alsapcm"
+#define CACHE_LINE_LEN      (5 * (STR_LEN + 1) + 64)
+#define MAX_FIELDS          6
+
+#define FNV_OFFSET          14695981039346656037ULL
+#define FNV_PRIME           1099511628211ULL
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static int isLoaded = FALSE;
+static int isDirty = FALSE;
+static UINT64 cacheKey = 0;
+// -1 = descs not cached
+static int descsCnt = -1;
+static MixerDesc* descs = NULL;
+static FmtCache entries = {NULL, 0, 0};
+
+static UINT64 hashBytes(UINT64 hash, const void* data, size_t len)
+{
+    const UINT8* bytes = (const UINT8*) data;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static UINT64 hashStr(UINT64 hash, const char* str)
+{
+    // including the terminating zero to separate consecutive strings
+    return hashBytes(hash, str, strlen(str) + 1);
+}
+
+static UINT64 hashStat(UINT64 hash, const struct stat* st)
+{
+    hash = hashBytes(hash, &st->st_mtim, sizeof(st->st_mtim));
+    return hashBytes(hash, &st->st_size, sizeof(st->st_size));
+}
+
+// hashes mtime and size of the file, or of all files in the dir
+static UINT64 hashPath(UINT64 hash, const char* path)
+{
+    struct stat st;
+    hash = hashStr(hash, path);
+    if (stat(path, &st) != 0) {
+        return hashStr(hash, "missing");
+    }
+    hash = hashStat(hash, &st);
+    if (S_ISDIR(st.st_mode)) {
+        DIR* dir = opendir(path);
+        if (dir == NULL) {
+            return hash;
+        }
+        // readdir order is not guaranteed, combining the entry hashes order-independently
+        UINT64 entriesHash = 0;
+        struct dirent* dirEntry;
+        while ((dirEntry = readdir(dir)) != NULL) {
+            if (dirEntry->d_name[0] == '.') {
+                continue;
+            }
+            char entryPath[PATH_MAX];
+            snprintf(entryPath, PATH_MAX, "%s/%s", path, dirEntry->d_name);
+            UINT64 entryHash = hashStr(FNV_OFFSET, dirEntry->d_name);
+            if (stat(entryPath, &st) == 0) {
+                entryHash = hashStat(entryHash, &st);
+            }
+            entriesHash += entryHash;
+        }
+        closedir(dir);
+        hash = hashBytes(hash, &entriesHash, sizeof(entriesHash));
+    }
+    return hash;
+}
+
+// hashes file content, for proc files which do not report size/mtime
+static UINT64 hashContent(UINT64 hash, const char* path)
+{
+    char buf[1024];
+    size_t len;
+    FILE* file = fopen(path, "r");
+    hash = hashStr(hash, path);
+    if (file == NULL) {
+        return hashStr(hash, "missing");
+    }
+    while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
+        hash = hashBytes(hash, buf, len);
+    }
+    fclose(file);
+    return hash;
+}
+
+static UINT64 computeKey()
+{
+    char fullPath[PATH_MAX];
+    UINT64 hash = FNV_OFFSET;
+    int version = DISK_CACHE_VERSION;
+    hash = hashBytes(hash, &version, sizeof(version));
+    hash = hashStr(hash, snd_asoundlib_version());
+    // the cached descs and formats depend on the enumeration and probing settings
+    const Settings* settings = getSettings();
+    hash = hashBytes(hash, settings->probedRates, sizeof(settings->probedRates));
+    hash = hashBytes(hash, settings->probedChannels, sizeof(settings->probedChannels));
+    hash = hashBytes(hash, &settings->maxRate, sizeof(settings->maxRate));
+    hash = hashBytes(hash, &settings->maxChannels, sizeof(settings->maxChannels));
+    hash = hashBytes(hash, settings->ignoredConfigs, sizeof(settings->ignoredConfigs));
+    const char* alsaConfigPath = getenv("ALSA_CONFIG_PATH");
+    if (alsaConfigPath != NULL) {
+        hash = hashStr(hash, alsaConfigPath);
+        hash = hashPath(hash, alsaConfigPath);
+    }
+    int i = 0;
+    while (WATCHED_CONFIGS[i]) {
+        if (expandConfigPath(WATCHED_CONFIGS[i], fullPath, PATH_MAX)) {
+            hash = hashPath(hash, fullPath);
+        }
+        ++i;
+    }
+    return hashContent(hash, "/proc/asound/cards");
+}
+
+static int getCachePath(char* path, int len)
+{
+    const char* cacheHome = getenv("XDG_CACHE_HOME");
+    if (cacheHome != NULL && cacheHome[0] == '/') {
+        snprintf(path, len, "%s/%s", cacheHome, DISK_CACHE_FILE);
+        return TRUE;
+    }
+    const char* home = getenv("HOME");
+    if (home == NULL) {
+        return FALSE;
+    }
+    snprintf(path, len, "%s/.cache/%s", home, DISK_CACHE_FILE);
+    return TRUE;
+}
+
+static void dropCache()
+{
+    clearFmtCache(&entries);
+    free(descs);
+    descs = NULL;
+    descsCnt = -1;
+    isDirty = FALSE;
+}
+
+// splits tab-separated line in place. Returns count of fields
+static int splitLine(char* line, char** fields)
+{
+    int cnt = 0;
+    line[strcspn(line, "\n")] = '\0';
+    while (cnt < MAX_FIELDS) {
+        fields[cnt++] = line;
+        line = strchr(line, '\t');
+        if (line == NULL) {
+            break;
+        }
+        *line++ = '\0';
+    }
+    return cnt;
+}
+
+static void copyField(char* dest, const char* field)
+{
+    strncpy(dest, field, STR_LEN);
+    dest[STR_LEN] = '\0';
+}
+
+// must be called with cacheLock held. Returns FALSE if the file is missing, stale or corrupt
+static int loadCache()
+{
+    char path[PATH_MAX];
+    char line[CACHE_LINE_LEN];
+    char* fields[MAX_FIELDS];
+    if (!getCachePath(path, PATH_MAX)) {
+        return FALSE;
+    }
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        TRACE2("%s: no cache file %s\n", __FUNCTION__, path);
+        return FALSE;
+    }
+    // header line: name, version, key
+    char keyStr[32];
+    snprintf(keyStr, sizeof(keyStr), "%llx", (unsigned long long) cacheKey);
+    if (fgets(line, CACHE_LINE_LEN, file) == NULL || splitLine(line, fields) != 3
+            || strcmp(fields[0], CACHE_HEADER) || atoi(fields[1]) != DISK_CACHE_VERSION || strcmp(fields[2], keyStr)) {
+        TRACE2("%s: cache file %s is stale\n", __FUNCTION__, path);
+        goto error;
+    }
+    FmtEntry* entry = NULL;
+    int fmtsToRead = 0;
+    int descsToRead = 0;
+    while (fgets(line, CACHE_LINE_LEN, file) != NULL) {
+        int cnt = splitLine(line, fields);
+        if (fmtsToRead > 0) {
+            AudioFmt fmt;
+            if (sscanf(fields[0], "%d %d %d %d %d %d %d", &fmt.sampleSignBits, &fmt.frameBytes, &fmt.channels,
+                    &fmt.rate, &fmt.enc, &fmt.isSigned, &fmt.isBigEndian) != 7) {
+                goto error;
+            }
+            if (!addFmt(&entry->list, fmt.sampleSignBits, fmt.frameBytes, fmt.channels, fmt.rate, fmt.enc,
+                    fmt.isSigned, fmt.isBigEndian)) {
+                goto error;
+            }
+            --fmtsToRead;
+        } else if (cnt == 2 && !strcmp(fields[0], "N")) {
+            // count of descs
+            descsToRead = atoi(fields[1]);
+            free(descs);
+            descs = (MixerDesc*) malloc((descsToRead > 0? descsToRead: 1) * sizeof(MixerDesc));
+            if (descs == NULL || descsToRead < 0) {
+                goto error;
+            }
+            descsCnt = 0;
+        } else if (cnt == 6 && !strcmp(fields[0], "D") && descsToRead > 0) {
+            --descsToRead;
+            MixerDesc* desc = &descs[descsCnt++];
+            copyField(desc->deviceID, fields[1]);
+            desc->maxLines = atoi(fields[2]);
+            copyField(desc->name, fields[3]);
+            copyField(desc->vendor, fields[4]);
+            copyField(desc->description, fields[5]);
+        } else if (cnt == 4 && !strcmp(fields[0], "F")) {
+            entry = putFmtEntry(&entries, fields[2], atoi(fields[1]));
+            if (entry == NULL) {
+                goto error;
+            }
+            fmtsToRead = atoi(fields[3]);
+        } else {
+            goto error;
+        }
+    }
+    if (fmtsToRead > 0 || descsToRead > 0) {
+        // truncated
+        goto error;
+    }
+    fclose(file);
+    TRACE4("%s: loaded %s: %d descs, %d format entries\n", __FUNCTION__, path, descsCnt, entries.cnt);
+    return TRUE;
+
+  error:
+    fclose(file);
+    dropCache();
+    return FALSE;
+}
+
+// must be called with cacheLock held
+static void ensureLoaded()
+{
+    if (!isLoaded) {
+        isLoaded = TRUE;
+        cacheKey = computeKey();
+        loadCache();
+    }
+}
+
+// creates the missing parent dirs of the path
+static void makeParentDirs(const char* path)
+{
+    char dir[PATH_MAX];
+    strncpy(dir, path, PATH_MAX - 1);
+    dir[PATH_MAX - 1] = '\0';
+    char* slash;
+    for (slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dir, 0700);
+        *slash = '/';
+    }
+}
+
+static int isStorable(const char* str)
+{
+    return strpbrk(str, "\t\n") == NULL;
+}
+
+// confChanged - result of confWatchCheck (CONF_UNKNOWN after a settings change), the key (stat of all watched
+// configs, cards, settings) is recomputed only if the watch reports a change or cannot tell.
+// Returns TRUE if the cached data are still valid, FALSE if they were dropped because config files or cards changed
+int diskCacheRevalidate(int confChanged)
+{
+    int ret = TRUE;
+    pthread_mutex_lock(&cacheLock);
+    if (!isLoaded) {
+        ensureLoaded();
+    } else if (confChanged != CONF_UNCHANGED) {
+        UINT64 key = computeKey();
+        if (key != cacheKey) {
+            TRACE1("%s: config files or cards changed, dropping cache\n", __FUNCTION__);
+            dropCache();
+            cacheKey = key;
+            ret = FALSE;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return ret;
+}
+
+// Copies the cached descs to *descs array of *capacity size, reallocating if needed.
+// Returns count of descs, -1 if not cached
+int diskCacheGetDescs(MixerDesc** destDescs, int* capacity)
+{
+    int cnt = -1;
+    pthread_mutex_lock(&cacheLock);
+    ensureLoaded();
+    if (descsCnt >= 0) {
+        if (descsCnt > *capacity) {
+            MixerDesc* newDescs = (MixerDesc*) realloc(*destDescs, descsCnt * sizeof(MixerDesc));
+            if (!newDescs) {
+                ERROR1("%s: Out of memory\n", __FUNCTION__);
+                goto end;
+            }
+            *destDescs = newDescs;
+            *capacity = descsCnt;
+        }
+        memcpy(*destDescs, descs, descsCnt * sizeof(MixerDesc));
+        cnt = descsCnt;
+    }
+  end:
+    pthread_mutex_unlock(&cacheLock);
+    return cnt;
+}
+
+void diskCachePutDescs(const MixerDesc* newDescs, int cnt)
+{
+    pthread_mutex_lock(&cacheLock);
+    ensureLoaded();
+    free(descs);
+    descsCnt = -1;
+    descs = (MixerDesc*) malloc((cnt > 0? cnt: 1) * sizeof(MixerDesc));
+    if (descs == NULL) {
+        ERROR1("%s: Out of memory\n", __FUNCTION__);
+    } else {
+        memcpy(descs, newDescs, cnt * sizeof(MixerDesc));
+        descsCnt = cnt;
+        isDirty = TRUE;
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
+
+// appends the cached formats to list. Returns FALSE if not cached
+int diskCacheGetFmts(const char* deviceID, int isSource, FmtList* list)
+{
+    int ret = FALSE;
+    pthread_mutex_lock(&cacheLock);
+    ensureLoaded();
+    FmtEntry* entry = findFmtEntry(&entries, deviceID, isSource);
+    if (entry != NULL) {
+        ret = appendFmtList(list, &entry->list);
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return ret;
+}
+
+void diskCachePutFmts(const char* deviceID, int isSource, const FmtList* list)
+{
+    if (!isStorable(deviceID) || strlen(deviceID) > STR_LEN) {
+        return;
+    }
+    pthread_mutex_lock(&cacheLock);
+    ensureLoaded();
+    FmtEntry* entry = putFmtEntry(&entries, deviceID, isSource);
+    if (entry != NULL) {
+        appendFmtList(&entry->list, list);
+        isDirty = TRUE;
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
+
+// writes the cache file if changed, atomically via rename
+void diskCacheSave()
+{
+    char path[PATH_MAX];
+    // path + "." + pid
+    char tmpPath[PATH_MAX + 16];
+    pthread_mutex_lock(&cacheLock);
+    if (!isDirty || !getCachePath(path, PATH_MAX)) {
+        goto end;
+    }
+    isDirty = FALSE;
+    makeParentDirs(path);
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int) getpid());
+    FILE* file = fopen(tmpPath, "w");
+    if (file == NULL) {
+        ERROR3("%s: cannot write cache file %s: %s\n", __FUNCTION__, tmpPath, strerror(errno));
+        goto end;
+    }
+    fprintf(file, "%s\t%d\t%llx\n", CACHE_HEADER, DISK_CACHE_VERSION, (unsigned long long) cacheKey);
+    int i, j;
+    if (descsCnt >= 0) {
+        int storableCnt = 0;
+        for (i = 0; i < descsCnt; ++i) {
+            if (isStorable(descs[i].deviceID) && isStorable(descs[i].name) && isStorable(descs[i].description))
+                ++storableCnt;
+        }
+        // descs with unstorable chars would change indices, not storing any descs then
+        if (storableCnt == descsCnt) {
+            fprintf(file, "N\t%d\n", descsCnt);
+            for (i = 0; i < descsCnt; ++i) {
+                MixerDesc* desc = &descs[i];
+                fprintf(file, "D\t%s\t%d\t%s\t%s\t%s\n", desc->deviceID, (int) desc->maxLines, desc->name,
+                        desc->vendor, desc->description);
+            }
+        }
+    }
+    for (i = 0; i < entries.cnt; ++i) {
+        FmtEntry* entry = &entries.entries[i];
+        fprintf(file, "F\t%d\t%s\t%d\n", entry->isSource, entry->deviceID, entry->list.cnt);
+        for (j = 0; j < entry->list.cnt; ++j) {
+            AudioFmt* fmt = &entry->list.fmts[j];
+            fprintf(file, "%d %d %d %d %d %d %d\n", fmt->sampleSignBits, fmt->frameBytes, fmt->channels,
+                    fmt->rate, fmt->enc, fmt->isSigned, fmt->isBigEndian);
+        }
+    }
+    if (fclose(file) != 0 || rename(tmpPath, path) != 0) {
+        ERROR3("%s: cannot write cache file %s: %s\n", __FUNCTION__, path, strerror(errno));
+        unlink(tmpPath);
+    } else {
+        TRACE2("%s: saved %s\n", __FUNCTION__, path);
+    }
+  end:
+    pthread_mutex_unlock(&cacheLock);
+}
+
+#else // USE_DISK_CACHE
+
+int diskCacheRevalidate(int confChanged)
+{
+    return TRUE;
+}
+
+int diskCacheGetDescs(MixerDesc** descs, int* capacity)
+{
+    return -1;
+}
+
+void diskCachePutDescs(const MixerDesc* descs, int cnt) {}
+
+int diskCacheGetFmts(const char* deviceID, int isSource, FmtList* list)
+{
+    return FALSE;
+}
+
+void diskCachePutFmts(const char* deviceID, int isSource, const FmtList* list) {}
+
+void diskCacheSave() {}
+
+#endif // USE_DISK_CACHE
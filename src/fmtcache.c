@@ -0,0 +1,113 @@
+#include <pthread.h>
+#include "common.h"
+
+// In-process cache of probed formats per device and direction, dropped together with the device snapshot.
+// Also the storage for the entries of the disk cache.
+
+static FmtCache fmtCache = {NULL, 0, 0};
+static unsigned int fmtCacheGeneration = 0;
+static pthread_mutex_t fmtCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+FmtEntry* findFmtEntry(FmtCache* cache, const char* deviceID, int isSource)
+{
+    int i;
+    for (i = 0; i < cache->cnt; ++i) {
+        if (cache->entries[i].isSource == isSource && !strcmp(cache->entries[i].deviceID, deviceID)) {
+            return &cache->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// returns existing entry with emptied list, or a new entry. NULL if out of memory
+FmtEntry* putFmtEntry(FmtCache* cache, const char* deviceID, int isSource)
+{
+    FmtEntry* entry = findFmtEntry(cache, deviceID, isSource);
+    if (entry != NULL) {
+        freeFmtList(&entry->list);
+        return entry;
+    }
+    if (cache->cnt >= cache->capacity) {
+        int newCapacity = (cache->capacity > 0)? 2 * cache->capacity: SNAPSHOT_INITIAL_CAPACITY;
+        FmtEntry* newEntries = (FmtEntry*) realloc(cache->entries, newCapacity * sizeof(FmtEntry));
+        if (!newEntries) {
+            ERROR1("%s: Out of memory\n", __FUNCTION__);
+            return NULL;
+        }
+        cache->entries = newEntries;
+        cache->capacity = newCapacity;
+    }
+    entry = &cache->entries[cache->cnt++];
+    memset(entry, 0, sizeof(FmtEntry));
+    strncpy(entry->deviceID, deviceID, STR_LEN);
+    entry->isSource = isSource;
+    return entry;
+}
+
+void clearFmtCache(FmtCache* cache)
+{
+    int i;
+    for (i = 0; i < cache->cnt; ++i) {
+        freeFmtList(&cache->entries[i].list);
+    }
+    free(cache->entries);
+    memset(cache, 0, sizeof(FmtCache));
+}
+
+// appends all formats of src to dest. Returns FALSE if out of memory
+int appendFmtList(FmtList* dest, const FmtList* src)
+{
+    int i;
+    for (i = 0; i < src->cnt; ++i) {
+        AudioFmt* fmt = &src->fmts[i];
+        if (!addFmt(dest, fmt->sampleSignBits, fmt->frameBytes, fmt->channels, fmt->rate, fmt->enc,
+                fmt->isSigned, fmt->isBigEndian)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// generation to be passed to fmtCachePut, read before probing
+unsigned int fmtCacheGetGeneration()
+{
+    pthread_mutex_lock(&fmtCacheLock);
+    unsigned int generation = fmtCacheGeneration;
+    pthread_mutex_unlock(&fmtCacheLock);
+    return generation;
+}
+
+// appends the cached formats to list. Returns FALSE if not cached
+int fmtCacheGet(const char* deviceID, int isSource, FmtList* list)
+{
+    int ret = FALSE;
+    pthread_mutex_lock(&fmtCacheLock);
+    FmtEntry* entry = findFmtEntry(&fmtCache, deviceID, isSource);
+    if (entry != NULL) {
+        ret = appendFmtList(list, &entry->list);
+    }
+    pthread_mutex_unlock(&fmtCacheLock);
+    return ret;
+}
+
+// formats probed before the last invalidation (i.e. with older generation) are not stored
+void fmtCachePut(const char* deviceID, int isSource, const FmtList* list, unsigned int generation)
+{
+    pthread_mutex_lock(&fmtCacheLock);
+    if (generation == fmtCacheGeneration) {
+        FmtEntry* entry = putFmtEntry(&fmtCache, deviceID, isSource);
+        if (entry != NULL) {
+            appendFmtList(&entry->list, list);
+        }
+    }
+    pthread_mutex_unlock(&fmtCacheLock);
+}
+
+void fmtCacheInvalidate()
+{
+    pthread_mutex_lock(&fmtCacheLock);
+    TRACE2("%s: dropping %d entries\n", __FUNCTION__, fmtCache.cnt);
+    clearFmtCache(&fmtCache);
+    ++fmtCacheGeneration;
+    pthread_mutex_unlock(&fmtCacheLock);
+}
@@ -0,0 +1,228 @@
+#include <math.h>
+#include "common.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAS_SSE2_KERNELS
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAS_NEON_KERNELS
+#endif
+
+// Per-stream gain of the write path, applied to the integer samples of the formats supported by initConverter.
+// A new target is requested by the controlling thread (packed with the ramp length into one atomic word) and
+// picked up by the writing thread, which ramps linearly from the current gain frame by frame.
+
+
+/********** SCALAR **********/
+
+static inline INT32 scaleSample(INT32 v, float gain, const Converter* conv)
+{
+    float f = (float) v * gain;
+    if (f > conv->maxVal) {
+        f = conv->maxVal;
+    } else if (f < -conv->scale) {
+        f = -conv->scale;
+    }
+    return (INT32) lrintf(f);
+}
+
+static void scaleInt16Scalar(const INT16* src, INT16* dst, int samples, float gain, const Converter* conv)
+{
+    int i;
+    for (i = 0; i < samples; i++) {
+        dst[i] = (INT16) scaleSample(src[i], gain, conv);
+    }
+}
+
+// shift 8 sign-extends 24 bits in the low bytes
+static void scaleInt32Scalar(const INT32* src, INT32* dst, int samples, float gain, const Converter* conv)
+{
+    int i;
+    for (i = 0; i < samples; i++) {
+        INT32 v = (INT32) ((UINT32) src[i] << conv->shift) >> conv->shift;
+        dst[i] = scaleSample(v, gain, conv);
+    }
+}
+
+
+#ifdef HAS_SSE2_KERNELS
+/********** SSE2 **********/
+
+static void scaleInt16(const INT16* src, INT16* dst, int samples, float gain, const Converter* conv)
+{
+    __m128 g = _mm_set1_ps(gain);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), g));
+        hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), g));
+        // saturating pack clips to the 16-bit range
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_packs_epi32(lo, hi));
+    }
+    scaleInt16Scalar(src + i, dst + i, samples - i, gain, conv);
+}
+
+static void scaleInt32(const INT32* src, INT32* dst, int samples, float gain, const Converter* conv)
+{
+    __m128 g = _mm_set1_ps(gain);
+    __m128 minVal = _mm_set1_ps(-conv->scale);
+    __m128 maxVal = _mm_set1_ps(conv->maxVal);
+    __m128i shift = _mm_cvtsi32_si128(conv->shift);
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+        v = _mm_sra_epi32(_mm_sll_epi32(v, shift), shift);
+        __m128 f = _mm_mul_ps(_mm_cvtepi32_ps(v), g);
+        f = _mm_min_ps(_mm_max_ps(f, minVal), maxVal);
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_cvtps_epi32(f));
+    }
+    scaleInt32Scalar(src + i, dst + i, samples - i, gain, conv);
+}
+
+#elif defined(HAS_NEON_KERNELS)
+/********** NEON **********/
+
+static void scaleInt16(const INT16* src, INT16* dst, int samples, float gain, const Converter* conv)
+{
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        int16x8_t v = vld1q_s16(src + i);
+        float32x4_t lo = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), gain);
+        float32x4_t hi = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), gain);
+        // saturating narrowing clips to the 16-bit range
+        vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(lo)), vqmovn_s32(vcvtnq_s32_f32(hi))));
+    }
+    scaleInt16Scalar(src + i, dst + i, samples - i, gain, conv);
+}
+
+static void scaleInt32(const INT32* src, INT32* dst, int samples, float gain, const Converter* conv)
+{
+    int32x4_t left = vdupq_n_s32(conv->shift);
+    // negative shift of signed lanes is arithmetic right shift
+    int32x4_t right = vdupq_n_s32(-conv->shift);
+    float32x4_t minVal = vdupq_n_f32(-conv->scale);
+    float32x4_t maxVal = vdupq_n_f32(conv->maxVal);
+    int i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        int32x4_t v = vld1q_s32((const int32_t*) (src + i));
+        v = vshlq_s32(vshlq_s32(v, left), right);
+        float32x4_t f = vmulq_n_f32(vcvtq_f32_s32(v), gain);
+        f = vminq_f32(vmaxq_f32(f, minVal), maxVal);
+        vst1q_s32((int32_t*) (dst + i), vcvtnq_s32_f32(f));
+    }
+    scaleInt32Scalar(src + i, dst + i, samples - i, gain, conv);
+}
+
+#else
+#define scaleInt16 scaleInt16Scalar
+#define scaleInt32 scaleInt32Scalar
+#endif
+
+
+/********** GAIN **********/
+
+static inline UINT64 packRequest(float target, int rampFrames)
+{
+    union { float f; UINT32 i; } u;
+    u.f = target;
+    return ((UINT64) u.i << 32) | (UINT32) rampFrames;
+}
+
+// src and dst can be the same buffer
+static void scaleSamples(const Converter* conv, const char* src, char* dst, int samples, float gain)
+{
+    if (conv->sampleBytes == 2) {
+        scaleInt16((const INT16*) src, (INT16*) dst, samples, gain, conv);
+    } else if (conv->sampleBytes == 4) {
+        scaleInt32((const INT32*) src, (INT32*) dst, samples, gain, conv);
+    } else {
+        // packed 24 bits through 32-bit samples, sign extended by the kernel
+        INT32 chunk[PACKED_CHUNK_SAMPLES];
+        while (samples > 0) {
+            int cnt = (samples < PACKED_CHUNK_SAMPLES)? samples: PACKED_CHUNK_SAMPLES;
+            unpackInt24(src, chunk, cnt);
+            scaleInt32(chunk, chunk, cnt, gain, conv);
+            packInt24(chunk, dst, cnt);
+            src += 3 * cnt;
+            dst += 3 * cnt;
+            samples -= cnt;
+        }
+    }
+}
+
+void initGain(Gain* gain)
+{
+    gain->level = 1.0f;
+    gain->isMuted = FALSE;
+    gain->current = 1.0f;
+    gain->target = 1.0f;
+    gain->step = 0.0f;
+    gain->rampLeft = 0;
+    gain->request = packRequest(1.0f, 0);
+    gain->appliedRequest = gain->request;
+}
+
+// controlling thread, called with level/isMuted updated under the PcmInfo lock
+void requestGain(Gain* gain, int rampFrames)
+{
+    float target = gain->isMuted? 0.0f: gain->level;
+    __atomic_store_n(&gain->request, packRequest(target, rampFrames), __ATOMIC_RELEASE);
+}
+
+// writing thread. Picks up a new request, returns FALSE if the samples pass unchanged
+int isGainActive(Gain* gain)
+{
+    UINT64 request = __atomic_load_n(&gain->request, __ATOMIC_ACQUIRE);
+    if (request != gain->appliedRequest) {
+        union { UINT32 i; float f; } u;
+        u.i = (UINT32) (request >> 32);
+        int rampFrames = (int) (UINT32) request;
+        gain->appliedRequest = request;
+        gain->target = u.f;
+        if (rampFrames > 0) {
+            gain->step = (gain->target - gain->current) / rampFrames;
+            gain->rampLeft = rampFrames;
+        } else {
+            gain->current = gain->target;
+            gain->rampLeft = 0;
+        }
+    }
+    return gain->rampLeft > 0 || gain->current != 1.0f;
+}
+
+// writing thread. Does not advance the ramp, the caller advances by the frames actually written
+void applyGain(Gain* gain, const Converter* conv, const char* src, char* dst, int frames, int channels)
+{
+    int f;
+    int frameBytes = conv->sampleBytes * channels;
+    int rampFrames = (gain->rampLeft < frames)? gain->rampLeft: frames;
+    for (f = 0; f < rampFrames; f++) {
+        scaleSamples(conv, src, dst, channels, gain->current + gain->step * (f + 1));
+        src += frameBytes;
+        dst += frameBytes;
+    }
+    int bytes = (frames - rampFrames) * frameBytes;
+    if (gain->target == 0.0f) {
+        memset(dst, 0, bytes);
+    } else if (gain->target == 1.0f) {
+        if (src != dst) {
+            memcpy(dst, src, bytes);
+        }
+    } else {
+        scaleSamples(conv, src, dst, (frames - rampFrames) * channels, gain->target);
+    }
+}
+
+void advanceGain(Gain* gain, int frames)
+{
+    if (frames >= gain->rampLeft) {
+        gain->current = gain->target;
+        gain->rampLeft = 0;
+    } else {
+        gain->current += gain->step * frames;
+        gain->rampLeft -= frames;
+    }
+}
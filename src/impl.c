@@ -1,17 +1,27 @@
+#include <errno.h>
 #include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "common.h"
 
 static void alsaDbgOut(const char *file, int line, const char *function, int err, const char *fmt, ...)
 {
 #ifdef OUTPUT_ALSA_ERRORS
-    va_list args;
-    va_start(args, fmt);
-    printf("%s:%d function %s: error %d: %s\n", file, line, function, err, snd_strerror(err));
+    // one logPrint call, honouring log_level and log_target and not interleaving with other threads
+    char msg[512];
+    msg[0] = '\0';
     if (strlen(fmt) > 0) {
-        vprintf(fmt, args);
-        printf("\n");
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, args);
+        va_end(args);
     }
-    va_end(args);
+    logPrint(LOG_LEVEL_ERROR, "%s:%d function %s: error %d: %s\n%s%s", file, line, function, err, snd_strerror(err),
+            msg, (msg[0] != '\0')? "\n": "");
 #endif
 }
 
@@ -32,19 +42,31 @@ inline static const char* getDirStr(int isSource)
 	return isSource? "PLAY" : "CAPT";
 }
 
+// the alsa error handler is global, counting opens with disabled debug running in parallel (e.g. probing threads)
+static int silentOpensCnt = 0;
+static pthread_mutex_t silentOpensLock = PTHREAD_MUTEX_INITIALIZER;
+
 int openDeviceID(const char* deviceID, snd_pcm_t** handle, int isSource, int logError)
 {
     initAlsalib();
     TRACE2("%s: Opening PCM device %s\n", __FUNCTION__, deviceID);
     if (!logError) {
         // disabling alsa debug
-        snd_lib_error_set_handler(&alsaNODbgOut);
+        pthread_mutex_lock(&silentOpensLock);
+        if (silentOpensCnt++ == 0)
+            snd_lib_error_set_handler(&alsaNODbgOut);
+        pthread_mutex_unlock(&silentOpensLock);
     }
     int ret = snd_pcm_open(handle, deviceID,
                        isSource? SND_PCM_STREAM_PLAYBACK: SND_PCM_STREAM_CAPTURE,
                        SND_PCM_NONBLOCK);
-	// restoring alsa debug
-	snd_lib_error_set_handler(&alsaDbgOut);
+    if (!logError) {
+        // restoring alsa debug
+        pthread_mutex_lock(&silentOpensLock);
+        if (--silentOpensCnt == 0)
+            snd_lib_error_set_handler(&alsaDbgOut);
+        pthread_mutex_unlock(&silentOpensLock);
+    }
     if (ret != 0) {
         if (logError) {
             ERROR4("%s: snd_pcm_open of dev %s %s: %s\n", __FUNCTION__, deviceID, getDirStr(isSource), snd_strerror(ret));
@@ -57,36 +79,26 @@ int openDeviceID(const char* deviceID, snd_pcm_t** handle, int isSource, int log
     return ret;
 }
 
-typedef int (*DescBuilder)(const char* deviceID, const char* type, MixerDesc* desc);
-
-int buildDesc(const char* deviceID, const char* type, MixerDesc* desc)
+static void buildDesc(const char* deviceID, const char* type, MixerDesc* desc)
 {
-    initAlsalib();
-    if (desc->down_counter == 0) {
-        // we found the device with correct index
-        TRACE2("%s: Building desc for device %s\n", __FUNCTION__, deviceID);
-        desc->maxLines = 1;
-        strncpy(desc->name, "PCM: ", STR_LEN);
-        strncat(desc->name, deviceID, STR_LEN - strlen(desc->name));
-        strncpy(desc->deviceID, deviceID, STR_LEN);
-        strncpy(desc->vendor, "ALSA", STR_LEN);
-        strncpy(desc->description, "Config type: ", STR_LEN);
-        strncat(desc->description, type, STR_LEN - strlen(desc->description));
-        // found, break walk
-        return TRUE;
-    } else {
-        // not found, continue walking
-        desc->down_counter--;
-        return FALSE;
-    }
+    TRACE2("%s: Building desc for device %s\n", __FUNCTION__, deviceID);
+    memset(desc, 0, sizeof(MixerDesc));
+    desc->maxLines = 1;
+    strncpy(desc->name, "PCM: ", STR_LEN);
+    strncat(desc->name, deviceID, STR_LEN - strlen(desc->name));
+    strncpy(desc->deviceID, deviceID, STR_LEN);
+    strncpy(desc->vendor, "ALSA", STR_LEN);
+    strncpy(desc->description, "Config type: ", STR_LEN);
+    strncat(desc->description, type, STR_LEN - strlen(desc->description));
 }
 
 
 static int ignoreConfig(const char *configID)
 {
+    const Settings* settings = getSettings();
     int i = 0;
-    while(IGNORED_CONFIGS[i]) {
-        if (!strcmp(configID, IGNORED_CONFIGS[i])) {
+    while(settings->ignoredConfigs[i][0]) {
+        if (!strcmp(configID, settings->ignoredConfigs[i])) {
             return TRUE;
         }
         ++i;
@@ -94,20 +106,44 @@ static int ignoreConfig(const char *configID)
     return FALSE;
 }
 
-// returns count of configs walked or -1 if error
-int walkConfigs(DescBuilder builder, MixerDesc* desc)
+/******** DEVICE SNAPSHOT **********/
+// all descs found by the last walk, indexed directly by mixer idx
+static MixerDesc* snapshotDescs = NULL;
+static int snapshotCapacity = 0;
+// -1 = snapshot not built yet
+static int snapshotCnt = -1;
+static pthread_mutex_t snapshotLock = PTHREAD_MUTEX_INITIALIZER;
+
+static MixerDesc* addSnapshotDesc()
+{
+    if (snapshotCnt >= snapshotCapacity) {
+        int newCapacity = (snapshotCapacity > 0)? 2 * snapshotCapacity: SNAPSHOT_INITIAL_CAPACITY;
+        MixerDesc* newDescs = (MixerDesc*) realloc(snapshotDescs, newCapacity * sizeof(MixerDesc));
+        if (!newDescs) {
+            ERROR1("%s: Out of memory\n", __FUNCTION__);
+            return NULL;
+        }
+        snapshotDescs = newDescs;
+        snapshotCapacity = newCapacity;
+    }
+    return &snapshotDescs[snapshotCnt++];
+}
+
+// walks the pcm configs once, storing descs of all non-ignored configs into the snapshot.
+// Must be called with snapshotLock held. Returns count of configs walked or -1 if error
+static int walkConfigs()
 {
     snd_config_t *topNode = NULL;
-    int cnt = 0;
     int ret;
 
+    snapshotCnt = 0;
     /* Iterate over configured PCM devices */
     if (NULL == snd_config) {
         TRACE1("%s: Updating snd_config\n", __FUNCTION__);
         ret = snd_config_update();
         if (ret < 0) {
             ERROR2("%s: snd_config_update: %s\n", __FUNCTION__, snd_strerror(ret));
-            return -1;
+            goto error;
         }
     }
     ret = snd_config_search(snd_config, "pcm", &topNode);
@@ -123,85 +159,313 @@ int walkConfigs(DescBuilder builder, MixerDesc* desc)
             if (ret < 0) {
                 if (-ENOENT != ret) {
                     ERROR2("%s: snd_config_search: %s", __FUNCTION__, snd_strerror(ret));
-                    return -1;
+                    goto error;
                 }
             }
             else {
                 ret = snd_config_get_string(type, &typeStr);
                 if (ret < 0) {
                     ERROR2("%s: snd_config_get_string: %s", __FUNCTION__, snd_strerror(ret));
-                    return -1;
+                    goto error;
                 }
             }
             ret = snd_config_get_id(entry, &idStr);
             if (ret < 0) {
                 ERROR2("%s: snd_config_get_id: %s", __FUNCTION__, snd_strerror(ret));
-                return -1;
+                goto error;
             }
             if (ignoreConfig(idStr)) {
                 TRACE3("%s: Ignoring config [%s] of type [%s]\n", __FUNCTION__, idStr, typeStr);
                 continue;
             }
             TRACE3("%s: Found config [%s] of type [%s]\n", __FUNCTION__, idStr, typeStr);
-            ++cnt;
-            if (builder != NULL) {
-                // must build description
-                if ((*builder)(idStr, typeStr, desc))
-                    // found
-                    break;
+            MixerDesc* desc = addSnapshotDesc();
+            if (desc == NULL) {
+                goto error;
             }
+            buildDesc(idStr, typeStr, desc);
         }
     } else
         ERROR2("%s: snd_config_search: %s\n", __FUNCTION__, snd_strerror(ret));
-    return cnt;
+    return snapshotCnt;
+
+  error:
+    // the next call will try walking again
+    snapshotCnt = -1;
+    return -1;
+}
+
+// must be called with snapshotLock held
+static void invalidateSnapshot()
+{
+    snapshotCnt = -1;
+    // formats of the devices could have changed too
+    fmtCacheInvalidate();
+}
+
+// Reloads snd_config and drops the snapshot if the alsa config changed.
+// Must be called with snapshotLock held
+static void checkConfigChanges()
+{
+    int changed = confWatchCheck();
+    if (!diskCacheRevalidate(changed)) {
+        // config files or cards changed since the cache was saved
+        invalidateSnapshot();
+    }
+    if (changed == CONF_UNCHANGED) {
+        return;
+    }
+    if (snd_config == NULL) {
+        // config not loaded yet, the snapshot is empty or restored from the disk cache
+        if (changed == CONF_CHANGED) {
+            invalidateSnapshot();
+        }
+        return;
+    }
+    if (changed == CONF_CHANGED) {
+        // snd_config_update checks only the top-level config files, included files (e.g. ~/.asoundrc) need a full reload
+        TRACE1("%s: config files changed, freeing snd_config\n", __FUNCTION__);
+        snd_config_update_free_global();
+    }
+    int ret = snd_config_update();
+    if (ret < 0) {
+        ERROR2("%s: snd_config_update: %s\n", __FUNCTION__, snd_strerror(ret));
+        return;
+    }
+    if (ret > 0 || changed == CONF_CHANGED) {
+        TRACE1("%s: snd_config reloaded, invalidating snapshot\n", __FUNCTION__);
+        invalidateSnapshot();
+    }
+}
+
+// must be called with snapshotLock held
+static int ensureSnapshot()
+{
+    if (snapshotCnt < 0) {
+        // the disk cache is valid only for the current config files, skipping loading of snd_config altogether
+        snapshotCnt = diskCacheGetDescs(&snapshotDescs, &snapshotCapacity);
+        if (snapshotCnt >= 0) {
+            TRACE2("%s: %d descs from disk cache\n", __FUNCTION__, snapshotCnt);
+        } else if (walkConfigs() >= 0) {
+            diskCachePutDescs(snapshotDescs, snapshotCnt);
+            diskCacheSave();
+        }
+    }
+    return snapshotCnt;
 }
 
 
+// Returns TRUE. Settings changing the enumeration or probing drop the snapshot, the formats and the disk cache
+int doInit(int logLevel, const char* logTarget, const int* rates, int ratesCnt, const int* channels,
+        int channelsCnt, int maxRate, int maxChannels)
+{
+    if (initSettings(logLevel, logTarget, rates, ratesCnt, channels, channelsCnt, maxRate, maxChannels)) {
+        pthread_mutex_lock(&snapshotLock);
+        // the disk cache key hashes the settings, recomputing it drops the data probed under the old ones
+        diskCacheRevalidate(CONF_UNKNOWN);
+        invalidateSnapshot();
+        pthread_mutex_unlock(&snapshotLock);
+    }
+    return TRUE;
+}
+
 INT32 doGetMixerCnt()
 {
-    return (INT32) walkConfigs(NULL, NULL);
+    initAlsalib();
+    pthread_mutex_lock(&snapshotLock);
+    // the list is refreshed only here, the following doFillDesc calls must see the same snapshot
+    checkConfigChanges();
+    int cnt = ensureSnapshot();
+    pthread_mutex_unlock(&snapshotLock);
+    return (INT32) cnt;
 }
 
 
-INT32 doFillDesc(MixerDesc* desc)
+INT32 doFillDesc(INT32 idx, MixerDesc* desc)
 {
+    int ret = FALSE;
     initAlsalib();
-    TRACE2("%s: idx = %d\n", __FUNCTION__, desc->down_counter);
-    int ret = walkConfigs(&buildDesc, desc);
-    if (ret < 0)
-        // error
-        return FALSE;
-    return (desc->down_counter == 0)? TRUE: FALSE;
+    TRACE2("%s: idx = %d\n", __FUNCTION__, idx);
+    pthread_mutex_lock(&snapshotLock);
+    if (ensureSnapshot() > idx && idx >= 0) {
+        memcpy(desc, &snapshotDescs[idx], sizeof(MixerDesc));
+        ret = TRUE;
+    }
+    pthread_mutex_unlock(&snapshotLock);
+    return ret;
+}
+
+// Refreshes the snapshot like doGetMixerCnt and returns its copy in one step, consistent even if another thread
+// rebuilds the snapshot meanwhile. The caller must free *descs. Returns count of descs or -1 if error
+INT32 doGetAllDescs(MixerDesc** descs)
+{
+    initAlsalib();
+    *descs = NULL;
+    pthread_mutex_lock(&snapshotLock);
+    checkConfigChanges();
+    int cnt = ensureSnapshot();
+    if (cnt > 0) {
+        *descs = (MixerDesc*) malloc(cnt * sizeof(MixerDesc));
+        if (*descs == NULL) {
+            ERROR1("%s: Out of memory\n", __FUNCTION__);
+            cnt = -1;
+        } else {
+            memcpy(*descs, snapshotDescs, cnt * sizeof(MixerDesc));
+        }
+    }
+    pthread_mutex_unlock(&snapshotLock);
+    return (INT32) cnt;
+}
+/******** FORMATS **********/
+// returns FALSE if out of memory
+int addFmt(FmtList* list, int sampleSignBits, int frameBytes, int channels, int rate, int enc, int isSigned, int isBigEndian)
+{
+    if (list->cnt >= list->capacity) {
+        int newCapacity = (list->capacity > 0)? 2 * list->capacity: FMT_LIST_INITIAL_CAPACITY;
+        AudioFmt* newFmts = (AudioFmt*) realloc(list->fmts, newCapacity * sizeof(AudioFmt));
+        if (!newFmts) {
+            ERROR1("%s: Out of memory\n", __FUNCTION__);
+            return FALSE;
+        }
+        list->fmts = newFmts;
+        list->capacity = newCapacity;
+    }
+    AudioFmt* fmt = &list->fmts[list->cnt++];
+    fmt->sampleSignBits = sampleSignBits;
+    fmt->frameBytes = frameBytes;
+    fmt->channels = channels;
+    fmt->rate = rate;
+    fmt->enc = enc;
+    fmt->isSigned = isSigned;
+    fmt->isBigEndian = isBigEndian;
+    return TRUE;
 }
-static void addFmtForChannels(AddFmtMethodInfo* mInfo, int sampleSignBits, int sampleBytes,
+
+void freeFmtList(FmtList* list)
+{
+    free(list->fmts);
+    memset(list, 0, sizeof(FmtList));
+}
+
+static void addFmtForChannels(FmtList* list, int sampleSignBits, int sampleBytes,
 			int channelsMin, int channelsMax, int rate, int enc, int isSigned, int isBigEndian)
 {
-    clbkAddAudioFmt(mInfo, sampleSignBits, sampleBytes * channelsMin, channelsMin, rate, enc, isSigned, isBigEndian);
+    addFmt(list, sampleSignBits, sampleBytes * channelsMin, channelsMin, rate, enc, isSigned, isBigEndian);
     if (channelsMax > channelsMin) {
         // we do not know the actual number of channels - only format with channelsMin, channelsMax, and unspecified
-        clbkAddAudioFmt(mInfo, sampleSignBits, sampleBytes * channelsMax, channelsMax, rate, enc, isSigned, isBigEndian);
+        addFmt(list, sampleSignBits, sampleBytes * channelsMax, channelsMax, rate, enc, isSigned, isBigEndian);
         if (channelsMin == 1 && channelsMax > 2) {
             // stereo is important
-            clbkAddAudioFmt(mInfo, sampleSignBits, sampleBytes * 2, 2, rate, enc, isSigned, isBigEndian);
+            addFmt(list, sampleSignBits, sampleBytes * 2, 2, rate, enc, isSigned, isBigEndian);
         }
         if (channelsMax > channelsMin + 1 && channelsMax > 3) {
             // there can be some channels in between which have not been added yet - unspecified channels => unspecified frameBytes
-            clbkAddAudioFmt(mInfo, sampleSignBits, NOT_SPECIFIED, NOT_SPECIFIED, rate, enc, isSigned, isBigEndian);
+            addFmt(list, sampleSignBits, NOT_SPECIFIED, NOT_SPECIFIED, rate, enc, isSigned, isBigEndian);
         }
     }
 }
 
-void doGetFmts(const char* deviceID, int isSource, AddFmtMethodInfo* mInfo) {
+#ifdef EXACT_FMT_PROBING
+// adds formats for all channel counts the device accepts with the params already restricted to format and rate
+static void addExactChannels(snd_pcm_t* handle, snd_pcm_hw_params_t* rateParams, FmtList* list, int sampleSignBits,
+            int sampleBytes, unsigned int channelsMin, unsigned int channelsMax, int rate, int enc, int isSigned, int isBigEndian)
+{
+    const Settings* settings = getSettings();
+    unsigned int channels;
+    unsigned int maxTested = (channelsMax > settings->maxChannels)? settings->maxChannels: channelsMax;
+    if (settings->probedChannels[0] > 0) {
+        // only the listed channel counts
+        int i;
+        for (i = 0; settings->probedChannels[i] > 0; ++i) {
+            channels = settings->probedChannels[i];
+            if (channels >= channelsMin && channels <= maxTested
+                    && snd_pcm_hw_params_test_channels(handle, rateParams, channels) == 0) {
+                addFmt(list, sampleSignBits, sampleBytes * channels, channels, rate, enc, isSigned, isBigEndian);
+            }
+        }
+    } else {
+        for (channels = channelsMin; channels <= maxTested; ++channels) {
+            if (snd_pcm_hw_params_test_channels(handle, rateParams, channels) == 0) {
+                addFmt(list, sampleSignBits, sampleBytes * channels, channels, rate, enc, isSigned, isBigEndian);
+            }
+        }
+    }
+    if (channelsMax > maxTested) {
+        // channels above the tested range - unspecified channels => unspecified frameBytes
+        addFmt(list, sampleSignBits, NOT_SPECIFIED, NOT_SPECIFIED, rate, enc, isSigned, isBigEndian);
+    }
+}
+
+// Returns TRUE if added format for the rate, i.e. the device runs natively at the rate
+static int addExactRate(snd_pcm_t* handle, snd_pcm_hw_params_t* fmtParams, snd_pcm_hw_params_t* rateParams,
+            FmtList* list, int sampleSignBits, int sampleBytes, unsigned int rate, int enc, int isSigned, int isBigEndian)
+{
+    snd_pcm_hw_params_copy(rateParams, fmtParams);
+    if (snd_pcm_hw_params_set_rate(handle, rateParams, rate, 0) < 0) {
+        return FALSE;
+    }
+    // channels range can depend on rate (e.g. fewer channels at high rates)
+    unsigned int channelsMin, channelsMax;
+    if (snd_pcm_hw_params_get_channels_min(rateParams, &channelsMin) != 0
+            || snd_pcm_hw_params_get_channels_max(rateParams, &channelsMax) != 0) {
+        return FALSE;
+    }
+    addExactChannels(handle, rateParams, list, sampleSignBits, sampleBytes, channelsMin, channelsMax, (int) rate,
+            enc, isSigned, isBigEndian);
+    return TRUE;
+}
+
+// Tests standard rates and each channel count with params restricted to the format, to report only natively supported
+// combinations. Devices accepting also a non-standard rate (i.e. converting) get also formats with unspecified rate
+static void addExactFmts(snd_pcm_t* handle, snd_pcm_hw_params_t* fmtParams, FmtList* list, int sampleSignBits,
+            int sampleBytes, unsigned int rateMin, unsigned int rateMax, unsigned int channelsMin, unsigned int channelsMax,
+            int enc, int isSigned, int isBigEndian)
+{
+    snd_pcm_hw_params_t* rateParams;
+    snd_pcm_hw_params_alloca(&rateParams);
+    int i;
+    int addedCnt = 0;
+    const Settings* settings = getSettings();
+    const unsigned int* probedRates = settings->probedRates;
+    for (i = 0; probedRates[i] > 0; ++i) {
+        unsigned int rate = probedRates[i];
+        if (rate >= rateMin && rate <= rateMax && addExactRate(handle, fmtParams, rateParams, list, sampleSignBits,
+                sampleBytes, rate, enc, isSigned, isBigEndian)) {
+            ++addedCnt;
+        }
+    }
+    if (addedCnt == 0) {
+        // no standard rate, reporting the range limits
+        addExactRate(handle, fmtParams, rateParams, list, sampleSignBits, sampleBytes, rateMin, enc, isSigned, isBigEndian);
+        if (rateMax > rateMin && rateMax <= INT_MAX) {
+            addExactRate(handle, fmtParams, rateParams, list, sampleSignBits, sampleBytes, rateMax, enc, isSigned, isBigEndian);
+        }
+    }
+    if (rateMax > rateMin && snd_pcm_hw_params_test_rate(handle, fmtParams, rateMin + 1, 0) == 0) {
+        // continuous range (e.g. plug with rate converter), any rate can be requested
+        if (channelsMax > settings->maxChannels) {
+            channelsMax = (channelsMin > settings->maxChannels)? channelsMin: settings->maxChannels;
+        }
+        addFmtForChannels(list, sampleSignBits, sampleBytes, channelsMin, channelsMax, NOT_SPECIFIED, enc, isSigned, isBigEndian);
+    }
+}
+#endif
+
+// opens the device and appends its supported formats to list. Returns TRUE if the device was probed completely
+static int probeFmts(const char* deviceID, int isSource, FmtList* list) {
+    int isProbed = FALSE;
     // opening the device to find out supported formats
     snd_pcm_t* handle;
     if (openDeviceID(deviceID, &handle, isSource, FALSE) < 0) {
         TRACE2("%s: opening device %s failed\n", __FUNCTION__, deviceID);
-        return;
+        return FALSE;
     }
     snd_pcm_format_mask_t* formatMask;
 	snd_pcm_format_mask_alloca(&formatMask);
     snd_pcm_hw_params_t* hwParams;
     snd_pcm_hw_params_alloca(&hwParams);
+    snd_pcm_hw_params_t* fmtParams;
+    snd_pcm_hw_params_alloca(&fmtParams);
     int ret = snd_pcm_hw_params_any(handle, hwParams);
     if (ret < 0) {
         ERROR4("%s: dev %s %s: snd_pcm_hw_params_any: %d\n", __FUNCTION__, deviceID, getDirStr(isSource), ret);
@@ -235,14 +499,22 @@ void doGetFmts(const char* deviceID, int isSource, AddFmtMethodInfo* mInfo) {
 	    int isSigned = (snd_pcm_format_signed(format) > 0);
 	    int isBigEndian = (snd_pcm_format_big_endian(format) > 0);
 
+        // rates and channels can depend on format, restricting the params
+        snd_pcm_hw_params_copy(fmtParams, hwParams);
+        ret = snd_pcm_hw_params_set_format(handle, fmtParams, format);
+        if (ret < 0) {
+            TRACE4("%s: dev %s %s: cannot restrict to format %s\n", __FUNCTION__, deviceID, getDirStr(isSource), snd_pcm_format_name(format));
+            continue;
+        }
+
 	    // fetching rates
 	    unsigned int rateMin, rateMax;
-		ret = snd_pcm_hw_params_get_rate_min(hwParams, &rateMin, 0);
+		ret = snd_pcm_hw_params_get_rate_min(fmtParams, &rateMin, 0);
         if (ret != 0) {
             ERROR4("%s: dev %s %s: snd_pcm_hw_params_get_rate_min: %d\n", __FUNCTION__, deviceID, getDirStr(isSource), ret);
             goto end;
         }
-		ret = snd_pcm_hw_params_get_rate_max(hwParams, &rateMax, 0);
+		ret = snd_pcm_hw_params_get_rate_max(fmtParams, &rateMax, 0);
         if (ret != 0) {
             ERROR4("%s: dev %s %s: snd_pcm_hw_params_get_rate_max: %d\n", __FUNCTION__, deviceID, getDirStr(isSource), ret);
             goto end;
@@ -251,29 +523,126 @@ void doGetFmts(const char* deviceID, int isSource, AddFmtMethodInfo* mInfo) {
         // Rate is passed as int, but alsa returns UINT_MAX from plug plugin. Clamping to singed int
         if (rateMax > INT_MAX)
             rateMax = INT_MAX;
+        // pruning rates above the limit of the settings
+        const Settings* settings = getSettings();
+        if (rateMin > settings->maxRate) {
+            TRACE4("%s: dev %s %s: format %s only above max. rate\n", __FUNCTION__, deviceID, getDirStr(isSource), snd_pcm_format_name(format));
+            continue;
+        }
+        if (rateMax > settings->maxRate)
+            rateMax = settings->maxRate;
 
         // fetching channels
         unsigned int channelsMin, channelsMax;
-        ret = snd_pcm_hw_params_get_channels_min(hwParams, &channelsMin);
+        ret = snd_pcm_hw_params_get_channels_min(fmtParams, &channelsMin);
         if (ret != 0) {
             ERROR4("%s: dev %s %s: snd_pcm_hw_params_get_channels_min: %d\n", __FUNCTION__, deviceID, getDirStr(isSource), ret);
             goto end;
         }
-        ret = snd_pcm_hw_params_get_channels_max(hwParams, &channelsMax);
+        ret = snd_pcm_hw_params_get_channels_max(fmtParams, &channelsMax);
         if (ret != 0) {
             ERROR4("%s: dev %s %s: snd_pcm_hw_params_get_channels_max: %d\n", __FUNCTION__, deviceID, getDirStr(isSource), ret);
             goto end;
         }
 	    TRACE5("%s: dev %s %s: channelsMin=%d, channelsMax=%d\n", __FUNCTION__, deviceID, getDirStr(isSource), channelsMin, channelsMax);
 
-        addFmtForChannels(mInfo, sampleSignBits, sampleBytes, channelsMin, channelsMax, rateMin, enc, isSigned, isBigEndian);
+#ifdef EXACT_FMT_PROBING
+        addExactFmts(handle, fmtParams, list, sampleSignBits, sampleBytes, rateMin, rateMax, channelsMin, channelsMax,
+                enc, isSigned, isBigEndian);
+#else
+        if (channelsMax > settings->maxChannels) {
+            channelsMax = (channelsMin > settings->maxChannels)? channelsMin: settings->maxChannels;
+        }
+        addFmtForChannels(list, sampleSignBits, sampleBytes, channelsMin, channelsMax, rateMin, enc, isSigned, isBigEndian);
         if (rateMax > rateMin) {
-            addFmtForChannels(mInfo, sampleSignBits, sampleBytes, channelsMin, channelsMax, rateMax, enc, isSigned, isBigEndian);
-            addFmtForChannels(mInfo, sampleSignBits, sampleBytes, channelsMin, channelsMax, NOT_SPECIFIED, enc, isSigned, isBigEndian);
+            addFmtForChannels(list, sampleSignBits, sampleBytes, channelsMin, channelsMax, rateMax, enc, isSigned, isBigEndian);
+            addFmtForChannels(list, sampleSignBits, sampleBytes, channelsMin, channelsMax, NOT_SPECIFIED, enc, isSigned, isBigEndian);
         }
+#endif
     }
+    isProbed = TRUE;
   end:
     snd_pcm_close(handle);
+    return isProbed;
+}
+
+// appends formats from caches or probes the device. Saving the disk cache is left to the caller
+static void getFmts(const char* deviceID, int isSource, FmtList* list) {
+    unsigned int generation = fmtCacheGetGeneration();
+    if (fmtCacheGet(deviceID, isSource, list)) {
+        TRACE4("%s: dev %s %s: %d formats from cache\n", __FUNCTION__, deviceID, getDirStr(isSource), list->cnt);
+    } else if (diskCacheGetFmts(deviceID, isSource, list)) {
+        TRACE4("%s: dev %s %s: %d formats from disk cache\n", __FUNCTION__, deviceID, getDirStr(isSource), list->cnt);
+        fmtCachePut(deviceID, isSource, list, generation);
+    } else if (probeFmts(deviceID, isSource, list)) {
+        fmtCachePut(deviceID, isSource, list, generation);
+        diskCachePutFmts(deviceID, isSource, list);
+    }
+}
+
+void doGetFmts(const char* deviceID, int isSource, AddFmtMethodInfo* mInfo) {
+    FmtList list;
+    memset(&list, 0, sizeof(FmtList));
+    getFmts(deviceID, isSource, &list);
+    diskCacheSave();
+    clbkAddAudioFmts(mInfo, &list);
+    freeFmtList(&list);
+}
+
+
+typedef struct {
+    MixerDesc* descs;
+    // jobs = both directions of each desc
+    int jobsCnt;
+    int nextJob;
+} ProbeJobs;
+
+static void* probeWorker(void* arg)
+{
+    ProbeJobs* jobs = (ProbeJobs*) arg;
+    int job;
+    while ((job = __sync_fetch_and_add(&jobs->nextJob, 1)) < jobs->jobsCnt) {
+        FmtList list;
+        memset(&list, 0, sizeof(FmtList));
+        getFmts(jobs->descs[job / 2].deviceID, job % 2, &list);
+        freeFmtList(&list);
+    }
+    return NULL;
+}
+
+// Probes formats of all devices in both directions in parallel, storing them into the caches.
+// Returns count of devices or -1 if error
+INT32 doProbeAllFmts()
+{
+    ProbeJobs jobs;
+    pthread_t threads[PROBE_THREADS];
+    int i, threadsCnt;
+
+    INT32 cnt = doGetAllDescs(&jobs.descs);
+    if (cnt <= 0) {
+        return cnt;
+    }
+    jobs.jobsCnt = 2 * cnt;
+    jobs.nextJob = 0;
+    // slow devices block in snd_pcm_open, the total time is given by the slowest one
+    for (threadsCnt = 0; threadsCnt < PROBE_THREADS && threadsCnt < jobs.jobsCnt; ++threadsCnt) {
+        int ret = pthread_create(&threads[threadsCnt], NULL, &probeWorker, &jobs);
+        if (ret != 0) {
+            ERROR2("%s: pthread_create: %s\n", __FUNCTION__, strerror(ret));
+            break;
+        }
+    }
+    if (threadsCnt == 0) {
+        // probing in this thread
+        probeWorker(&jobs);
+    }
+    for (i = 0; i < threadsCnt; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(jobs.descs);
+    diskCacheSave();
+    TRACE3("%s: probed %d devices with %d threads\n", __FUNCTION__, (int) cnt, threadsCnt);
+    return cnt;
 }
 
 int setDeviceStart(PcmInfo* info, int startAutomatically)
@@ -309,7 +678,106 @@ int setDeviceStartAndCommit(PcmInfo* info, int startAutomatically) {
     return (ret == 0)? TRUE: FALSE;
 }
 
-int setHWParams(PcmInfo* info, int rate, int channels, int bufferSize, snd_pcm_format_t format)
+// buffer of bufferSize frames, periods of the period time setting or 2 periods for small buffers
+static int setBufferParams(PcmInfo* info, int bufferSize)
+{
+    const Settings* settings = getSettings();
+    int ignDir = 0;
+    snd_pcm_uframes_t finalBufferSize = (snd_pcm_uframes_t) bufferSize;
+    int ret = snd_pcm_hw_params_set_buffer_size_near(info->handle, info->hwParams, &finalBufferSize);
+    if (ret < 0) {
+        ERROR3("%s: snd_pcm_hw_params_set_buffer_size_near: cannot set buffer size to %d frames: %s\n", __FUNCTION__, (int) finalBufferSize, snd_strerror(ret));
+        return FALSE;
+    }
+    bufferSize = (int) finalBufferSize;
+
+    if (bufferSize > settings->smallBufferFrames) {
+        ignDir = 0;
+        unsigned int periodTime = (unsigned int) settings->periodTimeUs;
+        ret = snd_pcm_hw_params_set_period_time_near(info->handle, info->hwParams, &periodTime, &ignDir);
+        if (ret < 0) {
+            ERROR3("%s: snd_pcm_hw_params_set_period_time_near: cannot set period time to %d: %s\n", __FUNCTION__, settings->periodTimeUs, snd_strerror(ret));
+            return FALSE;
+        }
+    } else {
+        // small buffer, using only 2 periods per buffer for low latency
+        ignDir = 0;
+        unsigned int periods = 2;
+        ret = snd_pcm_hw_params_set_periods_near(info->handle, info->hwParams, &periods, &ignDir);
+        if (ret < 0) {
+            ERROR3("%s: snd_pcm_hw_params_set_periods_near: cannot set period count to %d: %s\n", __FUNCTION__, periods, snd_strerror(ret));
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Tries period counts of the target latency on copies of the params, applies the combination of the buffer time
+// closest to latencyUs and the period time closest to wakeupUs, the buffer error weighing twice
+static int setLatencyParams(PcmInfo* info, const LatencyTarget* latency)
+{
+    int wakeupUs = (latency->wakeupUs > 0)? latency->wakeupUs: latency->latencyUs / 2;
+    double bufferTarget = (double) latency->latencyUs * info->rate / 1000000.0;
+    double periodTarget = (double) wakeupUs * info->rate / 1000000.0;
+    if (bufferTarget < 1.0 || periodTarget < 1.0) {
+        ERROR3("%s: latency %d us, wakeup %d us too short\n", __FUNCTION__, latency->latencyUs, wakeupUs);
+        return FALSE;
+    }
+    snd_pcm_hw_params_t* test;
+    snd_pcm_hw_params_alloca(&test);
+    snd_pcm_uframes_t bestPeriodSize = 0;
+    unsigned int bestPeriods = 0;
+    double bestCost = 0.0;
+    unsigned int periods;
+    for (periods = LATENCY_MIN_PERIODS; periods <= LATENCY_MAX_PERIODS; periods++) {
+        snd_pcm_uframes_t periodSize = (snd_pcm_uframes_t) (bufferTarget / periods + 0.5);
+        if (periodSize == 0) {
+            break;
+        }
+        snd_pcm_hw_params_copy(test, info->hwParams);
+        int ignDir = 0;
+        if (snd_pcm_hw_params_set_period_size_near(info->handle, test, &periodSize, &ignDir) < 0) {
+            continue;
+        }
+        unsigned int cnt = periods;
+        ignDir = 0;
+        if (snd_pcm_hw_params_set_periods_near(info->handle, test, &cnt, &ignDir) < 0) {
+            continue;
+        }
+        double cost = 2.0 * fabs((double) periodSize * cnt - bufferTarget) / bufferTarget
+                + fabs((double) periodSize - periodTarget) / periodTarget;
+        if (bestPeriods == 0 || cost < bestCost) {
+            bestPeriodSize = periodSize;
+            bestPeriods = cnt;
+            bestCost = cost;
+        }
+    }
+    if (bestPeriods == 0) {
+        ERROR2("%s: no period size/count of latency %d us accepted\n", __FUNCTION__, latency->latencyUs);
+        return FALSE;
+    }
+    TRACE4("%s: latency %d us: period size %d, periods %d\n", __FUNCTION__, latency->latencyUs,
+           (int) bestPeriodSize, bestPeriods);
+
+    int ignDir = 0;
+    int ret = snd_pcm_hw_params_set_period_size_near(info->handle, info->hwParams, &bestPeriodSize, &ignDir);
+    if (ret < 0) {
+        ERROR3("%s: snd_pcm_hw_params_set_period_size_near: cannot set period size to %d: %s\n", __FUNCTION__, (int) bestPeriodSize, snd_strerror(ret));
+        return FALSE;
+    }
+    ignDir = 0;
+    ret = snd_pcm_hw_params_set_periods_near(info->handle, info->hwParams, &bestPeriods, &ignDir);
+    if (ret < 0) {
+        ERROR3("%s: snd_pcm_hw_params_set_periods_near: cannot set period count to %d: %s\n", __FUNCTION__, bestPeriods, snd_strerror(ret));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// latency - NULL for the buffer of bufferSize frames, see setBufferParams. With period wakeups disabled by
+// OPEN_FLAG_TSCHED the buffer is TSCHED_BUFFER_TIME_US long instead, a latency target still wins over both
+int setHWParams(PcmInfo* info, int rate, int channels, int bufferSize, snd_pcm_format_t format,
+                const LatencyTarget* latency)
 {
     int ret = snd_pcm_hw_params_any(info->handle, info->hwParams);
     if (ret < 0) {
@@ -317,11 +785,31 @@ int setHWParams(PcmInfo* info, int rate, int channels, int bufferSize, snd_pcm_f
         return FALSE;
     }
 
-    ret = snd_pcm_hw_params_set_access(info->handle, info->hwParams, SND_PCM_ACCESS_RW_INTERLEAVED);
+    snd_pcm_access_t access = SND_PCM_ACCESS_RW_INTERLEAVED;
+#ifdef USE_MMAP_ACCESS
+    if (snd_pcm_hw_params_test_access(info->handle, info->hwParams, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0) {
+        access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+    }
+#endif
+    if (access == SND_PCM_ACCESS_RW_INTERLEAVED
+            && snd_pcm_hw_params_test_access(info->handle, info->hwParams, SND_PCM_ACCESS_RW_INTERLEAVED) != 0) {
+        // some multichannel cards offer non-interleaved access only
+        access = SND_PCM_ACCESS_RW_NONINTERLEAVED;
+#ifdef USE_MMAP_ACCESS
+        if (snd_pcm_hw_params_test_access(info->handle, info->hwParams, SND_PCM_ACCESS_MMAP_NONINTERLEAVED) == 0) {
+            access = SND_PCM_ACCESS_MMAP_NONINTERLEAVED;
+        }
+#endif
+    }
+    ret = snd_pcm_hw_params_set_access(info->handle, info->hwParams, access);
     if (ret < 0) {
         ERROR2("%s: snd_pcm_hw_params_set_access: %s\n", __FUNCTION__, snd_strerror(ret));
         return FALSE;
     }
+    info->isMmap = (access == SND_PCM_ACCESS_MMAP_INTERLEAVED || access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+    info->isNonInterleaved = (access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED
+            || access == SND_PCM_ACCESS_RW_NONINTERLEAVED);
+    TRACE2("%s: using %s access\n", __FUNCTION__, snd_pcm_access_name(access));
 
     ret = snd_pcm_hw_params_set_format(info->handle, info->hwParams, format);
     if (ret < 0) {
@@ -342,37 +830,34 @@ int setHWParams(PcmInfo* info, int rate, int channels, int bufferSize, snd_pcm_f
         ERROR3("%s: snd_pcm_hw_params_set_rate_near: rate %d unavailable: %s\n", __FUNCTION__, rate, snd_strerror(ret));
         return FALSE;
     }
-    if (abs(nearRate - rate) > 2) {
+    // a resampler converts any rate the device offers
+    if (abs(nearRate - rate) > 2 && !(info->flags & OPEN_FLAG_RESAMPLE_MASK)) {
         ERROR3("%s: Rate does not match (req. %d, got %d)\n", __FUNCTION__, rate, nearRate);
         return FALSE;
     }
+    info->rate = nearRate;
 
-    snd_pcm_uframes_t finalBufferSize = (snd_pcm_uframes_t) bufferSize;
-    ret = snd_pcm_hw_params_set_buffer_size_near(info->handle, info->hwParams, &finalBufferSize);
-    if (ret < 0) {
-        ERROR3("%s: snd_pcm_hw_params_set_buffer_size_near: cannot set buffer size to %d frames: %s\n", __FUNCTION__, (int) finalBufferSize, snd_strerror(ret));
-        return FALSE;
-    }
-    bufferSize = (int) finalBufferSize;
-
-    if (bufferSize > SMALL_BUFFER_SIZE_LIMIT) {
-        ignDir = 0;
-        unsigned int periodTime = DEFAULT_PERIOD_TIME;
-        ret = snd_pcm_hw_params_set_period_time_near(info->handle, info->hwParams, &periodTime, &ignDir);
-        if (ret < 0) {
-            ERROR3("%s: snd_pcm_hw_params_set_period_time_near: cannot set period time to %d: %s\n", __FUNCTION__,DEFAULT_PERIOD_TIME, snd_strerror(ret));
-            return FALSE;
+    if (info->flags & OPEN_FLAG_TSCHED) {
+        // without period interrupts the ring thread wakes up by its timer. Requires a non-blocking handle
+        ret = -EINVAL;
+        if (snd_pcm_hw_params_can_disable_period_wakeup(info->hwParams)) {
+            ret = snd_pcm_hw_params_set_period_wakeup(info->handle, info->hwParams, 0);
         }
-    } else {
-        // small buffer, using only 2 periods per buffer for low latency
-        ignDir = 0;
-        unsigned int periods = 2;
-        ret = snd_pcm_hw_params_set_periods_near(info->handle, info->hwParams, &periods, &ignDir);
-        if (ret < 0) {
-            ERROR3("%s: snd_pcm_hw_params_set_periods_near: cannot set period count to %d: %s\n", __FUNCTION__, periods, snd_strerror(ret));
+        info->isTimerSched = (ret == 0);
+        if (info->isTimerSched) {
+            bufferSize = (int) ((INT64) info->rate * TSCHED_BUFFER_TIME_US / 1000000);
+        } else {
+            TRACE2("%s: period wakeups cannot be disabled, using the ring with period wakeups: %s\n", __FUNCTION__,
+                   snd_strerror(ret));
+        }
+    }
+    if (latency != NULL) {
+        if (!setLatencyParams(info, latency)) {
             return FALSE;
         }
-    }    
+    } else if (!setBufferParams(info, bufferSize)) {
+        return FALSE;
+    }
     ret = snd_pcm_hw_params(info->handle, info->hwParams);
     if (ret < 0) {
         ERROR2("%s: snd_pcm_hw_params: %s\n", __FUNCTION__, snd_strerror(ret));
@@ -391,12 +876,21 @@ int setSWParams(PcmInfo* info) {
         return FALSE;
     }
 
-    // at least periodSize must be available
+    // at least periodSize must be available, a latency target wakes up every negotiated period
     ret = snd_pcm_sw_params_set_avail_min(info->handle, info->swParams, info->periodSize);
     if (ret < 0) {
         ERROR2("%s: snd_pcm_sw_params_set_avail_min: %s\n", __FUNCTION__, snd_strerror(ret));
         return FALSE;
     }
+    info->availMin = info->periodSize;
+    // CLOCK_MONOTONIC timestamps of pointer updates for capture chunk stamps, not fatal
+    ret = snd_pcm_sw_params_set_tstamp_mode(info->handle, info->swParams, SND_PCM_TSTAMP_ENABLE);
+    if (ret == 0) {
+        ret = snd_pcm_sw_params_set_tstamp_type(info->handle, info->swParams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+    }
+    if (ret < 0) {
+        TRACE2("%s: monotonic timestamps unavailable: %s\n", __FUNCTION__, snd_strerror(ret));
+    }
     ret = snd_pcm_sw_params(info->handle, info->swParams);
     if (ret < 0) {
         ERROR2("%s: snd_pcm_sw_params: %s\n", __FUNCTION__, snd_strerror(ret));
@@ -405,12 +899,84 @@ int setSWParams(PcmInfo* info) {
     return TRUE;
 }
 
+void wakeWaiter(PcmInfo* info)
+{
+    UINT64 val = 1;
+    if (write(info->waitFd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+        ERROR2("%s: write to eventfd failed: %s\n", __FUNCTION__, strerror(errno));
+    }
+}
+
+// makes doWaitAvail in progress return
+void cancelWait(PcmInfo* info)
+{
+    __atomic_add_fetch(&info->waitGeneration, 1, __ATOMIC_SEQ_CST);
+    wakeWaiter(info);
+}
+
+// Sleeps on the waiter eventfd until woken or timeoutMs passes. Returns FALSE if the wait of generation was cancelled
+int sleepOnWaiter(PcmInfo* info, int generation, int timeoutMs)
+{
+    struct pollfd fd;
+    fd.fd = info->waitFd;
+    fd.events = POLLIN;
+    if (poll(&fd, 1, timeoutMs) > 0 && (fd.revents & POLLIN)) {
+        UINT64 val;
+        // non-blocking, resets the counter
+        if (read(info->waitFd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+            ERROR2("%s: read from eventfd failed: %s\n", __FUNCTION__, strerror(errno));
+        }
+    }
+    return generation == __atomic_load_n(&info->waitGeneration, __ATOMIC_SEQ_CST);
+}
+
 /******** OPEN/CLOSE **********/
 static snd_output_t* OUTPUT = NULL;
 
+// stamps for chunks of at least half a period, device buffer for reading when the ring is full
+static int initCaptureStamps(PcmInfo* info)
+{
+    int periodBytes = (int) info->periodSize * info->frameBytes;
+    info->stampsCnt = 2 * (info->ring.size / (periodBytes > 0? periodBytes: info->frameBytes)) + 4;
+    info->stamps = (ChunkStamp*) calloc(info->stampsCnt, sizeof(ChunkStamp));
+    info->dropBuffer = (char*) malloc(info->bufferBytes);
+    if (info->stamps == NULL || info->dropBuffer == NULL) {
+        ERROR1("%s: Out of memory\n", __FUNCTION__);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// channel planes of non-interleaved access, rw access needs a planar buffer for one whole device buffer
+static int initPlanes(PcmInfo* info)
+{
+    info->planes = (char**) calloc(info->channels, sizeof(char*));
+    if (info->planes == NULL) {
+        ERROR1("%s: Out of memory\n", __FUNCTION__);
+        return FALSE;
+    }
+    if (!info->isMmap) {
+        int ch;
+        int sampleBytes = info->frameBytes / info->channels;
+        info->planeFrames = info->bufferBytes / info->frameBytes;
+        info->planar = (char*) malloc(info->bufferBytes);
+        if (info->planar == NULL) {
+            ERROR1("%s: Out of memory\n", __FUNCTION__);
+            return FALSE;
+        }
+        for (ch = 0; ch < info->channels; ch++) {
+            info->planes[ch] = info->planar + ch * info->planeFrames * sampleBytes;
+        }
+    }
+    return TRUE;
+}
+
+// latency - NULL for the device buffer of bufferBytes, else the negotiated period size/count. The ring of
+// OPEN_FLAG_RING then holds RING_DEVICE_BUFFER_DIVIDER device buffers
 // returns either pointer or NULL
 PcmInfo* doOpen(const char* deviceID, int isSource, int enc, int rate, int sampleBits,
-                   int frameBytes, int channels, int isSigned, int isBigEndian, int bufferBytes)
+                   int frameBytes, int channels, int isSigned, int isBigEndian, int bufferBytes, int flags,
+                   const LatencyTarget* latency)
 {
 	int ret;
     TRACE1("%s: start\n", __FUNCTION__);
@@ -433,6 +999,10 @@ PcmInfo* doOpen(const char* deviceID, int isSource, int enc, int rate, int sampl
         ERROR2("%s: Only PCM encoding supported, not encoding %d!\n", __FUNCTION__, enc);
         return NULL;
     }
+    if (flags & OPEN_FLAG_TSCHED) {
+        // timer scheduling is a mode of the ring thread
+        flags |= OPEN_FLAG_RING;
+    }
     int sampleBytes = frameBytes / channels;
     snd_pcm_format_t format = snd_pcm_build_linear_format(sampleBits, sampleBytes * 8,
             isSigned? 0: 1, isBigEndian? 1: 0);
@@ -450,20 +1020,43 @@ PcmInfo* doOpen(const char* deviceID, int isSource, int enc, int rate, int sampl
     memset(info, 0, sizeof(PcmInfo));
     info->isRunning = 0;
     info->isFlushed = 1;
+    info->flags = flags;
+    info->isSource = isSource;
+    info->wakeFd = -1;
+    info->timerFd = -1;
+    pthread_mutex_init(&info->lock, NULL);
+    pthread_mutex_init(&info->ioLock, NULL);
+    info->waitFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (info->waitFd < 0) {
+        ERROR2("%s: eventfd failed: %s\n", __FUNCTION__, strerror(errno));
+        pthread_mutex_destroy(&info->lock);
+        pthread_mutex_destroy(&info->ioLock);
+        free(info);
+        return NULL;
+    }
+
+    int deviceBufferBytes = bufferBytes;
+    if (flags & OPEN_FLAG_RING) {
+        // java gets the requested buffer as the ring, the device runs with a fraction of it.
+        // Timer scheduling replaces it by its long buffer, the ring gets at least the device buffer size
+        deviceBufferBytes = bufferBytes / RING_DEVICE_BUFFER_DIVIDER;
+    }
 
     ret = openDeviceID(deviceID, &(info->handle), isSource, TRUE);
     if (ret == 0) {
-        // starting with blocking mode
-        snd_pcm_nonblock(info->handle, 0);
+        // starting with blocking mode. Timer scheduling stays non-blocking, alsa-lib disables period wakeups of
+        // non-blocking handles only
+        snd_pcm_nonblock(info->handle, (flags & OPEN_FLAG_TSCHED)? 1: 0);
         ret = snd_pcm_hw_params_malloc(&(info->hwParams));
         if (ret != 0) {
             ERROR2("%s: snd_pcm_hw_params_malloc: %s\n", __FUNCTION__, snd_strerror(ret));
         } else {
             ret = -1;
-            if (setHWParams(info, rate, channels, bufferBytes / frameBytes, format)) {
+            if (setHWParams(info, rate, channels, deviceBufferBytes / frameBytes, format, latency)) {
                 // updating info from real HW params
 				int ignDir = 0;
                 info->frameBytes = frameBytes;
+                info->channels = channels;
                 ret = snd_pcm_hw_params_get_period_size(info->hwParams, &info->periodSize, &ignDir);
                 if (ret < 0) {
                     ERROR2("%s: snd_pcm_hw_params_get_period: %s\n", __FUNCTION__, snd_strerror(ret));
@@ -474,11 +1067,81 @@ PcmInfo* doOpen(const char* deviceID, int isSource, int enc, int rate, int sampl
                 info->bufferBytes = (int) bufferSize * frameBytes;
                 TRACE4("%s: period size = %d, periods = %d. Buffer bytes: %d.\n",
                        __FUNCTION__, (int) info->periodSize, info->periods, info->bufferBytes);
-            }
-        }
-        if (ret == 0) {
-            ret = snd_pcm_sw_params_malloc(&(info->swParams));
-            if (ret != 0) {
+                // one non-blocking read/write never transfers more than the whole buffer (or ring)
+                int javaBufferBytes = info->bufferBytes;
+                if (flags & OPEN_FLAG_RING) {
+                    javaBufferBytes = (bufferBytes / frameBytes) * frameBytes;
+                    if (latency != NULL) {
+                        // no bufferBytes with a latency target, the ring gets the usual multiple of the device buffer
+                        javaBufferBytes = info->bufferBytes * RING_DEVICE_BUFFER_DIVIDER;
+                    }
+                    if (javaBufferBytes < info->bufferBytes) {
+                        javaBufferBytes = info->bufferBytes;
+                    }
+                    if (!initRing(&info->ring, javaBufferBytes)) {
+                        ret = -1;
+                    } else if (!isSource && !initCaptureStamps(info)) {
+                        ret = -1;
+                    }
+                }
+                if (ret == 0) {
+                    info->staging = (char*) malloc(javaBufferBytes);
+                    if (info->staging == NULL) {
+                        ERROR1("%s: Out of memory\n", __FUNCTION__);
+                        ret = -1;
+                    } else {
+                        info->stagingBytes = javaBufferBytes;
+                    }
+                }
+                if (ret == 0 && info->isNonInterleaved && !initPlanes(info)) {
+                    ret = -1;
+                }
+                if (ret == 0 && initConverter(&info->conv, format, flags & OPEN_FLAG_DITHER)) {
+                    info->floatStagingSamples = (javaBufferBytes / frameBytes) * channels;
+                    info->floatStaging = (float*) malloc(info->floatStagingSamples * sizeof(float));
+                    if (info->floatStaging == NULL) {
+                        ERROR1("%s: Out of memory\n", __FUNCTION__);
+                        ret = -1;
+                    } else {
+                        info->hasConv = TRUE;
+                        initGain(&info->gain);
+                    }
+                }
+                if (ret == 0 && (flags & OPEN_FLAG_METER)) {
+                    if (!info->hasConv) {
+                        ERROR2("%s: metering of format %s not supported\n", __FUNCTION__, snd_pcm_format_name(format));
+                        ret = -1;
+                    } else {
+                        info->meter = (Meter*) malloc(sizeof(Meter));
+                        if (info->meter == NULL) {
+                            ERROR1("%s: Out of memory\n", __FUNCTION__);
+                            ret = -1;
+                        } else if (!initMeter(info->meter, channels, rate)) {
+                            ret = -1;
+                        }
+                    }
+                }
+                if (ret == 0 && (flags & OPEN_FLAG_RESAMPLE_MASK) && info->rate != rate) {
+                    if (!info->hasConv) {
+                        ERROR2("%s: resampling of format %s not supported\n", __FUNCTION__,
+                                snd_pcm_format_name(format));
+                        ret = -1;
+                    } else {
+                        info->resampler = (Resampler*) malloc(sizeof(Resampler));
+                        if (info->resampler == NULL) {
+                            ERROR1("%s: Out of memory\n", __FUNCTION__);
+                            ret = -1;
+                        } else if (!initResampler(info->resampler, (flags & OPEN_FLAG_RESAMPLE_MASK) >> 2, isSource,
+                                channels, frameBytes, rate, info->rate)) {
+                            ret = -1;
+                        }
+                    }
+                }
+            }
+        }
+        if (ret == 0) {
+            ret = snd_pcm_sw_params_malloc(&(info->swParams));
+            if (ret != 0) {
                 ERROR2("%s: snd_pcm_hw_params_malloc: %s\n", __FUNCTION__, snd_strerror(ret));
             } else {
                 if (!setSWParams(info)) {
@@ -494,12 +1157,18 @@ PcmInfo* doOpen(const char* deviceID, int isSource, int enc, int rate, int sampl
         }
 
     }
+    if (ret == 0) {
+        // all OK, setting to non-blocking mode
+        snd_pcm_nonblock(info->handle, 1);
+        if ((flags & OPEN_FLAG_RING) && !startRingThread(info, isSource)) {
+            ret = -1;
+        }
+    }
     if (ret != 0) {
         doClose(info, isSource);
+        free(info);
         info = NULL;
     } else {
-        // all OK, setting to non-blocking mode
-        snd_pcm_nonblock(info->handle, 1);
         TRACE3("%s: device %s %s opened OK\n", __FUNCTION__, deviceID, getDirStr(isSource));
     }
     return info;
@@ -509,6 +1178,10 @@ void doClose(PcmInfo* info, int isSource)
 {
     TRACE1("%s: start\n", __FUNCTION__);
     if (info != NULL) {
+        cancelWait(info);
+        if (info->hasRingThread) {
+            stopRingThread(info);
+        }
         if (info->handle != NULL) {
             snd_pcm_close(info->handle);
         }
@@ -518,14 +1191,40 @@ void doClose(PcmInfo* info, int isSource)
         if (info->swParams) {
             snd_pcm_sw_params_free(info->swParams);
         }
+        free(info->staging);
+        if (info->ring.data != NULL) {
+            freeRing(&info->ring);
+        }
+        free(info->stamps);
+        free(info->dropBuffer);
+        free(info->floatStaging);
+        free(info->planes);
+        free(info->planar);
+        if (info->resampler != NULL) {
+            freeResampler(info->resampler);
+            free(info->resampler);
+        }
+        if (info->meter != NULL) {
+            freeMeter(info->meter);
+            free(info->meter);
+        }
+        if (info->waitFd >= 0) {
+            close(info->waitFd);
+        }
+        pthread_mutex_destroy(&info->lock);
+        pthread_mutex_destroy(&info->ioLock);
     }
 }
 
-int doStart(PcmInfo* info, int isSource)
+// control ops run with info->lock held, the ring thread may be using the device meanwhile
+static int startPcm(PcmInfo* info, int isSource)
 {
     int ret;
     TRACE1("%s: start\n", __FUNCTION__);
-    snd_pcm_nonblock(info->handle, 0);
+    // alsa-lib refuses blocking mode with period wakeups disabled
+    if (!info->isTimerSched) {
+        snd_pcm_nonblock(info->handle, 0);
+    }
     // set start to autostart
     setDeviceStartAndCommit(info, TRUE);
     snd_pcm_state_t state = snd_pcm_state(info->handle);
@@ -559,9 +1258,11 @@ int doStart(PcmInfo* info, int isSource)
             ERROR3("%s: snd_pcm_start: %d: %s\n", __FUNCTION__, ret, snd_strerror(ret));
         }
     }
-    ret = snd_pcm_nonblock(info->handle, 1);
-    if (ret != 0) {
-        ERROR2("%s: snd_pcm_nonblock: %s\n", __FUNCTION__, snd_strerror(ret));
+    if (!info->isTimerSched) {
+        ret = snd_pcm_nonblock(info->handle, 1);
+        if (ret != 0) {
+            ERROR2("%s: snd_pcm_nonblock: %s\n", __FUNCTION__, snd_strerror(ret));
+        }
     }
     state = snd_pcm_state(info->handle);
     TRACE2("%s: state %s\n", __FUNCTION__, snd_pcm_state_name(state));
@@ -579,15 +1280,32 @@ int doStart(PcmInfo* info, int isSource)
     return ret? TRUE: FALSE;
 }
 
-int doStop(PcmInfo* info, int isSource)
+int doStart(PcmInfo* info, int isSource)
+{
+    pthread_mutex_lock(&info->lock);
+    int ret = startPcm(info, isSource);
+    pthread_mutex_unlock(&info->lock);
+    if (info->hasRingThread) {
+        wakeRingThread(info);
+    }
+    // a doWaitAvail started before the start re-evaluates, adding the device descriptors
+    wakeWaiter(info);
+    return ret;
+}
+
+static int stopPcm(PcmInfo* info, int isSource)
 {
     TRACE1("%s: start\n", __FUNCTION__);
-    snd_pcm_nonblock(info->handle, 0);
+    if (!info->isTimerSched) {
+        snd_pcm_nonblock(info->handle, 0);
+    }
     // preventing start after XRUN
     setDeviceStartAndCommit(info, FALSE);
     // pausing
     int ret = snd_pcm_pause(info->handle, 1);
-    snd_pcm_nonblock(info->handle, 1);
+    if (!info->isTimerSched) {
+        snd_pcm_nonblock(info->handle, 1);
+    }
     if (ret != 0) {
         ERROR2("%s: snd_pcm_pause: %s\n", __FUNCTION__, snd_strerror(ret));
         return FALSE;
@@ -597,6 +1315,15 @@ int doStop(PcmInfo* info, int isSource)
     return TRUE;
 }
 
+int doStop(PcmInfo* info, int isSource)
+{
+    pthread_mutex_lock(&info->lock);
+    int ret = stopPcm(info, isSource);
+    pthread_mutex_unlock(&info->lock);
+    cancelWait(info);
+    return ret;
+}
+
 /********** READ/WRITE *********/
 
 // error recovery - decides among OK (1), try again (0), unrecoverable failure (-1)
@@ -608,6 +1335,7 @@ int tryXRUNRecovery(PcmInfo* info, int err) {
             return 0;
     } else if (err == -EPIPE) {
         TRACE1("%s: XRUN.\n", __FUNCTION__);
+        info->xrunCnt++;
         ret = snd_pcm_prepare(info->handle);
         if (ret < 0) {
             ERROR2("%s: Cannot recover from XRUN, snd_pcm_prepare: %s\n", __FUNCTION__, snd_strerror(ret));
@@ -618,6 +1346,7 @@ int tryXRUNRecovery(PcmInfo* info, int err) {
         return 1;
     } else if (err == -ESTRPIPE) {
         TRACE1("%s: suspended.\n", __FUNCTION__);
+        info->xrunCnt++;
         ret = snd_pcm_resume(info->handle);
         if (ret < 0) {
             if (ret == -EAGAIN) {
@@ -640,107 +1369,522 @@ int tryXRUNRecovery(PcmInfo* info, int err) {
     return -1;
 }
 
-int doRead(PcmInfo* info, char* buffer, int bytes) {
-    int ret;
-    TRACE2("%s: %d bytes\n", __FUNCTION__, bytes);
-    if (bytes <= 0 || info->frameBytes <= 0) {
-        ERROR3("%s: wrong bytes=%d, frameBytes=%d\n", __FUNCTION__, (int) bytes, (int) info->frameBytes);
-        return -1;
+// Copies frames between buffer and the mmapped device ring, non-blocking like snd_pcm_readi/writei.
+// With conv the buffer holds float samples, converted straight from/to the device ring.
+// Returns frames transferred or negative error (-EAGAIN if no room/data)
+static snd_pcm_sframes_t mmapTransfer(PcmInfo* info, char* buffer, snd_pcm_uframes_t frames, int isSource,
+        Converter* conv)
+{
+    int bufferFrameBytes = (conv != NULL)? info->channels * (int) sizeof(float): info->frameBytes;
+    snd_pcm_t* handle = info->handle;
+    if (!isSource && info->isRunning && snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+        // readi starts capture automatically, mmap must start explicitly (e.g. after xrun recovery)
+        snd_pcm_start(handle);
     }
-    if (!info->isRunning && info->isFlushed) {
-        return 0;
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+    if (avail < 0) {
+        return avail;
+    }
+    if (avail == 0) {
+        return -EAGAIN;
     }
+    if (frames > (snd_pcm_uframes_t) avail) {
+        frames = (snd_pcm_uframes_t) avail;
+    }
+    snd_pcm_uframes_t transferred = 0;
+    while (transferred < frames) {
+        const snd_pcm_channel_area_t* areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t cnt = frames - transferred;
+        int ret = snd_pcm_mmap_begin(handle, &areas, &offset, &cnt);
+        if (ret < 0) {
+            return ret;
+        }
+        // interleaved - all channels in the area of the first channel
+        char* ring = (char*) areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+        char* data = buffer + transferred * bufferFrameBytes;
+        if (info->isNonInterleaved) {
+            // one area per channel, step of one sample
+            int ch;
+            for (ch = 0; ch < info->channels; ch++) {
+                info->planes[ch] = (char*) areas[ch].addr + (areas[ch].first + offset * areas[ch].step) / 8;
+            }
+            int sampleBytes = info->frameBytes / info->channels;
+            if (isSource) {
+                deinterleave(data, info->planes, (int) cnt, info->channels, sampleBytes);
+            } else {
+                interleave(info->planes, data, (int) cnt, info->channels, sampleBytes);
+            }
+        } else if (conv != NULL) {
+            if (isSource) {
+                convertFromFloat(conv, (const float*) data, ring, cnt * info->channels);
+            } else {
+                convertToFloat(conv, ring, (float*) data, cnt * info->channels);
+            }
+        } else if (isSource) {
+            memcpy(ring, data, cnt * info->frameBytes);
+        } else {
+            memcpy(data, ring, cnt * info->frameBytes);
+        }
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(handle, offset, cnt);
+        if (committed < 0) {
+            return committed;
+        }
+        transferred += committed;
+        if ((snd_pcm_uframes_t) committed != cnt) {
+            // xrun meanwhile
+            break;
+        }
+    }
+    if (isSource && info->isRunning && snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+        // writei starts playback at start_threshold (1 frame when running), mmap must start explicitly
+        snd_pcm_start(handle);
+    }
+    return (snd_pcm_sframes_t) transferred;
+}
+
+// rw access of non-interleaved devices through the planar buffer
+static snd_pcm_sframes_t transferPlanes(PcmInfo* info, char* buffer, snd_pcm_uframes_t frames, int isSource)
+{
+    int sampleBytes = info->frameBytes / info->channels;
+    if (frames > (snd_pcm_uframes_t) info->planeFrames) {
+        frames = (snd_pcm_uframes_t) info->planeFrames;
+    }
+    if (isSource) {
+        // deinterleaving only what fits in, errors are left for writen
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(info->handle);
+        if (avail == 0) {
+            return -EAGAIN;
+        }
+        if (avail > 0 && frames > (snd_pcm_uframes_t) avail) {
+            frames = (snd_pcm_uframes_t) avail;
+        }
+        deinterleave(buffer, info->planes, (int) frames, info->channels, sampleBytes);
+        return snd_pcm_writen(info->handle, (void**) info->planes, frames);
+    }
+    snd_pcm_sframes_t readFrames = snd_pcm_readn(info->handle, (void**) info->planes, frames);
+    if (readFrames > 0) {
+        interleave(info->planes, buffer, (int) readFrames, info->channels, sampleBytes);
+    }
+    return readFrames;
+}
+
+// read/write with xrun recovery. Conv (float buffer) only for interleaved mmap access.
+// Returns frames transferred, 0 for try again, -1 for unrecoverable failure
+static snd_pcm_sframes_t transferPcm(PcmInfo* info, char* buffer, snd_pcm_sframes_t frames, int isSource,
+        Converter* conv)
+{
+    int ret;
     int try = 0;
-    snd_pcm_sframes_t framesToRead = (snd_pcm_sframes_t) (bytes / info->frameBytes);
-    snd_pcm_sframes_t readFrames;
+    snd_pcm_sframes_t transferred;
     do {
-        readFrames = snd_pcm_readi(info->handle, buffer, framesToRead);
-        if (readFrames < 0) {
-            ret = tryXRUNRecovery(info, (int) readFrames);
+        if (info->isMmap) {
+            transferred = mmapTransfer(info, buffer, frames, isSource, conv);
+        } else if (info->isNonInterleaved) {
+            transferred = transferPlanes(info, buffer, frames, isSource);
+        } else if (isSource) {
+            transferred = snd_pcm_writei(info->handle, buffer, frames);
+        } else {
+            transferred = snd_pcm_readi(info->handle, buffer, frames);
+        }
+        if (transferred < 0) {
+            ret = tryXRUNRecovery(info, (int) transferred);
             if (ret <= 0) {
                 TRACE2("%s: tryXRUNRecovery: %d, returning.\n", __FUNCTION__, ret);
-                return ret;
+                transferred = ret;
+                break;
             }
-            if (try++ > TRIES_TO_RECOVER) {
-                ERROR2("%s: exceeded max tries %d to recover from xrun\n", __FUNCTION__, TRIES_TO_RECOVER);
-                return -1;
+            if (try++ > getSettings()->triesToRecover) {
+                ERROR2("%s: exceeded max tries %d to recover from xrun\n", __FUNCTION__, getSettings()->triesToRecover);
+                transferred = -1;
+                break;
             }
         } else {
+            info->pcmFrames += transferred;
             break;
         }
     } while (TRUE);
+    return transferred;
+}
+
+// reads directly from the device, called by doRead or by the ring thread
+int readFromPcm(PcmInfo* info, char* buffer, int bytes) {
+    int ret;
+    TRACE2("%s: %d bytes\n", __FUNCTION__, bytes);
+    if (bytes <= 0 || info->frameBytes <= 0) {
+        ERROR3("%s: wrong bytes=%d, frameBytes=%d\n", __FUNCTION__, (int) bytes, (int) info->frameBytes);
+        return -1;
+    }
+    if (!info->isRunning && info->isFlushed) {
+        return 0;
+    }
+    snd_pcm_sframes_t readFrames = transferPcm(info, buffer, bytes / info->frameBytes, FALSE, NULL);
+    if (readFrames <= 0) {
+        return (int) readFrames;
+    }
     ret =  (int) (readFrames * info->frameBytes);
     TRACE2("%s: read %d bytes.\n", __FUNCTION__, ret);
     return ret;
 }
 
-int doWrite(PcmInfo* info, char* buffer, int bytes) {
+// reads at the device rate, from the ring or the device. stamp can be NULL
+int readFromStream(PcmInfo* info, char* buffer, int bytes, ReadStamp* stamp) {
+    if (info->hasRingThread) {
+        return readFromRing(info, buffer, bytes, stamp);
+    }
+    if (stamp != NULL) {
+        stamp->droppedFrames = 0;
+        stamp->tstampNs = 0;
+    }
+    // not concurrently with control ops
+    pthread_mutex_lock(&info->lock);
+    int ret = readFromPcm(info, buffer, bytes);
+    pthread_mutex_unlock(&info->lock);
+    return ret;
+}
+
+// levels of data passed to/from java
+static void meterBytes(PcmInfo* info, char* buffer, int bytes) {
+    if (info->meter != NULL && bytes > 0) {
+        meterInt(info->meter, &info->conv, buffer, bytes / info->frameBytes);
+    }
+}
+
+static int readJavaRate(PcmInfo* info, char* buffer, int bytes, ReadStamp* stamp) {
+    if (info->resampler != NULL) {
+        return resampleRead(info, buffer, bytes, stamp);
+    }
+    return readFromStream(info, buffer, bytes, stamp);
+}
+
+// called under ioLock, by doRead* or by the JNI layer reading into its staging buffer
+int readJavaData(PcmInfo* info, char* buffer, int bytes, ReadStamp* stamp) {
+    if (stamp != NULL) {
+        stamp->droppedFrames = 0;
+        stamp->tstampNs = 0;
+    }
+    int ret = readJavaRate(info, buffer, bytes, stamp);
+    meterBytes(info, buffer, ret);
+    return ret;
+}
+
+int doRead(PcmInfo* info, char* buffer, int bytes) {
+    pthread_mutex_lock(&info->ioLock);
+    int ret = readJavaData(info, buffer, bytes, NULL);
+    pthread_mutex_unlock(&info->ioLock);
+    return ret;
+}
+
+// doRead with dropped frames and capture time of the first frame. Only the ring keeps track of them
+int doReadStamped(PcmInfo* info, char* buffer, int bytes, ReadStamp* stamp) {
+    pthread_mutex_lock(&info->ioLock);
+    int ret = readJavaData(info, buffer, bytes, stamp);
+    pthread_mutex_unlock(&info->ioLock);
+    return ret;
+}
+
+// writes directly to the device, called by doWrite or by the ring thread
+int writeToPcm(PcmInfo* info, char* buffer, int bytes) {
     int ret;
     TRACE2("%s: %d bytes\n", __FUNCTION__, bytes);
     if (bytes <= 0 || info->frameBytes <= 0) {
 		ERROR3("%s: wrong bytes=%d, frameBytes=%d\n", __FUNCTION__, (int) bytes, (int) info->frameBytes);
         return -1;
     }
-    int try = 0;
-    snd_pcm_sframes_t framesToWrite = (snd_pcm_sframes_t) (bytes / info->frameBytes);
-    snd_pcm_sframes_t writtenFrames;
-    do {
-        writtenFrames = snd_pcm_writei(info->handle, buffer, framesToWrite);
-        if (writtenFrames < 0) {
-            ret = tryXRUNRecovery(info, (int) writtenFrames);
-            if (ret <= 0) {
-                TRACE2("%s: tryXRUNRecovery: %d, returning.\n", __FUNCTION__, ret);
-                return ret;
-            }
-            if (try++ > TRIES_TO_RECOVER) {
-                ERROR2("%s: exceeded max tries %d to recover from xrun\n", __FUNCTION__, TRIES_TO_RECOVER);
-                return -1;
-            }
-        } else {
-            break;
-        }
-    } while (TRUE);
-    if (writtenFrames > 0) {
-        info->isFlushed = 0;
+    snd_pcm_sframes_t writtenFrames = transferPcm(info, buffer, bytes / info->frameBytes, TRUE, NULL);
+    if (writtenFrames <= 0) {
+        return (int) writtenFrames;
     }
+    info->isFlushed = 0;
     ret =  (int) (writtenFrames * info->frameBytes);
     TRACE2("%s: wrote %d bytes.\n", __FUNCTION__, ret);
     return ret;
 }
 
+// writes at the device rate, to the ring or the device
+int writeToStream(PcmInfo* info, char* buffer, int bytes) {
+    if (info->hasRingThread) {
+        return writeToRing(info, buffer, bytes);
+    }
+    // not concurrently with control ops
+    pthread_mutex_lock(&info->lock);
+    int ret = writeToPcm(info, buffer, bytes);
+    pthread_mutex_unlock(&info->lock);
+    return ret;
+}
 
-void doDrain(PcmInfo* info) {
-    snd_pcm_state_t state;
+static int writeJavaRate(PcmInfo* info, char* buffer, int bytes) {
+    if (info->resampler != NULL) {
+        return resampleWrite(info, buffer, bytes);
+    }
+    return writeToStream(info, buffer, bytes);
+}
 
+// called under ioLock, by doWrite or by the JNI layer writing from its staging buffer
+int writeJavaData(PcmInfo* info, char* buffer, int bytes) {
+    int ret;
+    if (info->hasConv && isGainActive(&info->gain)) {
+        // the java buffer (e.g. a direct ByteBuffer) stays untouched, gained samples go to staging
+        int frames = bytes / info->frameBytes;
+        int maxFrames = info->stagingBytes / info->frameBytes;
+        if (frames > maxFrames) {
+            frames = maxFrames;
+        }
+        applyGain(&info->gain, &info->conv, buffer, info->staging, frames, info->channels);
+        buffer = info->staging;
+        ret = writeJavaRate(info, buffer, frames * info->frameBytes);
+        if (ret > 0) {
+            advanceGain(&info->gain, ret / info->frameBytes);
+        }
+    } else {
+        ret = writeJavaRate(info, buffer, bytes);
+    }
+    meterBytes(info, buffer, ret);
+    return ret;
+}
+
+int doWrite(PcmInfo* info, char* buffer, int bytes) {
+    pthread_mutex_lock(&info->ioLock);
+    int ret = writeJavaData(info, buffer, bytes);
+    pthread_mutex_unlock(&info->ioLock);
+    return ret;
+}
+
+// samples of whole frames fitting into staging, 0 if none
+static int getFloatFrames(PcmInfo* info, int samples)
+{
+    int frames = samples / info->channels;
+    int maxFrames = info->stagingBytes / info->frameBytes;
+    return (frames < maxFrames)? frames: maxFrames;
+}
+
+// called under ioLock
+int writeFloatData(PcmInfo* info, const float* src, int samples) {
+    TRACE2("%s: %d samples\n", __FUNCTION__, samples);
+    if (!info->hasConv || samples <= 0) {
+        ERROR2("%s: float not supported or wrong samples=%d\n", __FUNCTION__, samples);
+        return -1;
+    }
+    int frames = getFloatFrames(info, samples);
+    if (info->isMmap && !info->isNonInterleaved && !info->hasRingThread && info->resampler == NULL
+            && !isGainActive(&info->gain)) {
+        // converting straight into the device ring
+        pthread_mutex_lock(&info->lock);
+        snd_pcm_sframes_t writtenFrames = transferPcm(info, (char*) src, frames, TRUE, &info->conv);
+        pthread_mutex_unlock(&info->lock);
+        if (writtenFrames <= 0) {
+            return (int) writtenFrames;
+        }
+        info->isFlushed = 0;
+        if (info->meter != NULL) {
+            meterFloat(info->meter, src, (int) writtenFrames);
+        }
+        return (int) writtenFrames * info->channels;
+    }
+    // converting only what can be written now
+    int availFrames = doGetAvailBytes(info, TRUE) / info->frameBytes;
+    if (frames > availFrames) {
+        frames = availFrames;
+    }
+    if (frames == 0) {
+        return 0;
+    }
+    convertFromFloat(&info->conv, src, info->staging, frames * info->channels);
+    int ret = writeJavaData(info, info->staging, frames * info->frameBytes);
+    return (ret <= 0)? ret: (ret / info->frameBytes) * info->channels;
+}
+
+// Returns float samples written or -1 for error
+int doWriteFloat(PcmInfo* info, const float* src, int samples) {
+    pthread_mutex_lock(&info->ioLock);
+    int ret = writeFloatData(info, src, samples);
+    pthread_mutex_unlock(&info->ioLock);
+    return ret;
+}
+
+// called under ioLock
+int readFloatData(PcmInfo* info, float* dst, int samples) {
+    TRACE2("%s: %d samples\n", __FUNCTION__, samples);
+    if (!info->hasConv || samples <= 0) {
+        ERROR2("%s: float not supported or wrong samples=%d\n", __FUNCTION__, samples);
+        return -1;
+    }
+    int frames = getFloatFrames(info, samples);
+    if (frames == 0) {
+        return 0;
+    }
+    if (info->isMmap && !info->isNonInterleaved && !info->hasRingThread && info->resampler == NULL) {
+        if (!info->isRunning && info->isFlushed) {
+            return 0;
+        }
+        // converting straight from the device ring
+        pthread_mutex_lock(&info->lock);
+        snd_pcm_sframes_t readFrames = transferPcm(info, (char*) dst, frames, FALSE, &info->conv);
+        pthread_mutex_unlock(&info->lock);
+        if (readFrames <= 0) {
+            return (int) readFrames;
+        }
+        if (info->meter != NULL) {
+            meterFloat(info->meter, dst, (int) readFrames);
+        }
+        return (int) readFrames * info->channels;
+    }
+    int ret = readJavaData(info, info->staging, frames * info->frameBytes, NULL);
+    if (ret <= 0) {
+        return ret;
+    }
+    samples = (ret / info->frameBytes) * info->channels;
+    convertToFloat(&info->conv, info->staging, dst, samples);
+    return samples;
+}
+
+// Returns float samples read or -1 for error
+int doReadFloat(PcmInfo* info, float* dst, int samples) {
+    pthread_mutex_lock(&info->ioLock);
+    int ret = readFloatData(info, dst, samples);
+    pthread_mutex_unlock(&info->ioLock);
+    return ret;
+}
+
+
+// Copies peak/RMS pairs of all channels, returns the number of published windows or -1 without OPEN_FLAG_METER
+int doGetMeter(PcmInfo* info, float* levels) {
+    if (info->meter == NULL) {
+        return -1;
+    }
+    return readMeter(info->meter, levels);
+}
+
+// playback only. Returns FALSE if the format has no gain support
+int doSetGain(PcmInfo* info, float gain, int rampFrames) {
+    if (!info->isSource || !info->hasConv || !(gain >= 0.0f)) {
+        ERROR2("%s: gain not supported or wrong gain=%f\n", __FUNCTION__, gain);
+        return FALSE;
+    }
+    pthread_mutex_lock(&info->lock);
+    info->gain.level = gain;
+    requestGain(&info->gain, rampFrames);
+    pthread_mutex_unlock(&info->lock);
+    return TRUE;
+}
+
+// playback only. Returns FALSE if the format has no gain support
+int doSetMute(PcmInfo* info, int isMuted, int rampFrames) {
+    if (!info->isSource || !info->hasConv) {
+        ERROR1("%s: gain not supported\n", __FUNCTION__);
+        return FALSE;
+    }
+    pthread_mutex_lock(&info->lock);
+    info->gain.isMuted = isMuted;
+    requestGain(&info->gain, rampFrames);
+    pthread_mutex_unlock(&info->lock);
+    return TRUE;
+}
+
+// Returns after the device played out its buffer, stop/flush/close cancel the wait
+void doDrain(PcmInfo* info) {
+    int generation = __atomic_load_n(&info->waitGeneration, __ATOMIC_SEQ_CST);
+    // the device can drain only what the ring thread has passed to it
+    if (info->hasRingThread && info->isSource && !waitRingEmpty(info, generation)) {
+        return;
+    }
+    // the handle is non-blocking, the drain only starts and returns -EAGAIN. Not holding the lock while waiting
+    pthread_mutex_lock(&info->lock);
     int ret = snd_pcm_drain(info->handle);
-    if (ret != 0) {
+    pthread_mutex_unlock(&info->lock);
+    if (ret != 0 && ret != -EAGAIN) {
         ERROR2("%s: snd_pcm_drain: %s\n", __FUNCTION__, snd_strerror(ret));
+        return;
+    }
+    while (TRUE) {
+        snd_pcm_sframes_t delay = 0;
+        pthread_mutex_lock(&info->lock);
+        snd_pcm_state_t state = snd_pcm_state(info->handle);
+        if (state == SND_PCM_STATE_DRAINING && snd_pcm_delay(info->handle, &delay) < 0) {
+            delay = 0;
+        }
+        pthread_mutex_unlock(&info->lock);
+        if (state != SND_PCM_STATE_DRAINING) {
+            TRACE2("%s: drained, state %s\n", __FUNCTION__, snd_pcm_state_name(state));
+            return;
+        }
+        // sleeping until the buffered frames are played, the device then reaches SETUP
+        int delayMs = (delay > 0)? (int) ((INT64) delay * 1000 / info->rate) + 1: 1;
+        if (!sleepOnWaiter(info, generation, delayMs)) {
+            return;
+        }
     }
 }
 
-void doFlush(PcmInfo* info, int isSource) {
-    TRACE1("%s: start\n", __FUNCTION__);
+// called under ioLock and lock
+static void flushPcm(PcmInfo* info, int isSource) {
+    if (info->hasRingThread) {
+        // the ring thread consumes (playback) or produces (capture) only under the lock
+        ringSkipAll(&info->ring);
+        info->pendingDropped = 0;
+        info->nextStartNs = 0;
+    }
+    if (info->resampler != NULL) {
+        resetResampler(info->resampler);
+    }
     if (info->isFlushed) {
         return;
     }
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(info->handle, &delay) < 0) {
+        delay = 0;
+    }
     int ret = snd_pcm_drop(info->handle);
     if (ret != 0) {
         ERROR2("%s: snd_pcm_drop: %s\n", __FUNCTION__, snd_strerror(ret));
         return;
     }
+    // dropped frames never reach the DAC (playback), captured ones still count (capture)
+    info->pcmFrames += isSource? -delay: delay;
     info->isFlushed = 1;
     if (info->isRunning) {
-        ret = doStart(info, isSource);
+        startPcm(info, isSource);
     }
 }
 
-int doGetAvailBytes(PcmInfo* info, int isSource) {
+void doFlush(PcmInfo* info, int isSource) {
+    TRACE1("%s: start\n", __FUNCTION__);
+    // java I/O state (resampler) first, then the device
+    pthread_mutex_lock(&info->ioLock);
+    pthread_mutex_lock(&info->lock);
+    flushPcm(info, isSource);
+    pthread_mutex_unlock(&info->lock);
+    pthread_mutex_unlock(&info->ioLock);
+    cancelWait(info);
+    if (info->hasRingThread) {
+        // a timer wakeup may be far ahead
+        wakeRingThread(info);
+    }
+}
+
+int doGetBufferBytes(PcmInfo* info) {
+    int bytes = info->hasRingThread? info->ring.size: info->bufferBytes;
+    return (info->resampler != NULL)? (int) toJavaBytes(info, bytes): bytes;
+}
+
+// avail at the device rate. status - device status taken under the lock, NULL to query the device
+static int getStreamAvailBytes(PcmInfo* info, int isSource, snd_pcm_status_t* status) {
     int ret;
-    snd_pcm_state_t state = snd_pcm_state(info->handle);
+    if (info->hasRingThread) {
+        if (isSource) {
+            ret = info->isFlushed? info->ring.size: ringSpace(&info->ring);
+        } else {
+            ret = ringFill(&info->ring);
+        }
+        TRACE2("%s: %d bytes in ring\n", __FUNCTION__, ret);
+        return ret;
+    }
+    snd_pcm_state_t state = (status != NULL)? snd_pcm_status_get_state(status): snd_pcm_state(info->handle);
     if (info->isFlushed || state == SND_PCM_STATE_XRUN) {
         ret = info->bufferBytes;
     } else {
-        snd_pcm_sframes_t availFrames = snd_pcm_avail_update(info->handle);
+        snd_pcm_sframes_t availFrames = (status != NULL)? (snd_pcm_sframes_t) snd_pcm_status_get_avail(status):
+                snd_pcm_avail_update(info->handle);
         if (availFrames < 0) {
             ret = 0;
         } else {
@@ -751,24 +1895,301 @@ int doGetAvailBytes(PcmInfo* info, int isSource) {
     return ret;
 }
 
-INT64 doGetBytePos(PcmInfo* info, int isSource, INT64 javaBytePos) {
+// stream avail -> java rate avail
+static int toJavaAvailBytes(PcmInfo* info, int isSource, int ret) {
+    Resampler* rs = info->resampler;
+    if (rs != NULL) {
+        // playback pending output waits for the device, capture pending output is ready for java
+        if (isSource) {
+            ret = (ret > rs->pendingBytes)? (int) toJavaBytes(info, ret - rs->pendingBytes): 0;
+        } else {
+            ret = (int) toJavaBytes(info, ret) + rs->pendingBytes;
+        }
+    }
+    return ret;
+}
+
+int doGetAvailBytes(PcmInfo* info, int isSource) {
+    return toJavaAvailBytes(info, isSource, getStreamAvailBytes(info, isSource, NULL));
+}
+
+// javaBytePos - bytes written to/read from the stream at the device rate
+static INT64 getStreamBytePos(PcmInfo* info, int isSource, INT64 javaBytePos) {
     int ret;
     INT64 result = javaBytePos;
-    snd_pcm_state_t state = snd_pcm_state(info->handle);
+    if (info->hasRingThread) {
+        // data still waiting in the ring have not reached the device (playback) or java (capture) yet
+        if (!isSource) {
+            javaBytePos += ringFill(&info->ring);
+        } else if (!info->isFlushed) {
+            javaBytePos -= ringFill(&info->ring);
+        }
+        result = javaBytePos;
+    }
+    if (info->isFlushed) {
+        return result;
+    }
+    // state and avail from a single call
+    snd_pcm_status_t* status;
+    snd_pcm_status_alloca(&status);
+    ret = snd_pcm_status(info->handle, status);
+    if (ret < 0) {
+        ERROR2("%s: snd_pcm_status: %s\n", __FUNCTION__, snd_strerror(ret));
+        result = javaBytePos;
+    } else if (snd_pcm_status_get_state(status) != SND_PCM_STATE_XRUN) {
+        int availBytes = (int) snd_pcm_status_get_avail(status) * info->frameBytes;
+        if (isSource){
+            result =(INT64) (javaBytePos - (info->bufferBytes - availBytes));
+        } else {
+            result = (INT64) (javaBytePos + availBytes);
+        }
+    }
+    return result;
+}
 
-    if (!info->isFlushed && state != SND_PCM_STATE_XRUN) {
-        snd_pcm_uframes_t availFrames = snd_pcm_avail(info->handle);
-        if (availFrames < 0) {
-            ERROR2("%s: snd_pcm_avail: %s\n", __FUNCTION__, snd_strerror(ret));
-            result = javaBytePos;
+INT64 doGetBytePos(PcmInfo* info, int isSource, INT64 javaBytePos) {
+    INT64 result;
+    pthread_mutex_lock(&info->lock);
+    Resampler* rs = info->resampler;
+    if (rs == NULL) {
+        result = getStreamBytePos(info, isSource, javaBytePos);
+    } else {
+        // device rate offset from the stream position, input frames held in the filter history count as not
+        // passed yet
+        INT64 lookahead = (INT64) (rs->taps / 2) * info->frameBytes;
+        if (isSource) {
+            INT64 offset = getStreamBytePos(info, isSource, 0) - rs->pendingBytes;
+            result = javaBytePos + toJavaBytes(info, offset) - lookahead;
         } else {
-            int availBytes = availFrames * info->frameBytes;
-            if (isSource){
-                result =(INT64) (javaBytePos - (info->bufferBytes - availBytes));
-            } else {
-                result = (INT64) (javaBytePos + availBytes);
-            }
+            INT64 offset = getStreamBytePos(info, isSource, 0) + lookahead;
+            result = javaBytePos + toJavaBytes(info, offset) + rs->pendingBytes;
         }
     }
+    pthread_mutex_unlock(&info->lock);
     return result;
 }
+
+static INT64 toNs(const snd_htimestamp_t* ts)
+{
+    return (INT64) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// device rate frames -> java rate frames
+static INT64 toJavaFrames(PcmInfo* info, INT64 frames)
+{
+    return (info->resampler != NULL)? toJavaBytes(info, frames * info->frameBytes) / info->frameBytes: frames;
+}
+
+// Device status with the frames transferred at the same moment, called under the lock (all transfers run under
+// the lock). Returns FALSE if the status is not available
+static int getPcmStatus(PcmInfo* info, snd_pcm_status_t* status, INT64* pcmFrames)
+{
+    int ret = snd_pcm_status(info->handle, status);
+    *pcmFrames = info->pcmFrames;
+    if (ret < 0) {
+        ERROR2("%s: snd_pcm_status: %s\n", __FUNCTION__, snd_strerror(ret));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// frames transferred so far -/+ the device delay, at the time of the device timestamp. Called under the lock
+static void fillPosition(PcmInfo* info, int isSource, snd_pcm_status_t* status, INT64 pcmFrames,
+        PcmPosition* pos)
+{
+    INT64 delay = snd_pcm_status_get_delay(status);
+    if (snd_pcm_status_get_state(status) == SND_PCM_STATE_XRUN) {
+        // all written data played, the rest of captured data lost
+        delay = 0;
+    }
+    INT64 devicePos = isSource? pcmFrames - delay: pcmFrames + delay;
+    // frames waiting in the ring
+    if (info->hasRingThread) {
+        delay += ringFill(&info->ring) / info->frameBytes;
+    }
+    pos->framePos = toJavaFrames(info, devicePos);
+    pos->delayFrames = toJavaFrames(info, delay);
+    Resampler* rs = info->resampler;
+    if (rs != NULL) {
+        // pending output, playback at the device rate, capture at the java rate. Filter lookahead
+        if (isSource) {
+            pos->delayFrames += toJavaFrames(info, rs->pendingBytes / info->frameBytes);
+        } else {
+            pos->delayFrames += rs->pendingBytes / info->frameBytes;
+        }
+        pos->delayFrames += rs->taps / 2;
+    }
+
+    snd_htimestamp_t ts;
+    snd_pcm_status_get_htstamp(status, &ts);
+    pos->tstampNs = toNs(&ts);
+    if (pos->tstampNs == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pos->tstampNs = toNs(&now);
+    }
+    snd_pcm_status_get_audio_htstamp(status, &ts);
+    pos->audioTstampNs = toNs(&ts);
+    TRACE4("%s: pos %lld, delay %lld, tstamp %lld\n", __FUNCTION__, (long long) pos->framePos,
+            (long long) pos->delayFrames, (long long) pos->tstampNs);
+}
+
+// Position from a single snd_pcm_status call. Returns FALSE if the status is not available
+int doGetPosition(PcmInfo* info, int isSource, PcmPosition* pos)
+{
+    snd_pcm_status_t* status;
+    snd_pcm_status_alloca(&status);
+    INT64 pcmFrames;
+    pthread_mutex_lock(&info->lock);
+    int ret = getPcmStatus(info, status, &pcmFrames);
+    if (ret) {
+        fillPosition(info, isSource, status, pcmFrames, pos);
+    }
+    pthread_mutex_unlock(&info->lock);
+    return ret;
+}
+
+// Refreshes the status block shared with java from a single snd_pcm_status call.
+// Returns the pcm state or -1 if the status is not available
+int doRefreshStatus(PcmInfo* info, int isSource)
+{
+    snd_pcm_status_t* status;
+    snd_pcm_status_alloca(&status);
+    INT64 pcmFrames;
+    PcmPosition pos;
+    StatusBlock* block = info->statusBlock;
+    pthread_mutex_lock(&info->lock);
+    if (!getPcmStatus(info, status, &pcmFrames)) {
+        pthread_mutex_unlock(&info->lock);
+        return -1;
+    }
+    fillPosition(info, isSource, status, pcmFrames, &pos);
+    int availBytes = toJavaAvailBytes(info, isSource, getStreamAvailBytes(info, isSource, status));
+    int state = (int) snd_pcm_status_get_state(status);
+    // refreshes are serialized by the lock, java readers retry while seq is odd or changes
+    UINT32 seq = block->seq;
+    __atomic_store_n(&block->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&block->state, state, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->availBytes, availBytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->xrunCnt, info->xrunCnt, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->delayFrames, pos.delayFrames, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->framePos, pos.framePos, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->tstampNs, pos.tstampNs, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->seq, seq + 2, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&info->lock);
+    return state;
+}
+
+
+/********** WAITING *********/
+
+static INT64 getMonotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (INT64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// with info->lock held. Device wakes poll only when avail_min frames are available
+static void setAvailMin(PcmInfo* info, snd_pcm_uframes_t frames)
+{
+    if (frames == info->availMin) {
+        return;
+    }
+    int ret = snd_pcm_sw_params_set_avail_min(info->handle, info->swParams, frames);
+    if (ret == 0) {
+        ret = snd_pcm_sw_params(info->handle, info->swParams);
+    }
+    if (ret < 0) {
+        ERROR2("%s: setting avail_min: %s\n", __FUNCTION__, snd_strerror(ret));
+        return;
+    }
+    info->availMin = frames;
+}
+
+// device frames making javaBytes available to java, rounded up as doGetAvailBytes rounds down
+static snd_pcm_uframes_t toDeviceFrames(PcmInfo* info, int javaBytes)
+{
+    INT64 frames = javaBytes / info->frameBytes;
+    if (info->resampler != NULL) {
+        Resampler* rs = info->resampler;
+        frames = (frames * rs->deviceRate + rs->javaRate - 1) / rs->javaRate;
+    }
+    INT64 bufferFrames = info->bufferBytes / info->frameBytes;
+    return (snd_pcm_uframes_t) ((frames < bufferFrames)? frames: bufferFrames);
+}
+
+static int waitAvail(PcmInfo* info, int isSource, int bytes, int timeoutMs)
+{
+    int generation = __atomic_load_n(&info->waitGeneration, __ATOMIC_SEQ_CST);
+    INT64 deadline = getMonotonicMs() + timeoutMs;
+    struct pollfd fds[1 + MAX_PCM_POLL_FDS];
+    fds[0].fd = info->waitFd;
+    fds[0].events = POLLIN;
+    while (TRUE) {
+        int fdsCnt = 1;
+        if (info->hasRingThread) {
+            // the ring thread wakes us after every transfer. Announcing before checking the ring
+            __atomic_store_n(&info->isAppWaiting, TRUE, __ATOMIC_SEQ_CST);
+        } else if (isSource || info->isRunning) {
+            int pcmFdsCnt = snd_pcm_poll_descriptors(info->handle, &fds[1], MAX_PCM_POLL_FDS);
+            if (pcmFdsCnt > 0) {
+                fdsCnt += pcmFdsCnt;
+            }
+        }
+        int avail = doGetAvailBytes(info, isSource);
+        int remainingMs = (int) (deadline - getMonotonicMs());
+        if (avail >= bytes || remainingMs <= 0
+                || generation != __atomic_load_n(&info->waitGeneration, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&info->isAppWaiting, FALSE, __ATOMIC_SEQ_CST);
+            TRACE3("%s: %d bytes available, %d requested\n", __FUNCTION__, avail, bytes);
+            return avail;
+        }
+        int ret = poll(fds, fdsCnt, remainingMs);
+        __atomic_store_n(&info->isAppWaiting, FALSE, __ATOMIC_SEQ_CST);
+        if (ret < 0) {
+            if (errno != EINTR) {
+                ERROR2("%s: poll failed: %s\n", __FUNCTION__, strerror(errno));
+                return -1;
+            }
+        } else if (ret > 0) {
+            if (fds[0].revents & POLLIN) {
+                UINT64 val;
+                // non-blocking, resets the counter
+                if (read(info->waitFd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+                    ERROR2("%s: read from eventfd failed: %s\n", __FUNCTION__, strerror(errno));
+                }
+            }
+            if (fdsCnt > 1) {
+                unsigned short revents;
+                snd_pcm_poll_descriptors_revents(info->handle, &fds[1], fdsCnt - 1, &revents);
+            }
+        }
+    }
+}
+
+// Sleeps until at least bytes can be written (playback) or read (capture), timeoutMs passes or stop/flush/close
+// cancels the wait. Returns the available bytes (less than bytes on timeout or cancel), -1 for error.
+// Without the ring avail_min is lowered to the wait for its duration, the negotiated period size is restored after
+int doWaitAvail(PcmInfo* info, int isSource, int bytes, int timeoutMs)
+{
+    int bufferBytes = doGetBufferBytes(info);
+    if (bytes > bufferBytes) {
+        bytes = bufferBytes;
+    }
+    if (bytes < info->frameBytes) {
+        bytes = info->frameBytes;
+    }
+    if (info->hasRingThread) {
+        return waitAvail(info, isSource, bytes, timeoutMs);
+    }
+    pthread_mutex_lock(&info->lock);
+    setAvailMin(info, toDeviceFrames(info, bytes));
+    pthread_mutex_unlock(&info->lock);
+    int ret = waitAvail(info, isSource, bytes, timeoutMs);
+    pthread_mutex_lock(&info->lock);
+    setAvailMin(info, info->periodSize);
+    pthread_mutex_unlock(&info->lock);
+    return ret;
+}
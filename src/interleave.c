@@ -0,0 +1,339 @@
+#include "common.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAS_SSE2_KERNELS
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAS_NEON_KERNELS
+#endif
+
+// (De)interleaving between java interleaved frames and per-channel planes of non-interleaved devices.
+// Vector kernels for 2 channels (16/32 bits), channels in multiples of 4 (32 bits) and 8 (16 bits, SSE2 only),
+// scalar code for the rest.
+
+
+/********** SCALAR **********/
+
+static void deinterleaveScalar(const char* src, char* const* planes, int startFrame, int frames, int channels,
+        int sampleBytes)
+{
+    int ch;
+    int f;
+    for (ch = 0; ch < channels; ch++) {
+        char* dst = planes[ch];
+        if (sampleBytes == 2) {
+            const INT16* in = (const INT16*) src;
+            INT16* out = (INT16*) dst;
+            for (f = startFrame; f < frames; f++) {
+                out[f] = in[f * channels + ch];
+            }
+        } else if (sampleBytes == 4) {
+            const INT32* in = (const INT32*) src;
+            INT32* out = (INT32*) dst;
+            for (f = startFrame; f < frames; f++) {
+                out[f] = in[f * channels + ch];
+            }
+        } else {
+            for (f = startFrame; f < frames; f++) {
+                memcpy(dst + f * sampleBytes, src + (f * channels + ch) * sampleBytes, sampleBytes);
+            }
+        }
+    }
+}
+
+static void interleaveScalar(char* const* planes, char* dst, int startFrame, int frames, int channels,
+        int sampleBytes)
+{
+    int ch;
+    int f;
+    for (ch = 0; ch < channels; ch++) {
+        const char* src = planes[ch];
+        if (sampleBytes == 2) {
+            const INT16* in = (const INT16*) src;
+            INT16* out = (INT16*) dst;
+            for (f = startFrame; f < frames; f++) {
+                out[f * channels + ch] = in[f];
+            }
+        } else if (sampleBytes == 4) {
+            const INT32* in = (const INT32*) src;
+            INT32* out = (INT32*) dst;
+            for (f = startFrame; f < frames; f++) {
+                out[f * channels + ch] = in[f];
+            }
+        } else {
+            for (f = startFrame; f < frames; f++) {
+                memcpy(dst + (f * channels + ch) * sampleBytes, src + f * sampleBytes, sampleBytes);
+            }
+        }
+    }
+}
+
+
+#ifdef HAS_SSE2_KERNELS
+/********** SSE2 **********/
+
+static inline void transpose4x4x32(__m128i* r)
+{
+    __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]);
+    __m128i t1 = _mm_unpacklo_epi32(r[2], r[3]);
+    __m128i t2 = _mm_unpackhi_epi32(r[0], r[1]);
+    __m128i t3 = _mm_unpackhi_epi32(r[2], r[3]);
+    r[0] = _mm_unpacklo_epi64(t0, t1);
+    r[1] = _mm_unpackhi_epi64(t0, t1);
+    r[2] = _mm_unpacklo_epi64(t2, t3);
+    r[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+static inline void transpose8x8x16(__m128i* r)
+{
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+    __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+    __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+    __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+    __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+    r[0] = _mm_unpacklo_epi64(b0, b4);
+    r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5);
+    r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6);
+    r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7);
+    r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+// returns frames done, the rest is left for scalar code
+static int deinterleaveVector(const char* src, char* const* planes, int frames, int channels, int sampleBytes)
+{
+    int ch;
+    int i;
+    int f = 0;
+    if (channels == 2 && sampleBytes == 2) {
+        const __m128i* in = (const __m128i*) src;
+        for (; f + 8 <= frames; f += 8) {
+            __m128i a = _mm_loadu_si128(in++);
+            __m128i b = _mm_loadu_si128(in++);
+            // left in the low halves of 32-bit pairs, right in the high ones
+            __m128i left = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                    _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+            __m128i right = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+            _mm_storeu_si128((__m128i*) (planes[0] + f * 2), left);
+            _mm_storeu_si128((__m128i*) (planes[1] + f * 2), right);
+        }
+    } else if (channels == 2 && sampleBytes == 4) {
+        const __m128i* in = (const __m128i*) src;
+        for (; f + 4 <= frames; f += 4) {
+            __m128 a = _mm_castsi128_ps(_mm_loadu_si128(in++));
+            __m128 b = _mm_castsi128_ps(_mm_loadu_si128(in++));
+            __m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            _mm_storeu_si128((__m128i*) (planes[0] + f * 4), _mm_castps_si128(left));
+            _mm_storeu_si128((__m128i*) (planes[1] + f * 4), _mm_castps_si128(right));
+        }
+    } else if (channels % 4 == 0 && sampleBytes == 4) {
+        const INT32* in = (const INT32*) src;
+        __m128i r[4];
+        for (; f + 4 <= frames; f += 4) {
+            for (ch = 0; ch < channels; ch += 4) {
+                for (i = 0; i < 4; i++) {
+                    r[i] = _mm_loadu_si128((const __m128i*) (in + (f + i) * channels + ch));
+                }
+                transpose4x4x32(r);
+                for (i = 0; i < 4; i++) {
+                    _mm_storeu_si128((__m128i*) (planes[ch + i] + f * 4), r[i]);
+                }
+            }
+        }
+    } else if (channels % 8 == 0 && sampleBytes == 2) {
+        const INT16* in = (const INT16*) src;
+        __m128i r[8];
+        for (; f + 8 <= frames; f += 8) {
+            for (ch = 0; ch < channels; ch += 8) {
+                for (i = 0; i < 8; i++) {
+                    r[i] = _mm_loadu_si128((const __m128i*) (in + (f + i) * channels + ch));
+                }
+                transpose8x8x16(r);
+                for (i = 0; i < 8; i++) {
+                    _mm_storeu_si128((__m128i*) (planes[ch + i] + f * 2), r[i]);
+                }
+            }
+        }
+    }
+    return f;
+}
+
+static int interleaveVector(char* const* planes, char* dst, int frames, int channels, int sampleBytes)
+{
+    int ch;
+    int i;
+    int f = 0;
+    if (channels == 2 && sampleBytes == 2) {
+        __m128i* out = (__m128i*) dst;
+        for (; f + 8 <= frames; f += 8) {
+            __m128i left = _mm_loadu_si128((const __m128i*) (planes[0] + f * 2));
+            __m128i right = _mm_loadu_si128((const __m128i*) (planes[1] + f * 2));
+            _mm_storeu_si128(out++, _mm_unpacklo_epi16(left, right));
+            _mm_storeu_si128(out++, _mm_unpackhi_epi16(left, right));
+        }
+    } else if (channels == 2 && sampleBytes == 4) {
+        __m128i* out = (__m128i*) dst;
+        for (; f + 4 <= frames; f += 4) {
+            __m128i left = _mm_loadu_si128((const __m128i*) (planes[0] + f * 4));
+            __m128i right = _mm_loadu_si128((const __m128i*) (planes[1] + f * 4));
+            _mm_storeu_si128(out++, _mm_unpacklo_epi32(left, right));
+            _mm_storeu_si128(out++, _mm_unpackhi_epi32(left, right));
+        }
+    } else if (channels % 4 == 0 && sampleBytes == 4) {
+        INT32* out = (INT32*) dst;
+        __m128i r[4];
+        for (; f + 4 <= frames; f += 4) {
+            for (ch = 0; ch < channels; ch += 4) {
+                for (i = 0; i < 4; i++) {
+                    r[i] = _mm_loadu_si128((const __m128i*) (planes[ch + i] + f * 4));
+                }
+                transpose4x4x32(r);
+                for (i = 0; i < 4; i++) {
+                    _mm_storeu_si128((__m128i*) (out + (f + i) * channels + ch), r[i]);
+                }
+            }
+        }
+    } else if (channels % 8 == 0 && sampleBytes == 2) {
+        INT16* out = (INT16*) dst;
+        __m128i r[8];
+        for (; f + 8 <= frames; f += 8) {
+            for (ch = 0; ch < channels; ch += 8) {
+                for (i = 0; i < 8; i++) {
+                    r[i] = _mm_loadu_si128((const __m128i*) (planes[ch + i] + f * 2));
+                }
+                transpose8x8x16(r);
+                for (i = 0; i < 8; i++) {
+                    _mm_storeu_si128((__m128i*) (out + (f + i) * channels + ch), r[i]);
+                }
+            }
+        }
+    }
+    return f;
+}
+
+#elif defined(HAS_NEON_KERNELS)
+/********** NEON **********/
+
+static inline void transpose4x4x32(int32x4_t* r)
+{
+    int32x4x2_t t0 = vtrnq_s32(r[0], r[1]);
+    int32x4x2_t t1 = vtrnq_s32(r[2], r[3]);
+    r[0] = vcombine_s32(vget_low_s32(t0.val[0]), vget_low_s32(t1.val[0]));
+    r[1] = vcombine_s32(vget_low_s32(t0.val[1]), vget_low_s32(t1.val[1]));
+    r[2] = vcombine_s32(vget_high_s32(t0.val[0]), vget_high_s32(t1.val[0]));
+    r[3] = vcombine_s32(vget_high_s32(t0.val[1]), vget_high_s32(t1.val[1]));
+}
+
+static int deinterleaveVector(const char* src, char* const* planes, int frames, int channels, int sampleBytes)
+{
+    int ch;
+    int i;
+    int f = 0;
+    if (channels == 2 && sampleBytes == 2) {
+        for (; f + 8 <= frames; f += 8) {
+            int16x8x2_t v = vld2q_s16((const int16_t*) src + f * 2);
+            vst1q_s16((int16_t*) planes[0] + f, v.val[0]);
+            vst1q_s16((int16_t*) planes[1] + f, v.val[1]);
+        }
+    } else if (channels == 2 && sampleBytes == 4) {
+        for (; f + 4 <= frames; f += 4) {
+            int32x4x2_t v = vld2q_s32((const int32_t*) src + f * 2);
+            vst1q_s32((int32_t*) planes[0] + f, v.val[0]);
+            vst1q_s32((int32_t*) planes[1] + f, v.val[1]);
+        }
+    } else if (channels % 4 == 0 && sampleBytes == 4) {
+        const int32_t* in = (const int32_t*) src;
+        int32x4_t r[4];
+        for (; f + 4 <= frames; f += 4) {
+            for (ch = 0; ch < channels; ch += 4) {
+                for (i = 0; i < 4; i++) {
+                    r[i] = vld1q_s32(in + (f + i) * channels + ch);
+                }
+                transpose4x4x32(r);
+                for (i = 0; i < 4; i++) {
+                    vst1q_s32((int32_t*) planes[ch + i] + f, r[i]);
+                }
+            }
+        }
+    }
+    return f;
+}
+
+static int interleaveVector(char* const* planes, char* dst, int frames, int channels, int sampleBytes)
+{
+    int ch;
+    int i;
+    int f = 0;
+    if (channels == 2 && sampleBytes == 2) {
+        for (; f + 8 <= frames; f += 8) {
+            int16x8x2_t v;
+            v.val[0] = vld1q_s16((const int16_t*) planes[0] + f);
+            v.val[1] = vld1q_s16((const int16_t*) planes[1] + f);
+            vst2q_s16((int16_t*) dst + f * 2, v);
+        }
+    } else if (channels == 2 && sampleBytes == 4) {
+        for (; f + 4 <= frames; f += 4) {
+            int32x4x2_t v;
+            v.val[0] = vld1q_s32((const int32_t*) planes[0] + f);
+            v.val[1] = vld1q_s32((const int32_t*) planes[1] + f);
+            vst2q_s32((int32_t*) dst + f * 2, v);
+        }
+    } else if (channels % 4 == 0 && sampleBytes == 4) {
+        int32_t* out = (int32_t*) dst;
+        int32x4_t r[4];
+        for (; f + 4 <= frames; f += 4) {
+            for (ch = 0; ch < channels; ch += 4) {
+                for (i = 0; i < 4; i++) {
+                    r[i] = vld1q_s32((const int32_t*) planes[ch + i] + f);
+                }
+                transpose4x4x32(r);
+                for (i = 0; i < 4; i++) {
+                    vst1q_s32(out + (f + i) * channels + ch, r[i]);
+                }
+            }
+        }
+    }
+    return f;
+}
+
+#else
+static int deinterleaveVector(const char* src, char* const* planes, int frames, int channels, int sampleBytes)
+{
+    return 0;
+}
+
+static int interleaveVector(char* const* planes, char* dst, int frames, int channels, int sampleBytes)
+{
+    return 0;
+}
+#endif
+
+
+// interleaved src -> planes[channel], frames from the plane start
+void deinterleave(const char* src, char* const* planes, int frames, int channels, int sampleBytes)
+{
+    int done = deinterleaveVector(src, planes, frames, channels, sampleBytes);
+    deinterleaveScalar(src, planes, done, frames, channels, sampleBytes);
+}
+
+// planes[channel] -> interleaved dst
+void interleave(char* const* planes, char* dst, int frames, int channels, int sampleBytes)
+{
+    int done = interleaveVector(planes, dst, frames, channels, sampleBytes);
+    interleaveScalar(planes, dst, done, frames, channels, sampleBytes);
+}
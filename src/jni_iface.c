@@ -5,25 +5,155 @@
 #include "com_cleansine_sound_provider_SimpleMixer.h"
 #include "com_cleansine_sound_provider_SimpleMixerProvider.h"
 
+#define MIXER_CLASS         "com/cleansine/sound/provider/SimpleMixer"
+#define MIXER_INFO_CLASS    "com/cleansine/sound/provider/SimpleMixerInfo"
 #define ADD_FORMAT_METHOD   "addFormat"
+#define ADD_FORMATS_METHOD  "addFormats"
+// ints per format in the array passed to addFormats
+#define PACKED_FMT_INTS     7
 
-// called from impl
-void clbkAddAudioFmt(AddFmtMethodInfo* mInfo, int sampleSignBits, int frameBytes,
-	int channels, int rate, int enc, int isSigned, int bigEndian)
+// class refs and method IDs looked up once in JNI_OnLoad
+static jclass mixerCls = NULL;
+static jmethodID addFormatMethodID = NULL;
+static jmethodID addFormatsMethodID = NULL;
+static jclass mixerInfoCls = NULL;
+static jmethodID mixerInfoConstrID = NULL;
+// serializes cacheJniIDs, mixerInfoCls is published last
+static pthread_mutex_t jniIDsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// must be called with jniIDsLock held
+static int cacheJniIDs(JNIEnv* env)
 {
-    if (frameBytes <= 0) {
-        if (channels > 0) {
-            frameBytes = ((sampleSignBits + 7) / 8) * channels;
-        } else {
-            frameBytes = -1;
+    jclass cls;
+    if (mixerCls == NULL) {
+        cls = (*env)->FindClass(env, MIXER_CLASS);
+        if (cls == NULL) {
+            ERROR2("%s: class %s not found\n", __FUNCTION__, MIXER_CLASS);
+            return FALSE;
+        }
+        addFormatMethodID = (*env)->GetStaticMethodID(env, cls, ADD_FORMAT_METHOD, "(Ljava/util/Vector;IIIIIZZ)V");
+        if (addFormatMethodID == NULL) {
+            ERROR1("Could not get method ID for %s!\n", ADD_FORMAT_METHOD);
+            return FALSE;
+        }
+        // optional, older java providers have only addFormat
+        addFormatsMethodID = (*env)->GetStaticMethodID(env, cls, ADD_FORMATS_METHOD, "(Ljava/util/Vector;[I)V");
+        if (addFormatsMethodID == NULL) {
+            (*env)->ExceptionClear(env);
+            TRACE1("%s: no batch method, formats will be added one by one\n", __FUNCTION__);
+        }
+        mixerCls = (jclass) (*env)->NewGlobalRef(env, cls);
+        (*env)->DeleteLocalRef(env, cls);
+        if (mixerCls == NULL) {
+            return FALSE;
         }
     }
+
+    cls = (*env)->FindClass(env, MIXER_INFO_CLASS);
+    if (cls == NULL) {
+        ERROR2("%s: class %s not found\n", __FUNCTION__, MIXER_INFO_CLASS);
+        return FALSE;
+    }
+    mixerInfoConstrID = (*env)->GetMethodID(env, cls, "<init>",
+                                 "(ILjava/lang/String;ILjava/lang/String;Ljava/lang/String;Ljava/lang/String;)V");
+    if (mixerInfoConstrID == NULL) {
+        ERROR1("%s: constr is NULL\n", __FUNCTION__);
+        return FALSE;
+    }
+    jclass infoCls = (jclass) (*env)->NewGlobalRef(env, cls);
+    (*env)->DeleteLocalRef(env, cls);
+    // all the other IDs visible to whoever sees mixerInfoCls
+    __atomic_store_n(&mixerInfoCls, infoCls, __ATOMIC_RELEASE);
+    return (infoCls != NULL)? TRUE: FALSE;
+}
+
+// IDs are normally cached by JNI_OnLoad, retrying here in case the classes were not loadable at that time
+static int ensureJniIDs(JNIEnv* env)
+{
+    if (__atomic_load_n(&mixerInfoCls, __ATOMIC_ACQUIRE) != NULL) {
+        return TRUE;
+    }
+    int ret = TRUE;
+    pthread_mutex_lock(&jniIDsLock);
+    // another thread may have cached the IDs meanwhile
+    if (mixerInfoCls == NULL && !cacheJniIDs(env)) {
+        (*env)->ExceptionClear(env);
+        ret = FALSE;
+    }
+    pthread_mutex_unlock(&jniIDsLock);
+    return ret;
+}
+
+JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* reserved)
+{
+    JNIEnv* env;
+    if ((*vm)->GetEnv(vm, (void**) &env, JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
+    // not fatal, will retry at first use
+    ensureJniIDs(env);
+    return JNI_VERSION_1_6;
+}
+
+static int getFrameBytes(const AudioFmt* fmt)
+{
+    if (fmt->frameBytes > 0) {
+        return fmt->frameBytes;
+    }
+    return (fmt->channels > 0)? ((fmt->sampleSignBits + 7) / 8) * fmt->channels: -1;
+}
+
+static void addAudioFmt(AddFmtMethodInfo* mInfo, const AudioFmt* fmt)
+{
+    int frameBytes = getFrameBytes(fmt);
     TRACE4("%s: sampleSignBits=%d, frameBytes=%d, channels=%d, ",
-           __FUNCTION__, sampleSignBits, frameBytes, channels);
+           __FUNCTION__, fmt->sampleSignBits, frameBytes, fmt->channels);
     TRACE4(" rate=%d, enc=%d, signed=%d, bigEndian=%d\n",
-           (int) rate, enc, isSigned, bigEndian);
+           fmt->rate, fmt->enc, fmt->isSigned, fmt->isBigEndian);
     (*mInfo->env)->CallStaticVoidMethod(mInfo->env, mInfo->clazz, mInfo->methodID,
-            mInfo->vector, sampleSignBits, frameBytes, channels, rate, enc, isSigned, bigEndian);
+            mInfo->vector, fmt->sampleSignBits, frameBytes, fmt->channels, fmt->rate, fmt->enc,
+            (jboolean) fmt->isSigned, (jboolean) fmt->isBigEndian);
+}
+
+// called from impl. Passes all formats in one int[] of PACKED_FMT_INTS per format, in the order of addFormat params
+void clbkAddAudioFmts(AddFmtMethodInfo* mInfo, const FmtList* list)
+{
+    JNIEnv* env = mInfo->env;
+    int i;
+    if (list->cnt == 0) {
+        return;
+    }
+    if (mInfo->batchMethodID == NULL) {
+        for (i = 0; i < list->cnt; ++i) {
+            addAudioFmt(mInfo, &list->fmts[i]);
+        }
+        return;
+    }
+    jsize len = (jsize) (list->cnt * PACKED_FMT_INTS);
+    jint* packed = (jint*) malloc(len * sizeof(jint));
+    if (packed == NULL) {
+        ERROR1("%s: Out of memory\n", __FUNCTION__);
+        return;
+    }
+    for (i = 0; i < list->cnt; ++i) {
+        const AudioFmt* fmt = &list->fmts[i];
+        jint* item = packed + i * PACKED_FMT_INTS;
+        item[0] = fmt->sampleSignBits;
+        item[1] = getFrameBytes(fmt);
+        item[2] = fmt->channels;
+        item[3] = fmt->rate;
+        item[4] = fmt->enc;
+        item[5] = fmt->isSigned;
+        item[6] = fmt->isBigEndian;
+    }
+    jintArray jPacked = (*env)->NewIntArray(env, len);
+    if (jPacked != NULL) {
+        (*env)->SetIntArrayRegion(env, jPacked, 0, len, packed);
+        TRACE2("%s: passing %d formats\n", __FUNCTION__, list->cnt);
+        (*env)->CallStaticVoidMethod(env, mInfo->clazz, mInfo->batchMethodID, mInfo->vector, jPacked);
+        (*env)->DeleteLocalRef(env, jPacked);
+    }
+    free(packed);
 }
 
 JNIEXPORT void JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetFormats
@@ -31,17 +161,31 @@ JNIEXPORT void JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetFormats
 {
     AddFmtMethodInfo mInfo;
 
+    if (!ensureJniIDs(env)) {
+        return;
+    }
     mInfo.env = env;
     mInfo.vector = formats;
-    mInfo.clazz = clazz;
-    mInfo.methodID = (*env)->GetStaticMethodID(env, clazz, ADD_FORMAT_METHOD, "(Ljava/util/Vector;IIIIIZZ)V");
-    if (mInfo.methodID == NULL) {
-        ERROR1("Could not get method ID for %s!\n", ADD_FORMAT_METHOD);
-    } else {
-        const char *utf_deviceID = (*env)->GetStringUTFChars(env, deviceID, 0);
-        doGetFmts(utf_deviceID, (int) isSource, &mInfo);
-        (*env)->ReleaseStringUTFChars(env, deviceID, utf_deviceID);
+    mInfo.clazz = mixerCls;
+    mInfo.methodID = addFormatMethodID;
+    mInfo.batchMethodID = addFormatsMethodID;
+    const char *utf_deviceID = (*env)->GetStringUTFChars(env, deviceID, 0);
+    doGetFmts(utf_deviceID, (int) isSource, &mInfo);
+    (*env)->ReleaseStringUTFChars(env, deviceID, utf_deviceID);
+}
+
+// handle of the opened line, 0 if not opened
+static INT64 registerOpened(PcmInfo* info, int isSource)
+{
+    if (info == NULL) {
+        return 0;
+    }
+    INT64 handle = registerPcm(info);
+    if (handle == 0) {
+        doClose(info, isSource);
+        free(info);
     }
+    return handle;
 }
 
 JNIEXPORT jlong JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nOpen
@@ -53,126 +197,450 @@ JNIEXPORT jlong JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nOpen
     PcmInfo* info =doOpen(utf_deviceID, (int) isSource,
                              (int) enc, (int) rate, (int) sampleSignBits,
                              (int) frameBytes, (int) channels,
-                             (int) isSigned, (int) isBigEndian, (int) bufferBytes);
+                             (int) isSigned, (int) isBigEndian, (int) bufferBytes, 0, NULL);
     (*env)->ReleaseStringUTFChars(env, deviceID, utf_deviceID);
-    return (jlong) (UINT_PTR) info;
+    return (jlong) registerOpened(info, (int) isSource);
+}
+
+// nOpen with OPEN_FLAG_* flags
+JNIEXPORT jlong JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nOpenEx
+	(JNIEnv* env, jclass clazz, jstring deviceID, jboolean isSource,
+	jint enc, jint rate, jint sampleSignBits, jint frameBytes, jint channels,
+	jboolean isSigned, jboolean isBigEndian, jint bufferBytes, jint flags)
+{
+    const char *utf_deviceID = (*env)->GetStringUTFChars(env, deviceID, 0);
+    PcmInfo* info =doOpen(utf_deviceID, (int) isSource,
+                             (int) enc, (int) rate, (int) sampleSignBits,
+                             (int) frameBytes, (int) channels,
+                             (int) isSigned, (int) isBigEndian, (int) bufferBytes, (int) flags, NULL);
+    (*env)->ReleaseStringUTFChars(env, deviceID, utf_deviceID);
+    return (jlong) registerOpened(info, (int) isSource);
+}
+
+// nOpenEx negotiating the device buffer/period by target latency and wakeup granularity (0 for half of the latency).
+// Fills negotiated with periodSize, periods and bufferSize in device frames. The ring of OPEN_FLAG_RING has
+// the size of the device buffer
+JNIEXPORT jlong JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nOpenLatency
+	(JNIEnv* env, jclass clazz, jstring deviceID, jboolean isSource,
+	jint enc, jint rate, jint sampleSignBits, jint frameBytes, jint channels,
+	jboolean isSigned, jboolean isBigEndian, jint latencyUs, jint wakeupUs, jint flags, jintArray negotiated)
+{
+    if (negotiated == NULL || (*env)->GetArrayLength(env, negotiated) < 3 || latencyUs <= 0 || wakeupUs < 0) {
+        return 0;
+    }
+    LatencyTarget latency;
+    latency.latencyUs = (int) latencyUs;
+    latency.wakeupUs = (int) wakeupUs;
+    const char *utf_deviceID = (*env)->GetStringUTFChars(env, deviceID, 0);
+    PcmInfo* info =doOpen(utf_deviceID, (int) isSource,
+                             (int) enc, (int) rate, (int) sampleSignBits,
+                             (int) frameBytes, (int) channels,
+                             (int) isSigned, (int) isBigEndian, 0, (int) flags, &latency);
+    (*env)->ReleaseStringUTFChars(env, deviceID, utf_deviceID);
+    if (info != NULL) {
+        jint values[3];
+        values[0] = (jint) info->periodSize;
+        values[1] = (jint) info->periods;
+        values[2] = (jint) (info->bufferBytes / info->frameBytes);
+        (*env)->SetIntArrayRegion(env, negotiated, 0, 3, values);
+    }
+    return (jlong) registerOpened(info, (int) isSource);
 }
 
 JNIEXPORT void JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nStart
 	(JNIEnv* env, jclass clazz, jlong nativePtr, jboolean isSource)
 {
-    PcmInfo* info = (PcmInfo*) (UINT_PTR) nativePtr;
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
     if (info) {
         doStart(info, (int) isSource);
     }
+    releasePcm(info);
 }
 
 JNIEXPORT void JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nStop
 	(JNIEnv* env, jclass clazz, jlong nativePtr, jboolean isSource)
 {
-    PcmInfo* info = (PcmInfo*) (UINT_PTR) nativePtr;
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
     if (info) {
         doStop(info, (int) isSource);
     }
+    releasePcm(info);
 }
 
 
 JNIEXPORT void JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nClose
 	(JNIEnv* env, jclass clazz, jlong nativePtr, jboolean isSource)
 {
-    PcmInfo* info = (PcmInfo*) (UINT_PTR) nativePtr;
+    // waits for calls of other threads in progress
+    PcmInfo* info = unregisterPcm((INT64) nativePtr);
     if (info) {
         doClose(info, (int) isSource);
         free(info);
     }
 }
 
+// checks the [offset, offset + len) region fits into the array
+static int checkArrayRegion(JNIEnv* env, jarray jData, jint offset, jint len)
+{
+    if (offset < 0 || len < 0) {
+        ERROR3("%s: wrong parameters: offset=%d, len=%d\n", __FUNCTION__, offset, len);
+        return FALSE;
+    }
+    jsize arrayLen = (*env)->GetArrayLength(env, jData);
+    if ((jlong) offset + (jlong) len > (jlong) arrayLen) {
+        ERROR4("%s: region offset=%d, len=%d exceeds array length %d\n", __FUNCTION__, offset, len, (int) arrayLen);
+        return FALSE;
+    }
+    return TRUE;
+}
+
 JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nWrite
 	(JNIEnv *env, jclass clazz, jlong nativePtr, jbyteArray jData, jint offset, jint len)
 {
-    PcmInfo* info = (PcmInfo*) (UINT_PTR) nativePtr;
     int ret = -1;
-    if (offset < 0 || len < 0) {
-        ERROR2("nWrite: wrong parameters: offset=%d, len=%d\n", offset, len);
+    if (!checkArrayRegion(env, jData, offset, len)) {
         return ret;
     }
     if (len == 0) {
         return 0;
     }
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
     if (info) {
-        jboolean didCopy;
-        UINT8* data = (UINT8*) ((*env)->GetByteArrayElements(env, jData, &didCopy));
-        if (data == NULL)
-            return ret;
-        UINT8* offsetData = data;
-        offsetData += (int) offset;
-        ret = doWrite(info, (INT8*) offsetData, (int) len);
-        (*env)->ReleaseByteArrayElements(env, jData, (jbyte*) data, JNI_ABORT);
+        // copying only the region, at most what fits into the device buffer. Java writes the rest in the next call
+        if (len > info->stagingBytes) {
+            len = info->stagingBytes;
+        }
+        // staging is shared by all calls on the line, filled and consumed under ioLock
+        pthread_mutex_lock(&info->ioLock);
+        (*env)->GetByteArrayRegion(env, jData, offset, len, (jbyte*) info->staging);
+        ret = writeJavaData(info, info->staging, (int) len);
+        pthread_mutex_unlock(&info->ioLock);
     }
+    releasePcm(info);
     return (jint) ret;
 }
 
 JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nRead
 	(JNIEnv* env, jclass clazz, jlong nativePtr, jbyteArray jData, jint offset, jint len)
 {
-    PcmInfo* info = (PcmInfo*) (UINT_PTR) nativePtr;
     int ret = -1;
+    if (!checkArrayRegion(env, jData, offset, len)) {
+        return ret;
+    }
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    if (info) {
+        if (len > info->stagingBytes) {
+            len = info->stagingBytes;
+        }
+        pthread_mutex_lock(&info->ioLock);
+        ret = readJavaData(info, info->staging, (int) len, NULL);
+        if (ret > 0) {
+            // copying back only the bytes actually read
+            (*env)->SetByteArrayRegion(env, jData, offset, ret, (const jbyte*) info->staging);
+        }
+        pthread_mutex_unlock(&info->ioLock);
+    }
+    releasePcm(info);
+    return (jint) ret;
+}
+
+// nRead also returning dropped frames before the data and CLOCK_MONOTONIC ns of the first frame in stamp[0], stamp[1].
+// Both are tracked only by lines opened with the ring.
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nReadStamped
+	(JNIEnv* env, jclass clazz, jlong nativePtr, jbyteArray jData, jint offset, jint len, jlongArray jStamp)
+{
+    int ret = -1;
+    if (!checkArrayRegion(env, jData, offset, len)) {
+        return ret;
+    }
+    if (jStamp == NULL || (*env)->GetArrayLength(env, jStamp) < 2) {
+        ERROR1("%s: stamp array must hold 2 longs\n", __FUNCTION__);
+        return ret;
+    }
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    if (info) {
+        if (len > info->stagingBytes) {
+            len = info->stagingBytes;
+        }
+        ReadStamp stamp;
+        pthread_mutex_lock(&info->ioLock);
+        ret = readJavaData(info, info->staging, (int) len, &stamp);
+        if (ret > 0) {
+            (*env)->SetByteArrayRegion(env, jData, offset, ret, (const jbyte*) info->staging);
+        }
+        pthread_mutex_unlock(&info->ioLock);
+        if (ret >= 0) {
+            jlong values[2] = {(jlong) stamp.droppedFrames, (jlong) stamp.tstampNs};
+            (*env)->SetLongArrayRegion(env, jStamp, 0, 2, values);
+        }
+    }
+    releasePcm(info);
+    return (jint) ret;
+}
+
+// returns address of the [offset, offset + len) region of direct buffer, NULL if not direct or out of bounds
+static UINT8* getDirectRegion(JNIEnv* env, jobject buffer, jint offset, jint len)
+{
     if (offset < 0 || len < 0) {
         ERROR3("%s: wrong parameters: offset=%d, len=%d\n", __FUNCTION__, offset, len);
+        return NULL;
+    }
+    UINT8* data = (UINT8*) (*env)->GetDirectBufferAddress(env, buffer);
+    if (data == NULL) {
+        ERROR1("%s: not a direct buffer\n", __FUNCTION__);
+        return NULL;
+    }
+    jlong capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+    if ((jlong) offset + (jlong) len > capacity) {
+        ERROR4("%s: region offset=%d, len=%d exceeds capacity %ld\n", __FUNCTION__, offset, len, (long) capacity);
+        return NULL;
+    }
+    return data + offset;
+}
+
+// zero-copy variant of nWrite for direct ByteBuffers
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nWriteDirect
+	(JNIEnv *env, jclass clazz, jlong nativePtr, jobject buffer, jint offset, jint len)
+{
+    int ret = -1;
+    if (len == 0) {
+        return 0;
+    }
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    if (info) {
+        UINT8* data = getDirectRegion(env, buffer, offset, len);
+        if (data != NULL) {
+            ret = doWrite(info, (INT8*) data, (int) len);
+        }
+    }
+    releasePcm(info);
+    return (jint) ret;
+}
+
+// zero-copy variant of nRead for direct ByteBuffers
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nReadDirect
+	(JNIEnv *env, jclass clazz, jlong nativePtr, jobject buffer, jint offset, jint len)
+{
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    int ret = -1;
+    if (info) {
+        UINT8* data = getDirectRegion(env, buffer, offset, len);
+        if (data != NULL) {
+            ret = doRead(info, (char*) data, (int) len);
+        }
+    }
+    releasePcm(info);
+    return (jint) ret;
+}
+
+// float variants of nWrite/nRead for lines of 16, 24 and 32 bit signed little-endian formats.
+// Offset and len in floats, returning floats written/read
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nWriteFloat
+	(JNIEnv* env, jclass clazz, jlong nativePtr, jfloatArray jData, jint offset, jint len)
+{
+    int ret = -1;
+    if (!checkArrayRegion(env, jData, offset, len)) {
         return ret;
     }
+    if (len == 0) {
+        return 0;
+    }
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    if (info && info->hasConv) {
+        if (len > info->floatStagingSamples) {
+            len = info->floatStagingSamples;
+        }
+        pthread_mutex_lock(&info->ioLock);
+        (*env)->GetFloatArrayRegion(env, jData, offset, len, info->floatStaging);
+        ret = writeFloatData(info, info->floatStaging, (int) len);
+        pthread_mutex_unlock(&info->ioLock);
+    }
+    releasePcm(info);
+    return (jint) ret;
+}
+
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nReadFloat
+	(JNIEnv* env, jclass clazz, jlong nativePtr, jfloatArray jData, jint offset, jint len)
+{
+    int ret = -1;
+    if (!checkArrayRegion(env, jData, offset, len)) {
+        return ret;
+    }
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    if (info && info->hasConv) {
+        if (len > info->floatStagingSamples) {
+            len = info->floatStagingSamples;
+        }
+        pthread_mutex_lock(&info->ioLock);
+        ret = readFloatData(info, info->floatStaging, (int) len);
+        if (ret > 0) {
+            (*env)->SetFloatArrayRegion(env, jData, offset, ret, info->floatStaging);
+        }
+        pthread_mutex_unlock(&info->ioLock);
+    }
+    releasePcm(info);
+    return (jint) ret;
+}
+
+// float variants of nWriteDirect/nReadDirect, native-order floats. Offset and len in bytes, returning bytes
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nWriteFloatDirect
+	(JNIEnv *env, jclass clazz, jlong nativePtr, jobject buffer, jint offset, jint len)
+{
+    int ret = -1;
+    if (len == 0) {
+        return 0;
+    }
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
     if (info) {
-        char* data = (char*) ((*env)->GetByteArrayElements(env, jData, NULL));
-        if (data == NULL)
-            return ret;
-        char* offsetData = data;
-        offsetData += (int) offset;
-        ret = doRead(info, offsetData, (int) len);
-        (*env)->ReleaseByteArrayElements(env, jData, (jbyte*) data, 0);
+        UINT8* data = getDirectRegion(env, buffer, offset, len);
+        if (data != NULL) {
+            ret = doWriteFloat(info, (const float*) data, (int) len / (int) sizeof(float));
+            if (ret > 0) {
+                ret *= sizeof(float);
+            }
+        }
     }
+    releasePcm(info);
+    return (jint) ret;
+}
+
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nReadFloatDirect
+	(JNIEnv *env, jclass clazz, jlong nativePtr, jobject buffer, jint offset, jint len)
+{
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    int ret = -1;
+    if (info) {
+        UINT8* data = getDirectRegion(env, buffer, offset, len);
+        if (data != NULL) {
+            ret = doReadFloat(info, (float*) data, (int) len / (int) sizeof(float));
+            if (ret > 0) {
+                ret *= sizeof(float);
+            }
+        }
+    }
+    releasePcm(info);
     return (jint) ret;
 }
 
 JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetBufferBytes
 	(JNIEnv* env, jclass clazz, jlong nativePtr, jboolean isSource)
 {
-    PcmInfo* info = (PcmInfo*) (UINT_PTR) nativePtr;
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
     int ret = -1;
     if (info) {
-        ret = info->bufferBytes;
+        ret = doGetBufferBytes(info);
     }
+    releasePcm(info);
     return (jint) ret;
 }
 
 JNIEXPORT void JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nDrain
 	(JNIEnv* env, jclass clazz, jlong nativePtr)
 {
-    PcmInfo* info = (PcmInfo*) (UINT_PTR) nativePtr;
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
     if (info) {
         doDrain(info);
     }
+    releasePcm(info);
 }
 
 
 JNIEXPORT void JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nFlush
 	(JNIEnv* env, jclass clazz, jlong nativePtr, jboolean isSource)
 {
-    PcmInfo* info = (PcmInfo*) (UINT_PTR) nativePtr;
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
 
     if (info) {
         doFlush(info, (int) isSource);
     }
+    releasePcm(info);
 }
 
 
 JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetAvailBytes
 	(JNIEnv* env, jclass clazz, jlong nativePtr, jboolean isSource)
 {
-    PcmInfo* info = (PcmInfo*) (UINT_PTR) nativePtr;
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
     int ret = -1;
     if (info) {
         ret = doGetAvailBytes(info, (int) isSource);
     }
+    releasePcm(info);
+    return (jint) ret;
+}
+
+// peak/RMS pairs of all channels from the last metering window. Returns the number of windows so far, -1 if
+// the line was not opened with OPEN_FLAG_METER or levels is too short
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetMeter
+	(JNIEnv* env, jclass clazz, jlong nativePtr, jfloatArray jLevels)
+{
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    int ret = -1;
+    if (info && info->meter != NULL) {
+        int len = 2 * info->channels;
+        if ((*env)->GetArrayLength(env, jLevels) < len) {
+            ERROR2("%s: levels shorter than %d\n", __FUNCTION__, len);
+            releasePcm(info);
+            return ret;
+        }
+        float levels[len];
+        ret = doGetMeter(info, levels);
+        (*env)->SetFloatArrayRegion(env, jLevels, 0, len, levels);
+    }
+    releasePcm(info);
+    return (jint) ret;
+}
+
+// the metering snapshot shared with java: int seq (odd while updated), int channels, int generation, peak/RMS float
+// pairs. A consistent read sees the same even seq before and after reading the levels. NULL without OPEN_FLAG_METER.
+// The snapshot outlives the line, generation differs from the handle's high 32 bits once it is closed
+JNIEXPORT jobject JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetMeterBuffer
+	(JNIEnv* env, jclass clazz, jlong nativePtr)
+{
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    jobject buffer = NULL;
+    if (info && info->meter != NULL) {
+        buffer = (*env)->NewDirectByteBuffer(env, info->meter->snapshot, (jlong) info->meter->snapshotBytes);
+    }
+    releasePcm(info);
+    return buffer;
+}
+
+// gain of a playback line, ramped linearly over rampFrames. Returns false if the format has no gain support
+JNIEXPORT jboolean JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nSetGain
+	(JNIEnv* env, jclass clazz, jlong nativePtr, jfloat gain, jint rampFrames)
+{
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    jboolean ret = JNI_FALSE;
+    if (info) {
+        ret = (jboolean) doSetGain(info, (float) gain, (int) rampFrames);
+    }
+    releasePcm(info);
+    return ret;
+}
+
+JNIEXPORT jboolean JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nSetMute
+	(JNIEnv* env, jclass clazz, jlong nativePtr, jboolean isMuted, jint rampFrames)
+{
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    jboolean ret = JNI_FALSE;
+    if (info) {
+        ret = (jboolean) doSetMute(info, (int) isMuted, (int) rampFrames);
+    }
+    releasePcm(info);
+    return ret;
+}
+
+// blocks until bytes are available, timeoutMs passes or the line is stopped/flushed/closed. Returns available bytes
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nWaitAvail
+	(JNIEnv* env, jclass clazz, jlong nativePtr, jboolean isSource, jint bytes, jint timeoutMs)
+{
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    int ret = -1;
+    if (info) {
+        ret = doWaitAvail(info, (int) isSource, (int) bytes, (int) timeoutMs);
+    }
+    releasePcm(info);
     return (jint) ret;
 }
 
@@ -180,14 +648,64 @@ JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetAvailBy
 JNIEXPORT jlong JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetBytePos
 	(JNIEnv* env, jclass clazz, jlong nativePtr, jboolean isSource, jlong javaBytePos)
 {
-    PcmInfo* info = (PcmInfo*) (UINT_PTR) nativePtr;
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
     INT64 ret = (INT64) javaBytePos;
     if (info) {
         ret = doGetBytePos(info, (int) isSource, (INT64) javaBytePos);
     }
+    releasePcm(info);
     return (jlong) ret;
 }
 
+// refreshes the status block by a single snd_pcm_status call. Returns the pcm state, -1 on error
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nRefreshStatus
+	(JNIEnv* env, jclass clazz, jlong nativePtr, jboolean isSource)
+{
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    int ret = -1;
+    if (info) {
+        ret = doRefreshStatus(info, (int) isSource);
+    }
+    releasePcm(info);
+    return (jint) ret;
+}
+
+// the status block shared with java: int seq (odd while refreshed), int state, int availBytes, int xrunCount,
+// long delayFrames, long framePos, long tstampNs, int generation. A consistent read sees the same even seq before
+// and after. The block outlives the line, generation differs from the handle's high 32 bits once it is closed
+JNIEXPORT jobject JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetStatusBuffer
+	(JNIEnv* env, jclass clazz, jlong nativePtr)
+{
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    jobject buffer = NULL;
+    if (info) {
+        buffer = (*env)->NewDirectByteBuffer(env, info->statusBlock, (jlong) sizeof(StatusBlock));
+    }
+    releasePcm(info);
+    return buffer;
+}
+
+// fills pos with frame position, delay frames, CLOCK_MONOTONIC ns of the position and driver audio time ns
+JNIEXPORT jboolean JNICALL Java_com_cleansine_sound_provider_SimpleMixer_nGetPosition
+	(JNIEnv* env, jclass clazz, jlong nativePtr, jboolean isSource, jlongArray jPos)
+{
+    if (jPos == NULL || (*env)->GetArrayLength(env, jPos) < 4) {
+        ERROR1("%s: pos array must hold 4 longs\n", __FUNCTION__);
+        return JNI_FALSE;
+    }
+    jboolean ret = JNI_FALSE;
+    PcmPosition pos;
+    PcmInfo* info = acquirePcm((INT64) nativePtr);
+    if (info && doGetPosition(info, (int) isSource, &pos)) {
+        jlong values[4] = {(jlong) pos.framePos, (jlong) pos.delayFrames, (jlong) pos.tstampNs,
+                (jlong) pos.audioTstampNs};
+        (*env)->SetLongArrayRegion(env, jPos, 0, 4, values);
+        ret = JNI_TRUE;
+    }
+    releasePcm(info);
+    return ret;
+}
+
 JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixerProvider_nGetMixerCnt
 	(JNIEnv *env, jclass clazz)
 {
@@ -198,53 +716,43 @@ JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixerProvider_nGe
     return (jint)mixerCnt;
 }
 
+// returns new local ref of SimpleMixerInfo or NULL
+static jobject createMixerInfo(JNIEnv *env, jint idx, MixerDesc* desc)
+{
+    jobject mixerInfo = NULL;
+    jstring name = (*env)->NewStringUTF(env, desc->name);
+    jstring deviceID = (*env)->NewStringUTF(env, desc->deviceID);
+    jstring vendor = (*env)->NewStringUTF(env, desc->vendor);
+    jstring description = (*env)->NewStringUTF(env, desc->description);
+    if (name != NULL && deviceID != NULL && vendor != NULL && description != NULL) {
+        mixerInfo = (*env)->NewObject(env, mixerInfoCls, mixerInfoConstrID, idx, deviceID,
+                                      desc->maxLines, name, vendor, description);
+    }
+    // releasing local refs, important when creating many infos in one native call
+    if (name != NULL)
+        (*env)->DeleteLocalRef(env, name);
+    if (deviceID != NULL)
+        (*env)->DeleteLocalRef(env, deviceID);
+    if (vendor != NULL)
+        (*env)->DeleteLocalRef(env, vendor);
+    if (description != NULL)
+        (*env)->DeleteLocalRef(env, description);
+    return mixerInfo;
+}
+
 JNIEXPORT jobject JNICALL Java_com_cleansine_sound_provider_SimpleMixerProvider_nCreateMixerInfo
 	(JNIEnv *env, jclass clazz, jint idx)
 {
-    jmethodID constr;
     MixerDesc desc;
     jobject mixerInfo = NULL;
-    jstring name;
-    jstring deviceID;
-    jstring vendor;
-    jstring description;
 
     TRACE2("%s: idx %d\n", __FUNCTION__, idx);
 
-    jclass infoCls = (*env)->FindClass(env, "com/cleansine/sound/provider/SimpleMixerInfo");
-    if (infoCls == NULL) {
-        ERROR1("%s: infoCls is NULL\n", __FUNCTION__);
-        return NULL;
-    }
-    constr = (*env)->GetMethodID(env, infoCls, "<init>",
-                                 "(ILjava/lang/String;ILjava/lang/String;Ljava/lang/String;Ljava/lang/String;)V");
-    if (constr == NULL) {
-        ERROR1("%s: constr is NULL\n", __FUNCTION__);
+    if (!ensureJniIDs(env)) {
         return NULL;
     }
-
-    desc.down_counter = idx;
-    strcpy(desc.deviceID, "UNKNOWN");
-    desc.maxLines = 0;
-    strcpy(desc.name, "UNKNOWN");
-    strcpy(desc.vendor, "UNKNOWN");
-    strcpy(desc.description, "UNKNOWN");
-
-    if (doFillDesc(&desc)) {
-        name = (*env)->NewStringUTF(env, desc.name);
-        if (name == NULL)
-            return mixerInfo;
-        deviceID = (*env)->NewStringUTF(env, desc.deviceID);
-        if (deviceID == NULL)
-            return mixerInfo;
-        vendor = (*env)->NewStringUTF(env, desc.vendor);
-        if (vendor == NULL)
-            return mixerInfo;
-        description = (*env)->NewStringUTF(env, desc.description);
-        if (description == NULL)
-            return mixerInfo;
-        mixerInfo = (*env)->NewObject(env, infoCls, constr, idx, deviceID,
-                                      desc.maxLines, name, vendor, description);
+    if (doFillDesc((INT32) idx, &desc)) {
+        mixerInfo = createMixerInfo(env, idx, &desc);
     } else {
         ERROR1("%s: doFillDesc(desc) returned FALSE!\n", __FUNCTION__);
     }
@@ -253,11 +761,76 @@ JNIEXPORT jobject JNICALL Java_com_cleansine_sound_provider_SimpleMixerProvider_
     return mixerInfo;
 }
 
+JNIEXPORT jobjectArray JNICALL Java_com_cleansine_sound_provider_SimpleMixerProvider_nGetAllMixerInfos
+	(JNIEnv *env, jclass clazz)
+{
+    MixerDesc* descs;
+    jobjectArray infos = NULL;
+
+    TRACE1("%s: starting\n", __FUNCTION__);
+    if (!ensureJniIDs(env)) {
+        return NULL;
+    }
+    INT32 cnt = doGetAllDescs(&descs);
+    if (cnt < 0) {
+        ERROR1("%s: doGetAllDescs failed!\n", __FUNCTION__);
+        return NULL;
+    }
+    infos = (*env)->NewObjectArray(env, (jsize) cnt, mixerInfoCls, NULL);
+    if (infos != NULL) {
+        int idx;
+        for (idx = 0; idx < cnt; ++idx) {
+            jobject mixerInfo = createMixerInfo(env, (jint) idx, &descs[idx]);
+            if (mixerInfo == NULL) {
+                // exception pending
+                infos = NULL;
+                break;
+            }
+            (*env)->SetObjectArrayElement(env, infos, (jsize) idx, mixerInfo);
+            (*env)->DeleteLocalRef(env, mixerInfo);
+        }
+    }
+    free(descs);
+    TRACE2("%s: %d infos done.\n", __FUNCTION__, (int) cnt);
+    return infos;
+}
+
+
+JNIEXPORT jint JNICALL Java_com_cleansine_sound_provider_SimpleMixerProvider_nProbeAllFormats
+	(JNIEnv *env, jclass clazz)
+{
+    TRACE1("%s: starting\n", __FUNCTION__);
+    INT32 cnt = doProbeAllFmts();
+    TRACE2("%s: probed %d devices\n", __FUNCTION__, cnt);
+    return (jint) cnt;
+}
 
 JNIEXPORT jboolean JNICALL Java_com_cleansine_sound_provider_SimpleMixerProvider_nInit
   (JNIEnv *env, jclass clazz, jint logLevelID, jstring logTarget, jintArray rates, jintArray channels,
    jint maxRateLimit, jint maxChannelsLimit)
 {
-	// logging is compiled-in, log params are ignored
-	return (jboolean) 1;
+    // entries above the settings limits are ignored anyway
+    jint ratesArr[SETTINGS_MAX_RATES];
+    jint channelsArr[SETTINGS_MAX_CHANNELS];
+    int ratesCnt = (rates != NULL)? (int) (*env)->GetArrayLength(env, rates): 0;
+    int channelsCnt = (channels != NULL)? (int) (*env)->GetArrayLength(env, channels): 0;
+    if (ratesCnt > SETTINGS_MAX_RATES) {
+        ratesCnt = SETTINGS_MAX_RATES;
+    }
+    if (channelsCnt > SETTINGS_MAX_CHANNELS) {
+        channelsCnt = SETTINGS_MAX_CHANNELS;
+    }
+    if (ratesCnt > 0) {
+        (*env)->GetIntArrayRegion(env, rates, 0, ratesCnt, ratesArr);
+    }
+    if (channelsCnt > 0) {
+        (*env)->GetIntArrayRegion(env, channels, 0, channelsCnt, channelsArr);
+    }
+    const char* utf_logTarget = (logTarget != NULL)? (*env)->GetStringUTFChars(env, logTarget, 0): NULL;
+    int ret = doInit((int) logLevelID, utf_logTarget, (const int*) ratesArr, ratesCnt,
+                     (const int*) channelsArr, channelsCnt, (int) maxRateLimit, (int) maxChannelsLimit);
+    if (utf_logTarget != NULL) {
+        (*env)->ReleaseStringUTFChars(env, logTarget, utf_logTarget);
+    }
+    return (jboolean) ret;
 }
@@ -0,0 +1,213 @@
+#include <math.h>
+#include "common.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAS_SSE2_KERNELS
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAS_NEON_KERNELS
+#endif
+
+// Per-channel peak and RMS of the data passing doWrite/doRead, over windows of METER_WINDOW_MS.
+// Accumulator lanes span a multiple of both the vector width and channels, lane j belongs to channel
+// j % channels. Finished windows are published to a seqlock-protected snapshot, read by java without locking.
+
+#define VECTOR_FLOATS   4
+// samples converted to float at once, rounded down to whole strides
+#define CHUNK_SAMPLES   1024
+
+
+/********** ACCUMULATION **********/
+
+static void accumulateScalar(const float* src, int samples, float* peak, float* sumSq)
+{
+    int i;
+    for (i = 0; i < samples; i++) {
+        float a = fabsf(src[i]);
+        if (a > peak[i]) {
+            peak[i] = a;
+        }
+        sumSq[i] += src[i] * src[i];
+    }
+}
+
+#ifdef HAS_SSE2_KERNELS
+static void accumulate(const float* src, int samples, int stride, float* peak, float* sumSq)
+{
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    int i = 0;
+    int j;
+    for (; i + stride <= samples; i += stride) {
+        for (j = 0; j < stride; j += VECTOR_FLOATS) {
+            __m128 v = _mm_loadu_ps(src + i + j);
+            _mm_storeu_ps(peak + j, _mm_max_ps(_mm_loadu_ps(peak + j), _mm_and_ps(v, absMask)));
+            _mm_storeu_ps(sumSq + j, _mm_add_ps(_mm_loadu_ps(sumSq + j), _mm_mul_ps(v, v)));
+        }
+    }
+    accumulateScalar(src + i, samples - i, peak, sumSq);
+}
+
+#elif defined(HAS_NEON_KERNELS)
+static void accumulate(const float* src, int samples, int stride, float* peak, float* sumSq)
+{
+    int i = 0;
+    int j;
+    for (; i + stride <= samples; i += stride) {
+        for (j = 0; j < stride; j += VECTOR_FLOATS) {
+            float32x4_t v = vld1q_f32(src + i + j);
+            vst1q_f32(peak + j, vmaxq_f32(vld1q_f32(peak + j), vabsq_f32(v)));
+            vst1q_f32(sumSq + j, vfmaq_f32(vld1q_f32(sumSq + j), v, v));
+        }
+    }
+    accumulateScalar(src + i, samples - i, peak, sumSq);
+}
+
+#else
+static void accumulate(const float* src, int samples, int stride, float* peak, float* sumSq)
+{
+    int i = 0;
+    for (; i + stride <= samples; i += stride) {
+        accumulateScalar(src + i, stride, peak, sumSq);
+    }
+    accumulateScalar(src + i, samples - i, peak, sumSq);
+}
+#endif
+
+
+/********** METER **********/
+
+// rate - java rate. Returns FALSE if out of memory
+int initMeter(Meter* meter, int channels, int rate)
+{
+    memset(meter, 0, sizeof(Meter));
+    meter->channels = channels;
+    meter->stride = channels * VECTOR_FLOATS / gcd(channels, VECTOR_FLOATS);
+    meter->windowFrames = (int) ((INT64) rate * METER_WINDOW_MS / 1000);
+    if (meter->windowFrames < 1) {
+        meter->windowFrames = 1;
+    }
+    meter->chunkSamples = (CHUNK_SAMPLES / meter->stride) * meter->stride;
+    if (meter->chunkSamples == 0) {
+        meter->chunkSamples = meter->stride;
+    }
+    meter->snapshotBytes = sizeof(MeterSnapshot) + 2 * channels * sizeof(float);
+    meter->peak = (float*) calloc(meter->stride, sizeof(float));
+    meter->sumSq = (float*) calloc(meter->stride, sizeof(float));
+    meter->chunk = (float*) malloc(meter->chunkSamples * sizeof(float));
+    if (meter->peak == NULL || meter->sumSq == NULL || meter->chunk == NULL) {
+        ERROR1("%s: Out of memory\n", __FUNCTION__);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// the snapshot belongs to the registry slot
+void freeMeter(Meter* meter)
+{
+    free(meter->peak);
+    free(meter->sumSq);
+    free(meter->chunk);
+}
+
+// by the registry when a line takes or leaves the slot, no writer meanwhile. Zeroes the levels of channels
+void resetMeterSnapshot(MeterSnapshot* snapshot, int channels, UINT32 generation)
+{
+    int i;
+    UINT32 seq = snapshot->seq;
+    __atomic_store_n(&snapshot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    float zero = 0.0f;
+    for (i = 0; i < 2 * channels; i++) {
+        __atomic_store(&snapshot->levels[i], &zero, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&snapshot->channels, channels, __ATOMIC_RELAXED);
+    __atomic_store_n(&snapshot->generation, generation, __ATOMIC_RELAXED);
+    __atomic_store_n(&snapshot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// single writer - doWrite or doRead thread
+static void publishWindow(Meter* meter)
+{
+    int ch;
+    int lane;
+    MeterSnapshot* snapshot = meter->snapshot;
+    UINT32 seq = snapshot->seq;
+    __atomic_store_n(&snapshot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (ch = 0; ch < meter->channels; ch++) {
+        float peak = 0.0f;
+        double sumSq = 0.0;
+        for (lane = ch; lane < meter->stride; lane += meter->channels) {
+            if (meter->peak[lane] > peak) {
+                peak = meter->peak[lane];
+            }
+            sumSq += meter->sumSq[lane];
+        }
+        __atomic_store(&snapshot->levels[2 * ch], &peak, __ATOMIC_RELAXED);
+        float rms = (float) sqrt(sumSq / meter->frames);
+        __atomic_store(&snapshot->levels[2 * ch + 1], &rms, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&snapshot->seq, seq + 2, __ATOMIC_RELEASE);
+    memset(meter->peak, 0, meter->stride * sizeof(float));
+    memset(meter->sumSq, 0, meter->stride * sizeof(float));
+    meter->frames = 0;
+}
+
+static void meterSamples(Meter* meter, const float* src, int frames)
+{
+    while (frames > 0) {
+        int cnt = meter->windowFrames - meter->frames;
+        if (cnt > frames) {
+            cnt = frames;
+        }
+        accumulate(src, cnt * meter->channels, meter->stride, meter->peak, meter->sumSq);
+        meter->frames += cnt;
+        if (meter->frames == meter->windowFrames) {
+            publishWindow(meter);
+        }
+        src += cnt * meter->channels;
+        frames -= cnt;
+    }
+}
+
+void meterFloat(Meter* meter, const float* src, int frames)
+{
+    meterSamples(meter, src, frames);
+}
+
+// integer samples converted in chunks which stay in cache
+void meterInt(Meter* meter, Converter* conv, const char* src, int frames)
+{
+    int chunkFrames = meter->chunkSamples / meter->channels;
+    int frameBytes = conv->sampleBytes * meter->channels;
+    while (frames > 0) {
+        int cnt = (frames < chunkFrames)? frames: chunkFrames;
+        convertToFloat(conv, src, meter->chunk, cnt * meter->channels);
+        meterSamples(meter, meter->chunk, cnt);
+        src += cnt * frameBytes;
+        frames -= cnt;
+    }
+}
+
+// any thread. Copies peak/rms pairs of the last window, returns the number of windows published so far
+int readMeter(Meter* meter, float* levels)
+{
+    int i;
+    MeterSnapshot* snapshot = meter->snapshot;
+    UINT32 seq;
+    while (TRUE) {
+        seq = __atomic_load_n(&snapshot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        for (i = 0; i < 2 * meter->channels; i++) {
+            __atomic_load(&snapshot->levels[i], &levels[i], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&snapshot->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+    return (int) ((seq - meter->seqBase) / 2);
+}
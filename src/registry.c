@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <time.h>
+#include "common.h"
+
+// Registry of open lines. Java gets a handle of the slot index (low 32 bits) and the slot generation (high 32 bits)
+// instead of a raw PcmInfo pointer, a stale handle of a closed line fails the generation check. Every call pins
+// the line by the slot refcount, unregisterPcm waits until the calls in progress finish before the line is freed.
+// The status block and the metering snapshot shared with java belong to the slot, not to the line: a direct ByteBuffer
+// kept by java after nClose stays readable, its generation field tells the line is closed.
+
+typedef struct {
+    PcmInfo* info;
+    UINT32 generation;
+    // calls in progress
+    int active;
+    int isClosing;
+    StatusBlock status;
+    // replaced by a larger one for a line of more channels, the old one may still be referenced by java and leaks
+    MeterSnapshot* meterSnapshot;
+    int meterChannels;
+} Slot;
+
+// slot 0 unused, handle 0 stays invalid
+static Slot slots[MAX_OPEN_PCMS];
+static pthread_mutex_t slotsLock = PTHREAD_MUTEX_INITIALIZER;
+// signalled when the last call of a closing line finishes
+static pthread_cond_t idleCond = PTHREAD_COND_INITIALIZER;
+
+static Slot* getSlot(INT64 handle)
+{
+    UINT32 idx = (UINT32) handle;
+    return (idx > 0 && idx < MAX_OPEN_PCMS)? &slots[idx]: NULL;
+}
+
+// no line uses the slot meanwhile, java readers of the block retry while seq is odd or changes
+static void setStatusGeneration(Slot* slot, UINT32 generation)
+{
+    StatusBlock* block = &slot->status;
+    UINT32 seq = block->seq;
+    __atomic_store_n(&block->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&block->state, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->availBytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->xrunCnt, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->delayFrames, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->framePos, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->tstampNs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->generation, generation, __ATOMIC_RELAXED);
+    __atomic_store_n(&block->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// the snapshot of the slot holding channels, NULL if out of memory
+static MeterSnapshot* getMeterSnapshot(Slot* slot, int channels)
+{
+    if (slot->meterChannels < channels) {
+        MeterSnapshot* snapshot = (MeterSnapshot*) calloc(1, sizeof(MeterSnapshot) + 2 * channels * sizeof(float));
+        if (snapshot == NULL) {
+            ERROR1("%s: Out of memory\n", __FUNCTION__);
+            return NULL;
+        }
+        slot->meterSnapshot = snapshot;
+        slot->meterChannels = channels;
+    }
+    return slot->meterSnapshot;
+}
+
+static void unpin(Slot* slot)
+{
+    if (__atomic_sub_fetch(&slot->active, 1, __ATOMIC_SEQ_CST) == 0
+            && __atomic_load_n(&slot->isClosing, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&slotsLock);
+        pthread_cond_broadcast(&idleCond);
+        pthread_mutex_unlock(&slotsLock);
+    }
+}
+
+// Returns the handle, 0 if all slots are taken
+INT64 registerPcm(PcmInfo* info)
+{
+    int idx;
+    pthread_mutex_lock(&slotsLock);
+    for (idx = 1; idx < MAX_OPEN_PCMS; idx++) {
+        Slot* slot = &slots[idx];
+        if (slot->info == NULL) {
+            MeterSnapshot* meterSnapshot = NULL;
+            if (info->meter != NULL) {
+                meterSnapshot = getMeterSnapshot(slot, info->meter->channels);
+                if (meterSnapshot == NULL) {
+                    pthread_mutex_unlock(&slotsLock);
+                    return 0;
+                }
+            }
+            // generation published before info, see acquirePcm. 0 marks a closed line in the status block
+            UINT32 generation = slot->generation + 1;
+            if (generation == 0) {
+                generation = 1;
+            }
+            __atomic_store_n(&slot->generation, generation, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->isClosing, FALSE, __ATOMIC_SEQ_CST);
+            setStatusGeneration(slot, generation);
+            if (meterSnapshot != NULL) {
+                resetMeterSnapshot(meterSnapshot, info->meter->channels, generation);
+                info->meter->snapshot = meterSnapshot;
+                info->meter->seqBase = meterSnapshot->seq;
+            }
+            info->handleIdx = idx;
+            info->statusBlock = &slot->status;
+            __atomic_store_n(&slot->info, info, __ATOMIC_RELEASE);
+            INT64 handle = ((INT64) slot->generation << 32) | (UINT32) idx;
+            pthread_mutex_unlock(&slotsLock);
+            return handle;
+        }
+    }
+    pthread_mutex_unlock(&slotsLock);
+    ERROR2("%s: all %d slots taken\n", __FUNCTION__, MAX_OPEN_PCMS - 1);
+    return 0;
+}
+
+// Lock-free. Returns the pinned line, NULL for a stale/invalid handle or a closing line. Pair with releasePcm
+PcmInfo* acquirePcm(INT64 handle)
+{
+    Slot* slot = getSlot(handle);
+    if (slot == NULL) {
+        return NULL;
+    }
+    // pinning first, unregisterPcm sets isClosing first - at least one of them sees the other
+    __atomic_add_fetch(&slot->active, 1, __ATOMIC_SEQ_CST);
+    PcmInfo* info = __atomic_load_n(&slot->info, __ATOMIC_ACQUIRE);
+    if (info == NULL || __atomic_load_n(&slot->generation, __ATOMIC_RELAXED) != (UINT32) (handle >> 32)
+            || __atomic_load_n(&slot->isClosing, __ATOMIC_SEQ_CST)) {
+        unpin(slot);
+        return NULL;
+    }
+    return info;
+}
+
+void releasePcm(PcmInfo* info)
+{
+    if (info != NULL) {
+        unpin(&slots[info->handleIdx]);
+    }
+}
+
+// Stops new calls, waits for the calls in progress (cancelling their waits) and frees the slot.
+// Returns the line to close, NULL for a stale/invalid handle or a line closed by another thread
+PcmInfo* unregisterPcm(INT64 handle)
+{
+    Slot* slot = getSlot(handle);
+    if (slot == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&slotsLock);
+    PcmInfo* info = slot->info;
+    if (info == NULL || slot->generation != (UINT32) (handle >> 32) || slot->isClosing) {
+        pthread_mutex_unlock(&slotsLock);
+        return NULL;
+    }
+    __atomic_store_n(&slot->isClosing, TRUE, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&slot->active, __ATOMIC_SEQ_CST) > 0) {
+        // a call may start waiting after the previous cancel
+        cancelWait(info);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CLOSE_WAIT_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&idleCond, &slotsLock, &deadline);
+    }
+    __atomic_store_n(&slot->info, NULL, __ATOMIC_RELEASE);
+    setStatusGeneration(slot, 0);
+    if (info->meter != NULL) {
+        resetMeterSnapshot(info->meter->snapshot, info->meter->channels, 0);
+    }
+    pthread_mutex_unlock(&slotsLock);
+    return info;
+}
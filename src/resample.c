@@ -0,0 +1,380 @@
+#include <math.h>
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_X86_KERNELS
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAS_NEON_KERNELS
+#endif
+
+// Polyphase windowed-sinc (Kaiser) resampling between the java rate and the rate the device runs at.
+// The rational ratio out/in = phases/step gives exact phases, each phase has its own tap set.
+// Samples are resampled as floats, streams of integer formats go through their Converter.
+
+typedef struct {
+    // taps at ratio 1, more when downsampling
+    int taps;
+    // passband edge relative to the lower nyquist
+    double rolloff;
+    double kaiserBeta;
+} Quality;
+
+// indexed by (flags & OPEN_FLAG_RESAMPLE_MASK) >> 2
+static const Quality QUALITIES[] = {
+    {0, 0, 0},
+    // OPEN_FLAG_RESAMPLE_FAST
+    {16, 0.85, 6.0},
+    // OPEN_FLAG_RESAMPLE_MEDIUM
+    {32, 0.92, 8.0},
+    // OPEN_FLAG_RESAMPLE_BEST
+    {64, 0.96, 10.0},
+};
+
+typedef float (*DotFunc)(const float* a, const float* b, int n);
+
+static DotFunc dot;
+static pthread_once_t dotOnce = PTHREAD_ONCE_INIT;
+
+
+/********** DOT PRODUCT **********/
+
+// n is a multiple of 8 in all kernels
+static float dotScalar(const float* a, const float* b, int n)
+{
+    int i;
+    float sum = 0.0f;
+    for (i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#ifdef HAS_X86_KERNELS
+__attribute__((target("sse")))
+static float dotSSE(const float* a, const float* b, int n)
+{
+    int i;
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    for (i = 0; i < n; i += 8) {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(sum0, sum1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2,fma")))
+static float dotAVX2(const float* a, const float* b, int n)
+{
+    int i;
+    __m256 sum = _mm256_setzero_ps();
+    for (i = 0; i < n; i += 8) {
+        sum = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum);
+    }
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, half);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+#endif
+
+#ifdef HAS_NEON_KERNELS
+static float dotNEON(const float* a, const float* b, int n)
+{
+    int i;
+    float32x4_t sum0 = vdupq_n_f32(0.0f);
+    float32x4_t sum1 = vdupq_n_f32(0.0f);
+    for (i = 0; i < n; i += 8) {
+        sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+        sum1 = vfmaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    return vaddvq_f32(vaddq_f32(sum0, sum1));
+}
+#endif
+
+static void selectDot()
+{
+    dot = dotScalar;
+#if defined(HAS_X86_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        dot = dotAVX2;
+    } else if (__builtin_cpu_supports("sse")) {
+        dot = dotSSE;
+    }
+#elif defined(HAS_NEON_KERNELS)
+    dot = dotNEON;
+#endif
+}
+
+
+/********** FILTER **********/
+
+// modified Bessel function of the first kind, order 0
+static double besselI0(double x)
+{
+    int k;
+    double sum = 1.0;
+    double term = 1.0;
+    for (k = 1; k < 50; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+// greatest common divisor, also used by the meter
+int gcd(int a, int b)
+{
+    while (b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// tap k of phase p weighs input sample (idx - taps/2 + 1 + k) for output at time idx + p/phases
+static void fillCoefs(Resampler* rs, double cutoff, double beta)
+{
+    int p;
+    int k;
+    int half = rs->taps / 2;
+    double i0Beta = besselI0(beta);
+    for (p = 0; p < rs->phases; p++) {
+        float* coef = rs->coefs + p * rs->taps;
+        double frac = (double) p / rs->phases;
+        double sum = 0.0;
+        for (k = 0; k < rs->taps; k++) {
+            double x = (k - half + 1) - frac;
+            double u = x / half;
+            double h = 0.0;
+            if (u > -1.0 && u < 1.0) {
+                double arg = M_PI * cutoff * x;
+                double sinc = (fabs(arg) < 1e-9)? 1.0: sin(arg) / arg;
+                h = cutoff * sinc * besselI0(beta * sqrt(1.0 - u * u)) / i0Beta;
+            }
+            coef[k] = (float) h;
+            sum += h;
+        }
+        // unity DC gain of every phase
+        for (k = 0; k < rs->taps; k++) {
+            coef[k] = (float) (coef[k] / sum);
+        }
+    }
+}
+
+// quality - index to QUALITIES. Returns FALSE if the ratio needs too many phases or out of memory
+int initResampler(Resampler* rs, int quality, int isSource, int channels, int frameBytes, int javaRate,
+        int deviceRate)
+{
+    memset(rs, 0, sizeof(Resampler));
+    pthread_once(&dotOnce, selectDot);
+    rs->isSource = isSource;
+    rs->channels = channels;
+    rs->javaRate = javaRate;
+    rs->deviceRate = deviceRate;
+    int inRate = isSource? javaRate: deviceRate;
+    int outRate = isSource? deviceRate: javaRate;
+    int divisor = gcd(inRate, outRate);
+    rs->phases = outRate / divisor;
+    rs->step = inRate / divisor;
+    if (rs->phases > RESAMPLE_MAX_PHASES) {
+        ERROR3("%s: ratio %d/%d needs too many phases\n", __FUNCTION__, outRate, inRate);
+        return FALSE;
+    }
+    const Quality* q = &QUALITIES[quality];
+    // downsampling - lower cutoff, proportionally longer filter
+    double ratio = (outRate < inRate)? (double) outRate / inRate: 1.0;
+    rs->taps = (int) ceil(q->taps / ratio);
+    rs->taps = (rs->taps + 7) & ~7;
+
+    rs->histCapacity = rs->taps + RESAMPLE_BLOCK_FRAMES;
+    rs->outCapacity = (int) ((INT64) RESAMPLE_BLOCK_FRAMES * rs->phases / rs->step) + 2;
+    rs->coefs = (float*) malloc(sizeof(float) * rs->phases * rs->taps);
+    rs->hist = (float*) malloc(sizeof(float) * channels * rs->histCapacity);
+    rs->planes = (char**) malloc(sizeof(char*) * channels);
+    rs->in = (float*) malloc(sizeof(float) * channels * RESAMPLE_BLOCK_FRAMES);
+    rs->out = (float*) malloc(sizeof(float) * channels * rs->outCapacity);
+    rs->pending = (char*) malloc(rs->outCapacity * frameBytes);
+    if (!isSource) {
+        rs->raw = (char*) malloc(RESAMPLE_BLOCK_FRAMES * frameBytes);
+    }
+    if (rs->coefs == NULL || rs->hist == NULL || rs->planes == NULL || rs->in == NULL || rs->out == NULL
+            || rs->pending == NULL || (!isSource && rs->raw == NULL)) {
+        ERROR1("%s: Out of memory\n", __FUNCTION__);
+        return FALSE;
+    }
+    fillCoefs(rs, ratio * q->rolloff, q->kaiserBeta);
+    resetResampler(rs);
+    TRACE5("%s: %d -> %d Hz, %d phases of %d taps\n", __FUNCTION__, inRate, outRate, rs->phases, rs->taps);
+    return TRUE;
+}
+
+void freeResampler(Resampler* rs)
+{
+    free(rs->coefs);
+    free(rs->hist);
+    free(rs->planes);
+    free(rs->in);
+    free(rs->out);
+    free(rs->raw);
+    free(rs->pending);
+}
+
+// history of silence, the first output centered at the first input frame
+void resetResampler(Resampler* rs)
+{
+    int half = rs->taps / 2;
+    memset(rs->hist, 0, sizeof(float) * rs->channels * rs->histCapacity);
+    rs->histFrames = half - 1;
+    rs->idx = half - 1;
+    rs->phase = 0;
+    rs->pendingOffset = 0;
+    rs->pendingBytes = 0;
+    rs->inOffset = 0;
+    rs->inFrames = 0;
+}
+
+// Takes interleaved input into the history, produces interleaved output.
+// Returns output frames, *used - input frames taken
+static int resample(Resampler* rs, const float* in, int inFrames, float* out, int maxOut, int* used)
+{
+    int ch;
+    int room = rs->histCapacity - rs->histFrames;
+    if (inFrames > room) {
+        inFrames = room;
+    }
+    for (ch = 0; ch < rs->channels; ch++) {
+        rs->planes[ch] = (char*) (rs->hist + ch * rs->histCapacity + rs->histFrames);
+    }
+    deinterleave((const char*) in, rs->planes, inFrames, rs->channels, sizeof(float));
+    rs->histFrames += inFrames;
+    *used = inFrames;
+
+    int half = rs->taps / 2;
+    int produced = 0;
+    // the last tap must be in the history
+    while (produced < maxOut && rs->idx + half < rs->histFrames) {
+        const float* coef = rs->coefs + rs->phase * rs->taps;
+        const float* start = rs->hist + rs->idx - half + 1;
+        for (ch = 0; ch < rs->channels; ch++) {
+            *out++ = dot(start + ch * rs->histCapacity, coef, rs->taps);
+        }
+        produced++;
+        rs->phase += rs->step;
+        rs->idx += rs->phase / rs->phases;
+        rs->phase %= rs->phases;
+    }
+
+    // dropping history before the first tap of the next output
+    int drop = rs->idx - half + 1;
+    if (drop > rs->histFrames) {
+        drop = rs->histFrames;
+    }
+    if (drop > 0) {
+        for (ch = 0; ch < rs->channels; ch++) {
+            float* plane = rs->hist + ch * rs->histCapacity;
+            memmove(plane, plane + drop, sizeof(float) * (rs->histFrames - drop));
+        }
+        rs->histFrames -= drop;
+        rs->idx -= drop;
+    }
+    return produced;
+}
+
+
+/********** STREAM **********/
+
+// playback. Returns java bytes taken, converted output the device does not take now is kept for the next call
+int resampleWrite(PcmInfo* info, char* buffer, int bytes)
+{
+    Resampler* rs = info->resampler;
+    int frames = bytes / info->frameBytes;
+    int consumed = 0;
+    while (TRUE) {
+        if (rs->pendingBytes > 0) {
+            int written = writeToStream(info, rs->pending + rs->pendingOffset, rs->pendingBytes);
+            if (written < 0) {
+                return (consumed > 0)? consumed * info->frameBytes: written;
+            }
+            rs->pendingOffset += written;
+            rs->pendingBytes -= written;
+            if (rs->pendingBytes > 0) {
+                // device full
+                break;
+            }
+        }
+        if (consumed == frames) {
+            break;
+        }
+        int block = frames - consumed;
+        if (block > RESAMPLE_BLOCK_FRAMES) {
+            block = RESAMPLE_BLOCK_FRAMES;
+        }
+        convertToFloat(&info->conv, buffer + consumed * info->frameBytes, rs->in, block * rs->channels);
+        int used;
+        int produced = resample(rs, rs->in, block, rs->out, rs->outCapacity, &used);
+        consumed += used;
+        convertFromFloat(&info->conv, rs->out, rs->pending, produced * rs->channels);
+        rs->pendingOffset = 0;
+        rs->pendingBytes = produced * info->frameBytes;
+    }
+    return consumed * info->frameBytes;
+}
+
+// capture. Returns java bytes read, output not fitting into buffer is kept for the next call
+int resampleRead(PcmInfo* info, char* buffer, int bytes, ReadStamp* stamp)
+{
+    Resampler* rs = info->resampler;
+    int delivered = 0;
+    bytes = (bytes / info->frameBytes) * info->frameBytes;
+    while (TRUE) {
+        if (rs->pendingBytes > 0) {
+            int len = (rs->pendingBytes < bytes - delivered)? rs->pendingBytes: bytes - delivered;
+            memcpy(buffer + delivered, rs->pending + rs->pendingOffset, len);
+            rs->pendingOffset += len;
+            rs->pendingBytes -= len;
+            delivered += len;
+        }
+        if (delivered == bytes) {
+            break;
+        }
+        if (rs->inFrames == 0) {
+            // stamp of the first device read only
+            int read = readFromStream(info, rs->raw, RESAMPLE_BLOCK_FRAMES * info->frameBytes, stamp);
+            stamp = NULL;
+            if (read <= 0) {
+                return (delivered > 0)? delivered: read;
+            }
+            rs->inOffset = 0;
+            rs->inFrames = read / info->frameBytes;
+            convertToFloat(&info->conv, rs->raw, rs->in, rs->inFrames * rs->channels);
+        }
+        // the device data are gone, input not taken by a full history waits for the next round
+        int used;
+        int produced = resample(rs, rs->in + rs->inOffset * rs->channels, rs->inFrames, rs->out, rs->outCapacity,
+                &used);
+        rs->inOffset += used;
+        rs->inFrames -= used;
+        convertFromFloat(&info->conv, rs->out, rs->pending, produced * rs->channels);
+        rs->pendingOffset = 0;
+        rs->pendingBytes = produced * info->frameBytes;
+    }
+    return delivered;
+}
+
+// device rate bytes -> java rate bytes, whole frames
+INT64 toJavaBytes(PcmInfo* info, INT64 streamBytes)
+{
+    Resampler* rs = info->resampler;
+    INT64 frames = streamBytes / info->frameBytes;
+    return (frames * rs->javaRate / rs->deviceRate) * info->frameBytes;
+}
@@ -0,0 +1,97 @@
+#include "common.h"
+
+// Lock-free single-producer single-consumer byte ring. Positions are ever-increasing byte counters, the producer
+// owns writePos, the consumer owns readPos.
+
+int initRing(Ring* ring, int size)
+{
+    ring->data = (char*) malloc(size);
+    if (ring->data == NULL) {
+        ERROR1("%s: Out of memory\n", __FUNCTION__);
+        return FALSE;
+    }
+    ring->size = size;
+    ring->readPos = 0;
+    ring->writePos = 0;
+    return TRUE;
+}
+
+void freeRing(Ring* ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+    ring->size = 0;
+}
+
+int ringFill(Ring* ring)
+{
+    UINT64 writePos = __atomic_load_n(&ring->writePos, __ATOMIC_ACQUIRE);
+    UINT64 readPos = __atomic_load_n(&ring->readPos, __ATOMIC_ACQUIRE);
+    return (int) (writePos - readPos);
+}
+
+int ringSpace(Ring* ring)
+{
+    return ring->size - ringFill(ring);
+}
+
+// producer side. Returns bytes written, at most the free space
+int ringWrite(Ring* ring, const char* buffer, int bytes)
+{
+    UINT64 writePos = ring->writePos;
+    UINT64 readPos = __atomic_load_n(&ring->readPos, __ATOMIC_ACQUIRE);
+    int space = ring->size - (int) (writePos - readPos);
+    if (bytes > space) {
+        bytes = space;
+    }
+    int offset = (int) (writePos % ring->size);
+    int firstPart = ring->size - offset;
+    if (firstPart > bytes) {
+        firstPart = bytes;
+    }
+    memcpy(ring->data + offset, buffer, firstPart);
+    memcpy(ring->data, buffer + firstPart, bytes - firstPart);
+    // publishing the data
+    __atomic_store_n(&ring->writePos, writePos + bytes, __ATOMIC_RELEASE);
+    return bytes;
+}
+
+// consumer side. Sets *ptr to the contiguous readable region, returns its length
+int ringPeek(Ring* ring, char** ptr)
+{
+    UINT64 readPos = ring->readPos;
+    UINT64 writePos = __atomic_load_n(&ring->writePos, __ATOMIC_ACQUIRE);
+    int fill = (int) (writePos - readPos);
+    int offset = (int) (readPos % ring->size);
+    *ptr = ring->data + offset;
+    return (fill < ring->size - offset)? fill: ring->size - offset;
+}
+
+// consumer side
+void ringConsume(Ring* ring, int bytes)
+{
+    __atomic_store_n(&ring->readPos, ring->readPos + bytes, __ATOMIC_RELEASE);
+}
+
+// consumer side, drops all data written so far
+void ringSkipAll(Ring* ring)
+{
+    __atomic_store_n(&ring->readPos, __atomic_load_n(&ring->writePos, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+// producer side. Sets *ptr to the contiguous writable region, returns its length
+int ringReserve(Ring* ring, char** ptr)
+{
+    UINT64 writePos = ring->writePos;
+    UINT64 readPos = __atomic_load_n(&ring->readPos, __ATOMIC_ACQUIRE);
+    int space = ring->size - (int) (writePos - readPos);
+    int offset = (int) (writePos % ring->size);
+    *ptr = ring->data + offset;
+    return (space < ring->size - offset)? space: ring->size - offset;
+}
+
+// producer side, publishes bytes written to the reserved region
+void ringCommit(Ring* ring, int bytes)
+{
+    __atomic_store_n(&ring->writePos, ring->writePos + bytes, __ATOMIC_RELEASE);
+}
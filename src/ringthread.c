@@ -0,0 +1,514 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "common.h"
+
+// Playback/capture through a ring (OPEN_FLAG_RING). Java only writes to/reads from the ring and never touches the
+// device, the ring thread moves the data between the ring and the device running with a short buffer. The thread
+// sleeps in poll on the device descriptors and on an eventfd woken by the writer and by control ops.
+// Capture data are stored in chunks stamped with CLOCK_MONOTONIC time of their first frame and with the number of
+// frames lost before them (ring full or device overrun).
+// OPEN_FLAG_TSCHED: the device runs with a large buffer and period wakeups disabled. The thread sleeps on
+// a CLOCK_MONOTONIC timerfd until the device fill (playback) or room (capture) drops to a watermark. Playback fills
+// the device only TSCHED_FILL_MARGIN_US above the watermark to keep the latency of gain changes low, capture lets the
+// whole buffer fill. Late wakeups and xruns raise the watermark, a quiet interval lowers it again.
+
+#define NS_PER_SEC          1000000000LL
+
+static INT64 framesToNs(PcmInfo* info, INT64 frames)
+{
+    return frames * NS_PER_SEC / info->rate;
+}
+
+static int usToFrames(PcmInfo* info, int us)
+{
+    return (int) ((INT64) us * info->rate / 1000000);
+}
+
+void wakeRingThread(PcmInfo* info)
+{
+    UINT64 val = 1;
+    if (write(info->wakeFd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+        ERROR2("%s: write to eventfd failed: %s\n", __FUNCTION__, strerror(errno));
+    }
+}
+
+static void drainWakeFd(PcmInfo* info)
+{
+    UINT64 val;
+    // non-blocking, resets the counter
+    if (read(info->wakeFd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+        ERROR2("%s: read from eventfd failed: %s\n", __FUNCTION__, strerror(errno));
+    }
+}
+
+// timer scheduling: bytes the device takes before its fill reaches the watermark plus TSCHED_FILL_MARGIN_US
+static int getFillLimit(PcmInfo* info)
+{
+    int limitFrames = info->watermarkFrames + usToFrames(info, TSCHED_FILL_MARGIN_US);
+    snd_pcm_sframes_t avail = snd_pcm_avail(info->handle);
+    // after an xrun the recovered device is empty
+    if (avail >= 0) {
+        limitFrames -= info->bufferBytes / info->frameBytes - (int) avail;
+    }
+    return (limitFrames > 0)? limitFrames * info->frameBytes: 0;
+}
+
+// with info->lock held. Returns TRUE if the device is full (or filled up to the timer scheduling limit) and ring data
+// are left, FALSE if the ring is empty, -1 for unrecoverable error
+static int feedPcm(PcmInfo* info)
+{
+    char* ptr;
+    int len;
+    int limit = info->isTimerSched? getFillLimit(info): INT_MAX;
+    while ((len = ringPeek(&info->ring, &ptr)) > 0) {
+        if (limit == 0) {
+            return TRUE;
+        }
+        if (len > limit) {
+            len = limit;
+        }
+        int written = writeToPcm(info, ptr, len);
+        if (written < 0) {
+            return -1;
+        }
+        ringConsume(&info->ring, written);
+        limit -= written;
+        if (written < len) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// capture time of the first of frames just read - frames still available in the device are newer
+static INT64 getChunkStartNs(PcmInfo* info, int frames)
+{
+    snd_pcm_uframes_t avail;
+    snd_htimestamp_t ts;
+    if (snd_pcm_htimestamp(info->handle, &avail, &ts) < 0 || (ts.tv_sec == 0 && ts.tv_nsec == 0)) {
+        // no device timestamp
+        snd_pcm_sframes_t availFrames = snd_pcm_avail_update(info->handle);
+        avail = availFrames > 0? (snd_pcm_uframes_t) availFrames: 0;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    }
+    INT64 nowNs = (INT64) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+    return nowNs - framesToNs(info, (INT64) avail + frames);
+}
+
+// producer side of the chunk stamps. Pending dropped frames go to a new stamp, with all slots taken the chunk is
+// merged into the last one (never released by the consumer). Returns FALSE if the chunk cannot be stored.
+static int addChunkStamp(PcmInfo* info, UINT64 startPos, int bytes, INT64 startNs)
+{
+    UINT64 stampsWrite = info->stampsWrite;
+    UINT64 stampsRead = __atomic_load_n(&info->stampsRead, __ATOMIC_ACQUIRE);
+    if (stampsWrite - stampsRead == (UINT64) info->stampsCnt) {
+        if (info->pendingDropped > 0) {
+            return FALSE;
+        }
+        ChunkStamp* last = &info->stamps[(stampsWrite - 1) % info->stampsCnt];
+        __atomic_store_n(&last->endPos, startPos + bytes, __ATOMIC_RELEASE);
+        return TRUE;
+    }
+    ChunkStamp* chunk = &info->stamps[stampsWrite % info->stampsCnt];
+    chunk->startPos = startPos;
+    chunk->endPos = startPos + bytes;
+    chunk->startNs = startNs;
+    chunk->droppedFrames = info->pendingDropped;
+    info->pendingDropped = 0;
+    __atomic_store_n(&info->stampsWrite, stampsWrite + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+// with info->lock held, capture. Reads all available device data into the ring, dropping them if the ring is full.
+// Returns FALSE when the device has no more data, -1 for unrecoverable error
+static int drainPcm(PcmInfo* info)
+{
+    while (TRUE) {
+        char* ptr;
+        int len = ringReserve(&info->ring, &ptr);
+        // the ring size is a multiple of frameBytes
+        int isDropping = (len == 0);
+        if (isDropping) {
+            // the device must be read anyway to keep it running
+            ptr = info->dropBuffer;
+            len = info->bufferBytes;
+        }
+        int xrunCnt = info->xrunCnt;
+        int read = readFromPcm(info, ptr, len);
+        if (read <= 0) {
+            return (read < 0)? -1: FALSE;
+        }
+        int frames = read / info->frameBytes;
+        INT64 startNs = getChunkStartNs(info, frames);
+        if (xrunCnt != info->xrunCnt && info->nextStartNs > 0) {
+            // frames lost in the device overrun
+            INT64 lostFrames = (startNs - info->nextStartNs) * info->rate / NS_PER_SEC;
+            if (lostFrames > 0) {
+                info->pendingDropped += lostFrames;
+            }
+        }
+        info->nextStartNs = startNs + framesToNs(info, frames);
+        if (isDropping || !addChunkStamp(info, info->ring.writePos, read, startNs)) {
+            info->pendingDropped += frames;
+        } else {
+            ringCommit(&info->ring, read);
+        }
+        if (read < len) {
+            return FALSE;
+        }
+    }
+}
+
+
+/********** TIMER SCHEDULING **********/
+
+static INT64 getMonotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (INT64) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void setWatermark(PcmInfo* info, int frames, INT64 nowNs)
+{
+    if (frames > info->maxWatermarkFrames) {
+        frames = info->maxWatermarkFrames;
+    }
+    if (frames < info->minWatermarkFrames) {
+        frames = info->minWatermarkFrames;
+    }
+    if (frames != info->watermarkFrames) {
+        TRACE3("%s: watermark %d -> %d frames\n", __FUNCTION__, info->watermarkFrames, frames);
+        info->watermarkFrames = frames;
+    }
+    info->watermarkChangeNs = nowNs;
+}
+
+static void initWatermark(PcmInfo* info)
+{
+    info->maxWatermarkFrames = info->bufferBytes / info->frameBytes / 2;
+    info->minWatermarkFrames = usToFrames(info, TSCHED_MIN_WATERMARK_US);
+    if (info->minWatermarkFrames > info->maxWatermarkFrames) {
+        info->minWatermarkFrames = info->maxWatermarkFrames;
+    }
+    info->watermarkFrames = 0;
+    setWatermark(info, usToFrames(info, TSCHED_WATERMARK_US), getMonotonicNs());
+    info->tschedXrunCnt = info->xrunCnt;
+}
+
+// after a timer wakeup of the running device. Waking later than half of the watermark doubles it,
+// TSCHED_WATERMARK_DEC_MS without a late wakeup or xrun lowers it by a quarter
+static void adaptWatermark(PcmInfo* info)
+{
+    INT64 nowNs = getMonotonicNs();
+    if (nowNs - info->wakeupNs > framesToNs(info, info->watermarkFrames / 2)) {
+        setWatermark(info, 2 * info->watermarkFrames, nowNs);
+    } else if (nowNs - info->watermarkChangeNs > TSCHED_WATERMARK_DEC_MS * 1000000LL) {
+        setWatermark(info, info->watermarkFrames - info->watermarkFrames / 4, nowNs);
+    }
+}
+
+// with info->lock held. Arms the timer to the time the device fill (playback) or room (capture) drops to the
+// watermark, an xrun since the last wakeup doubles the watermark first. Returns FALSE if not armed
+static int armWakeup(PcmInfo* info)
+{
+    INT64 nowNs = getMonotonicNs();
+    if (info->xrunCnt != info->tschedXrunCnt) {
+        info->tschedXrunCnt = info->xrunCnt;
+        setWatermark(info, 2 * info->watermarkFrames, nowNs);
+    }
+    snd_pcm_sframes_t avail = snd_pcm_avail(info->handle);
+    if (avail < 0) {
+        // xrun, recovered by the next transfer
+        return FALSE;
+    }
+    INT64 frames = (INT64) info->bufferBytes / info->frameBytes - avail - info->watermarkFrames;
+    info->wakeupNs = nowNs + (frames > 0? framesToNs(info, frames): 0);
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = info->wakeupNs / NS_PER_SEC;
+    its.it_value.tv_nsec = info->wakeupNs % NS_PER_SEC;
+    if (timerfd_settime(info->timerFd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        ERROR2("%s: timerfd_settime failed: %s\n", __FUNCTION__, strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void drainTimerFd(PcmInfo* info)
+{
+    UINT64 expirations;
+    if (read(info->timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        ERROR2("%s: read from timerfd failed: %s\n", __FUNCTION__, strerror(errno));
+    }
+}
+
+
+/********** THREAD **********/
+
+static void* ringThreadMain(void* arg)
+{
+    PcmInfo* info = (PcmInfo*) arg;
+    struct pollfd fds[1 + MAX_PCM_POLL_FDS];
+    fds[0].fd = info->wakeFd;
+    fds[0].events = POLLIN;
+    int pcmFdsCnt = 0;
+    if (info->isTimerSched) {
+        // the device descriptors never wake up without period interrupts
+        fds[1].fd = info->timerFd;
+        fds[1].events = POLLIN;
+    } else {
+        pcmFdsCnt = snd_pcm_poll_descriptors(info->handle, &fds[1], MAX_PCM_POLL_FDS);
+        if (pcmFdsCnt < 0) {
+            ERROR2("%s: snd_pcm_poll_descriptors: %s\n", __FUNCTION__, snd_strerror(pcmFdsCnt));
+            pcmFdsCnt = 0;
+        }
+    }
+    TRACE3("%s: started with %d device descriptors, timer scheduling %d\n", __FUNCTION__, pcmFdsCnt, info->isTimerSched);
+
+    while (!__atomic_load_n(&info->quitRingThread, __ATOMIC_ACQUIRE)) {
+        int waitForDevice = FALSE;
+        int isTimerArmed = FALSE;
+        pthread_mutex_lock(&info->lock);
+        if (info->isRunning) {
+            int ret = info->isSource? feedPcm(info): drainPcm(info);
+            if (ret < 0) {
+                if (!info->ringThreadError) {
+                    ERROR1("%s: unrecoverable device error\n", __FUNCTION__);
+                }
+                info->ringThreadError = TRUE;
+            } else {
+                // playback waits for room only if ring data are left, capture always for new data
+                waitForDevice = info->isSource? ret: TRUE;
+                if (waitForDevice && info->isTimerSched) {
+                    isTimerArmed = armWakeup(info);
+                }
+            }
+        }
+        pthread_mutex_unlock(&info->lock);
+        if (__atomic_exchange_n(&info->isAppWaiting, FALSE, __ATOMIC_SEQ_CST)) {
+            // the ring may have room/data for doWaitAvail now
+            wakeWaiter(info);
+        }
+
+        int fdsCnt = 1;
+        int timeout = RING_THREAD_POLL_TIMEOUT;
+        if (isTimerArmed) {
+            fdsCnt = 2;
+            timeout = -1;
+        } else if (waitForDevice) {
+            // timer scheduling retries arming the timer after the timeout
+            fdsCnt += pcmFdsCnt;
+        } else if (info->isTimerSched) {
+            // woken by the writer or by control ops only, no idle wakeups
+            timeout = -1;
+        }
+        if (!waitForDevice && info->isSource) {
+            // waiting for the writer or for start. Announcing before re-checking the ring so that the writer
+            // either sees the flag or its data are seen here
+            __atomic_store_n(&info->isRingThreadWaiting, TRUE, __ATOMIC_SEQ_CST);
+            if (info->isRunning && !info->ringThreadError && ringFill(&info->ring) > 0) {
+                __atomic_store_n(&info->isRingThreadWaiting, FALSE, __ATOMIC_SEQ_CST);
+                continue;
+            }
+        }
+        int ret = poll(fds, fdsCnt, timeout);
+        __atomic_store_n(&info->isRingThreadWaiting, FALSE, __ATOMIC_SEQ_CST);
+        if (ret > 0) {
+            if (fds[0].revents & POLLIN) {
+                drainWakeFd(info);
+            }
+            if (isTimerArmed) {
+                if (fds[1].revents & POLLIN) {
+                    drainTimerFd(info);
+                    if (info->isRunning) {
+                        adaptWatermark(info);
+                    }
+                }
+            } else if (fdsCnt > 1) {
+                unsigned short revents;
+                snd_pcm_poll_descriptors_revents(info->handle, &fds[1], pcmFdsCnt, &revents);
+            }
+        }
+    }
+    TRACE1("%s: finished\n", __FUNCTION__);
+    return NULL;
+}
+
+int startRingThread(PcmInfo* info, int isSource)
+{
+    info->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (info->wakeFd < 0) {
+        ERROR2("%s: eventfd failed: %s\n", __FUNCTION__, strerror(errno));
+        return FALSE;
+    }
+    info->quitRingThread = FALSE;
+    if (info->isTimerSched) {
+        info->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (info->timerFd < 0) {
+            ERROR2("%s: timerfd_create failed: %s\n", __FUNCTION__, strerror(errno));
+            close(info->wakeFd);
+            info->wakeFd = -1;
+            return FALSE;
+        }
+        initWatermark(info);
+    }
+
+    pthread_attr_t attr;
+    struct sched_param param;
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    param.sched_priority = RING_THREAD_RT_PRIORITY;
+    pthread_attr_setschedparam(&attr, &param);
+    int ret = pthread_create(&info->ringThread, &attr, ringThreadMain, info);
+    pthread_attr_destroy(&attr);
+    if (ret == EPERM) {
+        // no rights for real-time scheduling
+        TRACE1("%s: SCHED_FIFO not permitted, using normal priority\n", __FUNCTION__);
+        ret = pthread_create(&info->ringThread, NULL, ringThreadMain, info);
+    }
+    if (ret != 0) {
+        ERROR2("%s: pthread_create failed: %s\n", __FUNCTION__, strerror(ret));
+        close(info->wakeFd);
+        info->wakeFd = -1;
+        if (info->timerFd >= 0) {
+            close(info->timerFd);
+            info->timerFd = -1;
+        }
+        return FALSE;
+    }
+    info->hasRingThread = TRUE;
+    return TRUE;
+}
+
+void stopRingThread(PcmInfo* info)
+{
+    __atomic_store_n(&info->quitRingThread, TRUE, __ATOMIC_RELEASE);
+    wakeRingThread(info);
+    pthread_join(info->ringThread, NULL);
+    info->hasRingThread = FALSE;
+    close(info->wakeFd);
+    info->wakeFd = -1;
+    if (info->timerFd >= 0) {
+        close(info->timerFd);
+        info->timerFd = -1;
+    }
+}
+
+// producer side of the ring, never blocks. Returns bytes written or -1 if the ring thread failed
+int writeToRing(PcmInfo* info, char* buffer, int bytes)
+{
+    TRACE2("%s: %d bytes\n", __FUNCTION__, bytes);
+    if (bytes <= 0 || info->frameBytes <= 0) {
+        ERROR3("%s: wrong bytes=%d, frameBytes=%d\n", __FUNCTION__, (int) bytes, (int) info->frameBytes);
+        return -1;
+    }
+    if (info->ringThreadError) {
+        return -1;
+    }
+    // whole frames only, the ring size is a multiple of frameBytes
+    int written = ringWrite(&info->ring, buffer, (bytes / info->frameBytes) * info->frameBytes);
+    if (written > 0) {
+        info->isFlushed = 0;
+        if (__atomic_exchange_n(&info->isRingThreadWaiting, FALSE, __ATOMIC_SEQ_CST)) {
+            wakeRingThread(info);
+        }
+    }
+    return written;
+}
+
+// consumer side of the capture ring, never blocks. A read never spans a gap - frames dropped before a chunk are
+// reported by the read starting at the chunk
+int readFromRing(PcmInfo* info, char* buffer, int bytes, ReadStamp* stamp)
+{
+    TRACE2("%s: %d bytes\n", __FUNCTION__, bytes);
+    if (bytes <= 0 || info->frameBytes <= 0) {
+        ERROR3("%s: wrong bytes=%d, frameBytes=%d\n", __FUNCTION__, (int) bytes, (int) info->frameBytes);
+        return -1;
+    }
+    if (stamp != NULL) {
+        stamp->droppedFrames = 0;
+        stamp->tstampNs = 0;
+    }
+    if (info->ringThreadError) {
+        return -1;
+    }
+    Ring* ring = &info->ring;
+    // acquiring the ring data makes their stamps visible too
+    int fill = ringFill(ring);
+    bytes = (bytes / info->frameBytes) * info->frameBytes;
+    if (bytes > fill) {
+        bytes = fill;
+    }
+    if (bytes == 0) {
+        return 0;
+    }
+    UINT64 readPos = ring->readPos;
+    UINT64 stampsWrite = __atomic_load_n(&info->stampsWrite, __ATOMIC_ACQUIRE);
+    UINT64 idx = info->stampsRead;
+    // releasing chunks read completely, keeping the last one
+    while (idx + 1 < stampsWrite
+            && __atomic_load_n(&info->stamps[idx % info->stampsCnt].endPos, __ATOMIC_ACQUIRE) <= readPos) {
+        idx++;
+    }
+    __atomic_store_n(&info->stampsRead, idx, __ATOMIC_RELEASE);
+
+    ChunkStamp* chunk = &info->stamps[idx % info->stampsCnt];
+    if (stamp != NULL && chunk->startPos <= readPos) {
+        if (chunk->startPos == readPos) {
+            stamp->droppedFrames = chunk->droppedFrames;
+        }
+        stamp->tstampNs = chunk->startNs + framesToNs(info, (INT64) (readPos - chunk->startPos) / info->frameBytes);
+    }
+    // stopping at the next gap
+    for (UINT64 i = idx + 1; i < stampsWrite; i++) {
+        ChunkStamp* next = &info->stamps[i % info->stampsCnt];
+        if (next->startPos >= readPos + bytes) {
+            break;
+        }
+        if (next->droppedFrames > 0 && next->startPos > readPos) {
+            bytes = (int) (next->startPos - readPos);
+            break;
+        }
+    }
+
+    int copied = 0;
+    while (copied < bytes) {
+        char* ptr;
+        int len = ringPeek(ring, &ptr);
+        if (len > bytes - copied) {
+            len = bytes - copied;
+        }
+        memcpy(buffer + copied, ptr, len);
+        ringConsume(ring, len);
+        copied += len;
+    }
+    TRACE2("%s: read %d bytes.\n", __FUNCTION__, copied);
+    return copied;
+}
+
+// playback. Returns when the ring is empty or the line stops, FALSE if the wait of generation was cancelled
+int waitRingEmpty(PcmInfo* info, int generation)
+{
+    int ret = TRUE;
+    while (TRUE) {
+        // the ring thread wakes us after its next transfer. Announcing before checking the ring
+        __atomic_store_n(&info->isAppWaiting, TRUE, __ATOMIC_SEQ_CST);
+        if (ringFill(&info->ring) == 0 || !info->isRunning || info->ringThreadError) {
+            break;
+        }
+        if (!sleepOnWaiter(info, generation, RING_THREAD_POLL_TIMEOUT)) {
+            ret = FALSE;
+            break;
+        }
+    }
+    __atomic_store_n(&info->isAppWaiting, FALSE, __ATOMIC_SEQ_CST);
+    return ret;
+}
@@ -0,0 +1,386 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include "common.h"
+
+// Runtime settings replacing rebuilds for tuning a deployment. Defaults come from config.h, overridden in this order
+// by the nInit params, by the settings file (key = value lines, # comments) and by CSJSOUND_<KEY> environment
+// variables. Keys: log_level (0-4 or error/warn/info/debug/trace), log_target, period_time_us, small_buffer_frames,
+// tries_to_recover, rates, channels, max_rate, max_channels, ignored_configs - lists separated by commas or spaces.
+// Changed only by nInit, which publishes a new immutable copy, so threads holding the previous one are not affected.
+
+#define ENV_PREFIX          "CSJSOUND_"
+#define LINE_LEN            1024
+
+static const char* KEYS[] = {
+            "log_level", "log_target", "period_time_us", "small_buffer_frames", "tries_to_recover",
+            "rates", "channels", "max_rate", "max_channels", "ignored_configs",
+            NULL
+};
+
+// see config.h
+const unsigned int PROBED_RATES[] = {
+            44100, 48000, 88200, 96000, 176400, 192000, 352800, 384000, 705600, 768000,
+            0
+};
+
+// see config.h
+const char *IGNORED_CONFIGS[] = {
+            "hw", "plughw", "plug", "dsnoop", "tee",
+            "file", "null", "shm", "cards", "rate_convert",
+            NULL
+};
+
+static const char* LOG_LEVEL_NAMES[] = {"error", "warn", "info", "debug", "trace", NULL};
+
+static pthread_once_t defaultsOnce = PTHREAD_ONCE_INIT;
+static Settings defaultSettings;
+// published with release, never freed: getSettings callers may keep using a replaced copy
+static Settings* settings = NULL;
+// serializes concurrent nInit calls
+static pthread_mutex_t initLock = PTHREAD_MUTEX_INITIALIZER;
+
+// read by logPrint without locking, kept apart from settings to log while loading them
+static int currentLogLevel = LOG_LEVEL_TRACE;
+// NULL = stdout
+static FILE* currentLogFile = NULL;
+
+void logPrint(int level, const char* format, ...)
+{
+    if (level > __atomic_load_n(&currentLogLevel, __ATOMIC_RELAXED)) {
+        return;
+    }
+    FILE* file = __atomic_load_n(&currentLogFile, __ATOMIC_ACQUIRE);
+    if (file == NULL) {
+        file = stdout;
+    }
+    va_list args;
+    va_start(args, format);
+    vfprintf(file, format, args);
+    va_end(args);
+    fflush(file);
+}
+
+
+/********** PARSING **********/
+
+static int parseInt(const char* value, int minVal, int* result)
+{
+    char* end;
+    errno = 0;
+    long val = strtol(value, &end, 10);
+    while (isspace((unsigned char) *end)) {
+        end++;
+    }
+    if (errno != 0 || end == value || *end != '\0' || val < minVal || val > INT_MAX) {
+        return FALSE;
+    }
+    *result = (int) val;
+    return TRUE;
+}
+
+static int parseLogLevel(const char* value, int* result)
+{
+    int i;
+    for (i = 0; LOG_LEVEL_NAMES[i] != NULL; i++) {
+        if (strcasecmp(value, LOG_LEVEL_NAMES[i]) == 0) {
+            *result = i;
+            return TRUE;
+        }
+    }
+    return parseInt(value, LOG_LEVEL_ERROR, result) && *result <= LOG_LEVEL_TRACE;
+}
+
+// splits value by commas/spaces into at most maxCnt tokens of STR_LEN, returns count of tokens or -1
+static int splitList(const char* value, char tokens[][STR_LEN + 1], int maxCnt)
+{
+    int cnt = 0;
+    while (*value != '\0') {
+        size_t len = strcspn(value, ", \t");
+        if (len > 0) {
+            if (cnt == maxCnt || len > STR_LEN) {
+                return -1;
+            }
+            memcpy(tokens[cnt], value, len);
+            tokens[cnt][len] = '\0';
+            cnt++;
+        }
+        value += len;
+        value += strspn(value, ", \t");
+    }
+    return cnt;
+}
+
+// 0-terminated list of positive numbers
+static int parseNumList(const char* value, unsigned int* list, int maxCnt)
+{
+    int i;
+    char tokens[maxCnt][STR_LEN + 1];
+    int cnt = splitList(value, tokens, maxCnt);
+    if (cnt < 0) {
+        return FALSE;
+    }
+    unsigned int parsed[maxCnt + 1];
+    for (i = 0; i < cnt; i++) {
+        int val;
+        if (!parseInt(tokens[i], 1, &val)) {
+            return FALSE;
+        }
+        parsed[i] = (unsigned int) val;
+    }
+    parsed[cnt] = 0;
+    memset(list, 0, (maxCnt + 1) * sizeof(unsigned int));
+    memcpy(list, parsed, (cnt + 1) * sizeof(unsigned int));
+    return TRUE;
+}
+
+static int setSetting(Settings* s, const char* key, const char* value)
+{
+    if (strcmp(key, "log_level") == 0) {
+        return parseLogLevel(value, &s->logLevel);
+    } else if (strcmp(key, "log_target") == 0) {
+        if (strlen(value) > STR_LEN) {
+            return FALSE;
+        }
+        strcpy(s->logTarget, value);
+        return TRUE;
+    } else if (strcmp(key, "period_time_us") == 0) {
+        return parseInt(value, 1, &s->periodTimeUs);
+    } else if (strcmp(key, "small_buffer_frames") == 0) {
+        return parseInt(value, 0, &s->smallBufferFrames);
+    } else if (strcmp(key, "tries_to_recover") == 0) {
+        return parseInt(value, 0, &s->triesToRecover);
+    } else if (strcmp(key, "rates") == 0) {
+        return parseNumList(value, s->probedRates, SETTINGS_MAX_RATES);
+    } else if (strcmp(key, "channels") == 0) {
+        return parseNumList(value, s->probedChannels, SETTINGS_MAX_CHANNELS);
+    } else if (strcmp(key, "max_rate") == 0) {
+        int val;
+        if (!parseInt(value, 1, &val)) {
+            return FALSE;
+        }
+        s->maxRate = (unsigned int) val;
+        return TRUE;
+    } else if (strcmp(key, "max_channels") == 0) {
+        int val;
+        if (!parseInt(value, 1, &val)) {
+            return FALSE;
+        }
+        s->maxChannels = (unsigned int) val;
+        return TRUE;
+    } else if (strcmp(key, "ignored_configs") == 0) {
+        char names[SETTINGS_MAX_IGNORED][STR_LEN + 1];
+        int cnt = splitList(value, names, SETTINGS_MAX_IGNORED);
+        if (cnt < 0) {
+            return FALSE;
+        }
+        memset(s->ignoredConfigs, 0, sizeof(s->ignoredConfigs));
+        memcpy(s->ignoredConfigs, names, cnt * sizeof(names[0]));
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static char* trim(char* str)
+{
+    while (isspace((unsigned char) *str)) {
+        str++;
+    }
+    char* end = str + strlen(str);
+    while (end > str && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return str;
+}
+
+
+/********** SOURCES **********/
+
+static void setDefaults(Settings* s)
+{
+    int i;
+    memset(s, 0, sizeof(Settings));
+    s->logLevel = LOG_LEVEL_TRACE;
+    strcpy(s->logTarget, "stdout");
+    s->periodTimeUs = DEFAULT_PERIOD_TIME;
+    s->smallBufferFrames = SMALL_BUFFER_SIZE_LIMIT;
+    s->triesToRecover = TRIES_TO_RECOVER;
+    for (i = 0; PROBED_RATES[i] > 0 && i < SETTINGS_MAX_RATES; i++) {
+        s->probedRates[i] = PROBED_RATES[i];
+    }
+    s->maxRate = INT_MAX;
+    s->maxChannels = PROBE_MAX_CHANNELS;
+    for (i = 0; IGNORED_CONFIGS[i] != NULL && i < SETTINGS_MAX_IGNORED; i++) {
+        strncpy(s->ignoredConfigs[i], IGNORED_CONFIGS[i], STR_LEN);
+    }
+}
+
+static int getSettingsPath(char* path, int len)
+{
+    const char* settingsPath = getenv(ENV_PREFIX "CONFIG");
+    if (settingsPath != NULL) {
+        snprintf(path, len, "%s", settingsPath);
+        return TRUE;
+    }
+    const char* configHome = getenv("XDG_CONFIG_HOME");
+    if (configHome != NULL && configHome[0] == '/') {
+        snprintf(path, len, "%s/%s", configHome, SETTINGS_FILE);
+        return TRUE;
+    }
+    const char* home = getenv("HOME");
+    if (home == NULL) {
+        return FALSE;
+    }
+    snprintf(path, len, "%s/.config/%s", home, SETTINGS_FILE);
+    return TRUE;
+}
+
+// missing file is not an error
+static void loadFile(Settings* s)
+{
+    char path[PATH_MAX];
+    if (!getSettingsPath(path, PATH_MAX)) {
+        return;
+    }
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        TRACE2("%s: no settings file %s\n", __FUNCTION__, path);
+        return;
+    }
+    char line[LINE_LEN];
+    int lineNo = 0;
+    while (fgets(line, LINE_LEN, file) != NULL) {
+        lineNo++;
+        line[strcspn(line, "#\n")] = '\0';
+        char* key = trim(line);
+        if (*key == '\0') {
+            continue;
+        }
+        char* eq = strchr(key, '=');
+        if (eq == NULL) {
+            ERROR3("%s: %s:%d: missing =\n", __FUNCTION__, path, lineNo);
+            continue;
+        }
+        *eq = '\0';
+        key = trim(key);
+        if (!setSetting(s, key, trim(eq + 1))) {
+            ERROR4("%s: %s:%d: invalid setting %s\n", __FUNCTION__, path, lineNo, key);
+        }
+    }
+    fclose(file);
+}
+
+static void loadEnv(Settings* s)
+{
+    int i;
+    int j;
+    char name[64];
+    for (i = 0; KEYS[i] != NULL; i++) {
+        int len = snprintf(name, sizeof(name), "%s%s", ENV_PREFIX, KEYS[i]);
+        for (j = 0; j < len; j++) {
+            name[j] = (char) toupper((unsigned char) name[j]);
+        }
+        const char* value = getenv(name);
+        if (value != NULL && !setSetting(s, KEYS[i], value)) {
+            ERROR3("%s: invalid %s=%s\n", __FUNCTION__, name, value);
+        }
+    }
+}
+
+// the previous log file stays open, a concurrent logPrint may still use it
+static void applyLog(const Settings* s)
+{
+    FILE* file = NULL;
+    if (strcmp(s->logTarget, "stderr") == 0) {
+        file = stderr;
+    } else if (s->logTarget[0] != '\0' && strcmp(s->logTarget, "stdout") != 0) {
+        file = fopen(s->logTarget, "a");
+        if (file == NULL) {
+            ERROR3("%s: cannot open log target %s: %s\n", __FUNCTION__, s->logTarget, strerror(errno));
+        }
+    }
+    __atomic_store_n(&currentLogFile, file, __ATOMIC_RELEASE);
+    __atomic_store_n(&currentLogLevel, s->logLevel, __ATOMIC_RELAXED);
+}
+
+static void initDefaults()
+{
+    setDefaults(&defaultSettings);
+    loadFile(&defaultSettings);
+    loadEnv(&defaultSettings);
+    applyLog(&defaultSettings);
+    __atomic_store_n(&settings, &defaultSettings, __ATOMIC_RELEASE);
+}
+
+const Settings* getSettings()
+{
+    pthread_once(&defaultsOnce, initDefaults);
+    return __atomic_load_n(&settings, __ATOMIC_ACQUIRE);
+}
+
+// java params override the defaults, the file and the environment override java.
+// Returns TRUE if the settings of device enumeration or format probing changed
+int initSettings(int logLevel, const char* logTarget, const int* rates, int ratesCnt, const int* channels,
+        int channelsCnt, int maxRate, int maxChannels)
+{
+    int i;
+    Settings s;
+    setDefaults(&s);
+    if (logLevel >= LOG_LEVEL_ERROR && logLevel <= LOG_LEVEL_TRACE) {
+        s.logLevel = logLevel;
+    }
+    if (logTarget != NULL && logTarget[0] != '\0' && strlen(logTarget) <= STR_LEN) {
+        strcpy(s.logTarget, logTarget);
+    }
+    if (ratesCnt > 0) {
+        memset(s.probedRates, 0, sizeof(s.probedRates));
+        int cnt = 0;
+        for (i = 0; i < ratesCnt && cnt < SETTINGS_MAX_RATES; i++) {
+            if (rates[i] > 0) {
+                s.probedRates[cnt++] = (unsigned int) rates[i];
+            }
+        }
+    }
+    if (channelsCnt > 0) {
+        int cnt = 0;
+        for (i = 0; i < channelsCnt && cnt < SETTINGS_MAX_CHANNELS; i++) {
+            if (channels[i] > 0) {
+                s.probedChannels[cnt++] = (unsigned int) channels[i];
+            }
+        }
+    }
+    if (maxRate > 0) {
+        s.maxRate = (unsigned int) maxRate;
+    }
+    if (maxChannels > 0) {
+        s.maxChannels = (unsigned int) maxChannels;
+    }
+    loadFile(&s);
+    loadEnv(&s);
+    Settings* published = (Settings*) malloc(sizeof(Settings));
+    if (published == NULL) {
+        ERROR1("%s: cannot allocate settings, keeping the current ones\n", __FUNCTION__);
+        return FALSE;
+    }
+    memcpy(published, &s, sizeof(Settings));
+
+    pthread_mutex_lock(&initLock);
+    const Settings* current = getSettings();
+    int isProbingChanged = memcmp(s.probedRates, current->probedRates, sizeof(s.probedRates)) != 0
+            || memcmp(s.probedChannels, current->probedChannels, sizeof(s.probedChannels)) != 0
+            || s.maxRate != current->maxRate || s.maxChannels != current->maxChannels
+            || memcmp(s.ignoredConfigs, current->ignoredConfigs, sizeof(s.ignoredConfigs)) != 0;
+    if (strcmp(s.logTarget, current->logTarget) != 0 || s.logLevel != current->logLevel) {
+        applyLog(&s);
+    }
+    __atomic_store_n(&settings, published, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&initLock);
+    TRACE5("%s: period time %d us, small buffer %d frames, max rate %u, max channels %u\n", __FUNCTION__,
+           s.periodTimeUs, s.smallBufferFrames, s.maxRate, s.maxChannels);
+    return isProbingChanged;
+}
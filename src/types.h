@@ -3,12 +3,17 @@
 
 typedef unsigned char           UINT8;
 typedef char                    INT8;
+typedef short                   INT16;
 #ifdef _LP64
 typedef int                     INT32;
+typedef unsigned int            UINT32;
 typedef long                    INT64;
+typedef unsigned long           UINT64;
 #else
 typedef long                    INT32;
+typedef unsigned long           UINT32;
 typedef long long               INT64;
+typedef unsigned long long      UINT64;
 #endif
 
 typedef unsigned long           UINT_PTR;